@@ -0,0 +1,220 @@
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <benchmark/benchmark.h>
+#include <PieceChain/PieceChain.h>
+
+// Workloads mirroring the real usage of piece chains.
+// The argument of each benchmark is the number of pieces the chain is made of (or the size of the file),
+// so that the cost of the operations can be followed as the chain gets fragmented.
+
+// The peak resident memory of the process never goes down on its own:
+// it is reset at the start of each benchmark, so that it does not report the peak of the previous ones
+static void reset_rss() {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd != -1) {
+        if (write(fd, "5", 1) != 1) {
+            perror("Cannot reset the peak RSS");
+        }
+        close(fd);
+    }
+}
+
+static void report_rss(benchmark::State& state) {
+    size_t peak = 0;
+    FILE* f = fopen("/proc/self/status", "r");
+    if (f != nullptr) {
+        char line[256];
+        while (fgets(line, sizeof(line), f) != nullptr && sscanf(line, "VmHWM: %zu kB", &peak) != 1);
+        fclose(f);
+    }
+    state.counters["peak_rss"] = benchmark::Counter((double) peak * 1024, benchmark::Counter::kDefaults, benchmark::Counter::OneK::kIs1024);
+}
+
+static std::string make_file(size_t size) {
+    std::string path = "bench-" + std::to_string(size) + ".txt";
+    std::vector<char> data(1024 * 1024);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = (char) ('a' + i % 26);
+    }
+    FILE* f = fopen(path.c_str(), "wb");
+    for (size_t written = 0; written < size; written += data.size()) {
+        fwrite(data.data(), 1, std::min(data.size(), size - written), f);
+    }
+    fclose(f);
+    return path;
+}
+
+// Overwrites single bytes at random, committing each of them, so that the chain ends up with about `pieces` pieces
+static void fragment(PieceChain_t* chain, size_t pieces, std::mt19937& rng) {
+    size_t size = piece_chain_size(chain);
+    for (size_t i = 0; i < pieces / 2; ++i) {
+        unsigned char c = (unsigned char) ('A' + rng() % 26);
+        piece_chain_replace(chain, rng() % size, &c, 1);
+        piece_chain_commit(chain);
+    }
+}
+
+static PieceChain_t* fragmented_chain(size_t pieces, std::mt19937& rng) {
+    PieceChain_t* chain = piece_chain_open(nullptr);
+    std::string base(std::max(pieces * 16, (size_t) 4096), 'x');
+    piece_chain_insert(chain, 0, (const unsigned char*) base.data(), base.size());
+    piece_chain_commit(chain);
+    fragment(chain, pieces, rng);
+    return chain;
+}
+
+static void BM_InsertSequential(benchmark::State& state) {
+    reset_rss();
+    size_t n = state.range(0);
+    for (auto _ : state) {
+        PieceChain_t* chain = piece_chain_open(nullptr);
+        for (size_t i = 0; i < n; ++i) {
+            unsigned char c = (unsigned char) ('a' + i % 26);
+            piece_chain_insert(chain, i, &c, 1);
+            piece_chain_commit(chain);
+        }
+        state.PauseTiming();
+        piece_chain_destroy(chain);
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+    report_rss(state);
+}
+BENCHMARK(BM_InsertSequential)->RangeMultiplier(8)->Range(1 << 8, 1 << 17)->Unit(benchmark::kMicrosecond);
+
+static void BM_InsertRandom(benchmark::State& state) {
+    reset_rss();
+    size_t n = state.range(0);
+    std::mt19937 rng(1);
+    for (auto _ : state) {
+        PieceChain_t* chain = piece_chain_open(nullptr);
+        for (size_t i = 0; i < n; ++i) {
+            unsigned char c = (unsigned char) ('a' + i % 26);
+            piece_chain_insert(chain, rng() % (i + 1), &c, 1);
+            piece_chain_commit(chain);
+        }
+        state.PauseTiming();
+        piece_chain_destroy(chain);
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+    report_rss(state);
+}
+BENCHMARK(BM_InsertRandom)->RangeMultiplier(8)->Range(1 << 8, 1 << 17)->Unit(benchmark::kMicrosecond);
+
+static void BM_DeleteRandom(benchmark::State& state) {
+    reset_rss();
+    size_t n = state.range(0);
+    std::mt19937 rng(2);
+    std::string base(2 * n, 'x');
+    for (auto _ : state) {
+        state.PauseTiming();
+        PieceChain_t* chain = piece_chain_open(nullptr);
+        piece_chain_insert(chain, 0, (const unsigned char*) base.data(), base.size());
+        piece_chain_commit(chain);
+        state.ResumeTiming();
+        for (size_t i = 0; i < n; ++i) {
+            piece_chain_delete(chain, rng() % (base.size() - i), 1);
+            piece_chain_commit(chain);
+        }
+        state.PauseTiming();
+        piece_chain_destroy(chain);
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+    report_rss(state);
+}
+BENCHMARK(BM_DeleteRandom)->RangeMultiplier(8)->Range(1 << 8, 1 << 17)->Unit(benchmark::kMicrosecond);
+
+static void BM_ReadByteSweep(benchmark::State& state) {
+    reset_rss();
+    std::mt19937 rng(3);
+    PieceChain_t* chain = fragmented_chain(state.range(0), rng);
+    size_t size = piece_chain_size(chain);
+    for (auto _ : state) {
+        unsigned int sum = 0;
+        for (size_t i = 0; i < size; ++i) {
+            unsigned char c;
+            piece_chain_read_byte(chain, i, &c);
+            sum += c;
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetBytesProcessed(state.iterations() * size);
+    report_rss(state);
+    piece_chain_destroy(chain);
+}
+BENCHMARK(BM_ReadByteSweep)->RangeMultiplier(8)->Range(1 << 4, 1 << 16)->Unit(benchmark::kMicrosecond);
+
+static void BM_VisitScan(benchmark::State& state) {
+    reset_rss();
+    std::mt19937 rng(4);
+    PieceChain_t* chain = fragmented_chain(state.range(0), rng);
+    size_t size = piece_chain_size(chain);
+    for (auto _ : state) {
+        unsigned int sum = 0;
+        piece_chain_visit(chain, 0, size, [](PieceChain_t*, size_t, const unsigned char* data, size_t len, void* user) {
+            for (size_t i = 0; i < len; ++i) {
+                *(unsigned int*) user += data[i];
+            }
+            return true;
+        }, &sum);
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetBytesProcessed(state.iterations() * size);
+    report_rss(state);
+    piece_chain_destroy(chain);
+}
+BENCHMARK(BM_VisitScan)->RangeMultiplier(8)->Range(1 << 4, 1 << 16)->Unit(benchmark::kMicrosecond);
+
+static void BM_Open(benchmark::State& state) {
+    reset_rss();
+    size_t size = state.range(0);
+    std::string path = make_file(size);
+    for (auto _ : state) {
+        PieceChain_t* chain = piece_chain_open(path.c_str());
+        unsigned char c;
+        piece_chain_read_byte(chain, size - 1, &c);
+        benchmark::DoNotOptimize(c);
+        piece_chain_destroy(chain);
+    }
+    state.SetBytesProcessed(state.iterations() * size);
+    report_rss(state);
+    unlink(path.c_str());
+}
+BENCHMARK(BM_Open)->RangeMultiplier(16)->Range(1 << 20, 1 << 28)->Unit(benchmark::kMicrosecond);
+
+static void BM_Save(benchmark::State& state) {
+    reset_rss();
+    PieceChainSaveMode mode = (PieceChainSaveMode) state.range(0);
+    size_t size = 16 << 20;
+    std::string path = make_file(size);
+    std::mt19937 rng(5);
+    PieceChain_t* chain = piece_chain_open(path.c_str());
+    fragment(chain, state.range(1), rng);
+    for (auto _ : state) {
+        if (!piece_chain_save(chain, path.c_str(), mode)) {
+            state.SkipWithError(piece_chain_last_error(chain)->message);
+            break;
+        }
+
+        // Incremental saves have nothing left to write once the file is up to date
+        state.PauseTiming();
+        fragment(chain, 2, rng);
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(state.iterations() * size);
+    report_rss(state);
+    piece_chain_destroy(chain);
+    unlink(path.c_str());
+}
+BENCHMARK(BM_Save)
+    ->ArgNames({ "mode", "pieces" })
+    ->ArgsProduct({ { SAVE_MODE_ATOMIC, SAVE_MODE_INPLACE, SAVE_MODE_INCREMENTAL }, { 1 << 4, 1 << 10, 1 << 16 } })
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,21 +16,201 @@ typedef struct PieceChain_t PieceChain_t;
 /** Opaque structure representing an iterator over the contents of a piece chain. */
 typedef struct PieceChainIterator_t PieceChainIterator_t;
 
+/** Opaque structure representing an immutable view of the contents of a piece chain. */
+typedef struct PieceChainSnapshot_t PieceChainSnapshot_t;
+
+/** Opaque structure keeping mapped the window of a windowed file holding a chunk returned by `piece_chain_chunk_at`. */
+typedef struct PieceChainPin_t PieceChainPin_t;
+
 /** Description of an error occurred during the processing of one of the operations on a piece chain. */
 typedef struct PieceChainError_t {
     const char* message;
     int err;
 } PieceChainError_t;
 
+/** Options controlling the behaviour of a piece chain. Fields left to zero get their default value. */
+typedef struct PieceChainOptions_t {
+
+    /** Size of the first memory block allocated to store new data. Defaults to 4KiB. */
+    size_t initial_block_size;
+
+    /** Every new memory block doubles the size of the previous one, up to this size. Defaults to 1MiB. */
+    size_t max_block_size;
+
+    /**
+     * Memory blocks of at least this size are allocated with an anonymous `mmap`
+     * and advised to be backed by huge pages. Defaults to 0, which disables this behaviour.
+     */
+    size_t mmap_threshold;
+
+    /**
+     * Keeps track of the position of newlines, to allow converting between line numbers and offsets
+     * in logarithmic time. Defaults to false.
+     */
+    bool line_index;
+
+    /**
+     * Files bigger than this are not mapped all at once: windows of this size (rounded up to 64KiB)
+     * are mapped only when read from, and unmapped when not used anymore. Defaults to 0, which maps whole files.
+     * Pointers to data from a windowed file returned by iterators stay valid until the next call on the iterator,
+     * and the ones returned by `piece_chain_chunk_at` as long as their pin, while `piece_chain_read_direct`
+     * never returns them. Saving over the file itself keeps mapped, on top of those,
+     * the windows holding the regions it overwrote, since their old contents are only in memory afterwards.
+     */
+    size_t window_size;
+
+    /** Maximum number of windows of a file kept mapped when not in use. Defaults to 64. */
+    size_t max_windows;
+
+    /**
+     * Maximum number of bytes of memory blocks holding inserted data. When a commit goes over the budget,
+     * the oldest revisions are dropped, and the blocks no longer referenced are released, until the chain fits again
+     * or no undo history is left. Defaults to 0, which keeps the whole history.
+     */
+    size_t history_budget;
+
+    /**
+     * Coalescing mode: commits do not create a new revision until the pending changes are `coalesce_ms` milliseconds old,
+     * or they have edited `coalesce_bytes` bytes, whichever comes first. Meanwhile, adjacent edits keep extending the same piece,
+     * so that streams of tiny edits cost a few pieces and revisions instead of one each. Either can be 0 to ignore that limit,
+     * and both default to 0, which disables coalescing. Undo, redo and `piece_chain_commit_now` always commit right away,
+     * and batches applied with `piece_chain_apply_edits` always get a revision of their own.
+     */
+    size_t coalesce_ms;
+    size_t coalesce_bytes;
+
+    /**
+     * Undo tree mode: editing after an undo starts a new branch of the history instead of discarding the redo history,
+     * and every revision stays reachable with `piece_chain_goto_revision`. Redo follows the branch visited last.
+     * Defaults to false.
+     */
+    bool undo_tree;
+
+} PieceChainOptions_t;
+
+/** Memory held by a piece chain, as returned by `piece_chain_stats`. */
+typedef struct PieceChainStats_t {
+    size_t heap_bytes; // Memory blocks holding inserted data
+    size_t heap_live_bytes; // Bytes of the memory blocks referenced by the current contents
+    size_t free_bytes; // Memory blocks not used anymore, kept for reuse
+    size_t mapped_bytes; // Files mapped in memory (for windowed files, only the windows currently mapped)
+    size_t buffer_bytes; // Buffers adopted by the chain
+    size_t shared_bytes; // Blocks shared with the chain this one has been cloned from
+    size_t bookkeeping_bytes; // Pieces, changes and revisions
+    size_t blocks;
+    size_t pieces; // Pieces making up the current contents
+    size_t total_pieces; // Pieces kept alive, including the ones referenced only by the history
+    size_t changes;
+    size_t revisions;
+    double fragmentation; // Fraction of `heap_bytes` not referenced by the current contents
+} PieceChainStats_t;
+
+/** A single edit of a batch: `delete_len` bytes at `offset` are replaced with the `len` bytes pointed by `data`. */
+typedef struct PieceChainEdit_t {
+    size_t offset;
+    size_t delete_len;
+    const unsigned char* data;
+    size_t len;
+} PieceChainEdit_t;
+
 enum PieceChainSaveMode {
     SAVE_MODE_AUTO = 0,
     SAVE_MODE_ATOMIC,
-    SAVE_MODE_INPLACE
+    SAVE_MODE_INPLACE,
+    SAVE_MODE_INCREMENTAL
+};
+
+/**
+ * Counters of the work done on the hot paths, as returned by `piece_chain_counters`.
+ * They are updated only if the library has been built with `PIECE_CHAIN_INSTRUMENTATION` defined,
+ * and stay zero otherwise.
+ */
+typedef struct PieceChainCounters_t {
+    uint64_t lookups; // Offsets looked up in the chain
+    uint64_t lookup_steps; // Pieces walked from the cursor and nodes of the index visited by the lookups
+    uint64_t cursor_hits; // Lookups resolved by walking from the cursor, without descending the index
+    uint64_t cache_hits; // Insertions appended to the cached piece
+    uint64_t cache_misses; // Insertions that needed new pieces
+    uint64_t blocks_allocated; // Memory blocks allocated, not counting the ones reused
+    uint64_t block_bytes; // Size of the memory blocks allocated
+    uint64_t bytes_written; // Bytes written or copied to files by the saves
+    uint64_t save_bytes[SAVE_MODE_INCREMENTAL + 1]; // Bytes written by each save mode (`SAVE_MODE_AUTO` counts as the mode used)
+    uint64_t fsyncs;
+    uint64_t fsync_ns; // Time spent in `fsync`
+    uint64_t renames;
+    uint64_t rename_ns; // Time spent in `rename`
+} PieceChainCounters_t;
+
+/** Kinds of the events reported to the tracing callback. */
+enum PieceChainTraceType {
+    TRACE_BLOCK_ALLOC = 0,
+    TRACE_SAVE,
+    TRACE_FSYNC,
+    TRACE_RENAME
+};
+
+/** An event reported to the tracing callback registered with `piece_chain_set_trace`. */
+typedef struct PieceChainTraceEvent_t {
+    enum PieceChainTraceType type;
+    enum PieceChainSaveMode mode; // For saves, the mode actually used
+    uint64_t duration_ns; // Time taken by saves, fsyncs and renames
+    size_t bytes; // Size of the block allocated, or bytes written by the save
+    bool success;
+} PieceChainTraceEvent_t;
+
+enum PieceChainAdvice {
+    ADVICE_NORMAL = 0,
+    ADVICE_SEQUENTIAL,
+    ADVICE_RANDOM,
+    ADVICE_WILLNEED,
+    ADVICE_DONTNEED
 };
 
 /** Creates a new PieceChain_t initialized with the contents of the given file. Pass NULL to create an empty piece chain. */
 PieceChain_t* piece_chain_open(const char* path);
 
+/** Same as `piece_chain_open`, but allows to customize the behaviour of the piece chain. `options` can be NULL. */
+PieceChain_t* piece_chain_open_ex(const char* path, const PieceChainOptions_t* options);
+
+/**
+ * Same as `piece_chain_open_ex`, but reads the contents from an already open file.
+ * The descriptor is duplicated, so the caller can close its own as soon as the function returns.
+ */
+PieceChain_t* piece_chain_open_fd(int fd, const PieceChainOptions_t* options);
+
+/**
+ * Creates a new PieceChain_t initialized with the contents of the given buffer, without copying it.
+ * The piece chain adopts the buffer, even if this function fails: the buffer must not be modified afterwards,
+ * and when it is not needed anymore `release` (if not NULL) is called to give it back.
+ * Since snapshots keep the buffer alive, `release` can be called from any thread. `options` can be NULL.
+ */
+PieceChain_t* piece_chain_open_buffer(
+    const unsigned char* data,
+    size_t len,
+    void (*release)(const unsigned char* data, size_t len, void* user),
+    void* user,
+    const PieceChainOptions_t* options
+);
+
+/**
+ * Same as `piece_chain_open_ex`, but keeps a journal of the changes in the file at path `journal`,
+ * so that a chain opened again after a crash picks up from the last commit, undo history included.
+ * If the journal already exists, its changes are replayed over the contents of `path`, which must not have
+ * changed since the journal was started. Every commit, undo and redo is appended to the journal,
+ * undo and redo as the edits they make (after a replay, they are part of the history like any other edit).
+ * A successful save restarts the journal from the file just written, which is the one to reopen it with.
+ * If the journal cannot be restarted, the save fails and the chain stops journaling.
+ * The journal is not synced to disk: it survives crashes of the application, not of the system.
+ */
+PieceChain_t* piece_chain_open_with_journal(const char* path, const char* journal, const PieceChainOptions_t* options);
+
+/**
+ * Creates a new piece chain with the same contents of the given one, but without its history.
+ * The clone shares the data of the original chain, copying only the pieces, so it costs O(#pieces)
+ * and next to no memory. Both chains can then be modified and destroyed independently.
+ */
+PieceChain_t* piece_chain_clone(PieceChain_t*);
+
 /** Destroys a piece chain and releases all the resources held. */
 void piece_chain_destroy(PieceChain_t*);
 
@@ -39,12 +220,46 @@ size_t piece_chain_size(PieceChain_t*);
 /** Returns whether the contents of this piece chain have been modified or not since last save. */
 bool piece_chain_dirty(PieceChain_t*);
 
+/** Fills `*out` with the memory currently held by the piece chain. Takes time linear in the number of pieces. */
+void piece_chain_stats(PieceChain_t*, PieceChainStats_t* out);
+
+/** Fills `*out` with the instrumentation counters of the piece chain, including the ones of the completed background saves. */
+void piece_chain_counters(PieceChain_t*, PieceChainCounters_t* out);
+
+/** Sets all the instrumentation counters of the piece chain back to zero. */
+void piece_chain_counters_reset(PieceChain_t*);
+
+/**
+ * Registers a callback called synchronously on the thread using the chain for each block allocated,
+ * save, `fsync` and `rename`, for example to forward them to a metrics system. Pass NULL to remove it.
+ * Saves started with `piece_chain_save_async` report their events from the background thread, as the chain they belong to,
+ * possibly at the same time as the thread using the chain: while they are running, the callback must be thread-safe.
+ * Changing or removing the callback waits for the background saves to complete, so that they never call the old one afterwards.
+ * Like the counters, events are reported only if the library has been built with `PIECE_CHAIN_INSTRUMENTATION`.
+ */
+void piece_chain_set_trace(PieceChain_t*, void (*trace)(PieceChain_t*, const PieceChainTraceEvent_t* event, void* user), void* user);
+
 /** Returns a string containing a human-readable description of the last error in case a function fails. */
 PieceChainError_t* piece_chain_last_error(PieceChain_t*);
 
-/** Saves the contents of a piece chain to a file. */
+/** Saves the contents of a piece chain to a file, after waiting for the saves running in the background. */
 bool piece_chain_save(PieceChain_t*, const char* path, enum PieceChainSaveMode);
 
+/**
+ * Saves the current contents of a piece chain like `SAVE_MODE_ATOMIC` does, but on a background thread,
+ * while the chain can keep being edited. Capturing the contents costs O(#pieces), like a snapshot.
+ * When the save completes, `done` is called on the background thread, with the error if it failed:
+ * it must not use the chain, which might be in use by other threads. Once saved, the chain is not dirty anymore,
+ * unless it has been edited after `piece_chain_save_async` has been called.
+ * Destroying the chain waits for the saves still running. Chains with a journal cannot be saved this way.
+ */
+bool piece_chain_save_async(
+    PieceChain_t*,
+    const char* path,
+    void (*done)(PieceChain_t*, bool success, const PieceChainError_t* error, void* user),
+    void* user
+);
+
 /** Inserts a string at the given offset. */
 bool piece_chain_insert(PieceChain_t*, size_t offset, const unsigned char* data, size_t len);
 
@@ -54,18 +269,122 @@ bool piece_chain_delete(PieceChain_t*, size_t offset, size_t len);
 /** Replaces a string with another. */
 bool piece_chain_replace(PieceChain_t*, size_t offset, const unsigned char* data, size_t len);
 
+/**
+ * Applies a batch of edits in a single pass over the chain, recording them as a single revision.
+ * Offsets refer to the contents before the batch is applied, so the edits can be given in any order,
+ * but the deleted ranges must not overlap. Edits at the same offset are applied in the order they are given.
+ * Any pending change is committed first, in a revision of its own, even if the batch then fails.
+ * A failed batch leaves the contents and the history as they were.
+ */
+bool piece_chain_apply_edits(PieceChain_t*, const PieceChainEdit_t* edits, size_t n);
+
 /** Commits any pending change in a new revision, snapshotting the current status. */
 bool piece_chain_commit(PieceChain_t*);
 
+/** Same as `piece_chain_commit`, but in coalescing mode commits right away instead of waiting for the group to be complete. */
+bool piece_chain_commit_now(PieceChain_t*);
+
 /** Undoes a recent modification. `*pos` contains the location of the last change, if the contents of the piece chain changed. */
 bool piece_chain_undo(PieceChain_t*, size_t* pos);
 
 /** Redoes an undone modification. `*pos` contains the location of the last change, if the contents of the piece chain changed. */
 bool piece_chain_redo(PieceChain_t*, size_t* pos);
 
+/**
+ * Returns the identifier of the current revision, which does not include the changes not committed yet.
+ * Identifiers are never reused by a chain, and stay valid until the revision is discarded.
+ */
+uint64_t piece_chain_revision(PieceChain_t*);
+
+/** Returns the identifier of the revision the given one has been committed over, or 0 if there is none. */
+uint64_t piece_chain_revision_parent(PieceChain_t*, uint64_t id);
+
+/**
+ * Brings the contents of the chain to the given revision, undoing and redoing only the revisions
+ * between the current one and the target, up to their common ancestor. The target becomes the one redo leads to.
+ * `*pos` contains the location of the last change, if the contents of the piece chain changed.
+ */
+bool piece_chain_goto_revision(PieceChain_t*, uint64_t id, size_t* pos);
+
+/**
+ * Merges runs of adjacent pieces shorter than `threshold` bytes into new contiguous pieces,
+ * so that long editing sessions do not slow down lookups and reads. Pass 0 to use a default threshold.
+ * The contents do not change, but any redo history is discarded. In undo tree mode no branch is discarded:
+ * if the current revision has children, the merges are recorded in a new child revision,
+ * whose undo leaves the contents as they are.
+ * If `discard_history` is true, the undo history is dropped too, releasing the pieces it references
+ * and the memory blocks not needed anymore.
+ * This is meant to be called when the application is idle.
+ */
+bool piece_chain_compact(PieceChain_t*, size_t threshold, bool discard_history);
+
 /** Reads a single byte from the piece chain. */
 bool piece_chain_read_byte(PieceChain_t*, size_t offset, unsigned char* out);
 
+/** Copies up to `len` bytes starting at `offset` to `buf`. Returns the number of bytes copied. */
+size_t piece_chain_read(PieceChain_t*, size_t offset, unsigned char* buf, size_t len);
+
+/**
+ * If the `len` bytes starting at `offset` are stored contiguously, stores in `*out` a pointer to them and returns `true`.
+ * The pointer is valid until the piece chain is modified. Fails on data still backed by a windowed file,
+ * since nothing would keep its window mapped: use `piece_chain_chunk_at` or `piece_chain_read` instead.
+ */
+bool piece_chain_read_direct(PieceChain_t*, size_t offset, size_t len, const unsigned char** out);
+
+/**
+ * Looks up the contiguous chunk of data containing the byte at `offset`.
+ * On success, `*data` points to the beginning of the chunk, `*start` is the offset of its first byte and `*len` its length.
+ * The pointer is valid until the piece chain is modified. If the chunk comes from a windowed file, `*pin` receives a reference
+ * keeping its window mapped, to be dropped with `piece_chain_pin_unref`, otherwise NULL.
+ * `pin` can be NULL if the chain has no windowed file, and then chunks of windowed files make the call fail.
+ */
+bool piece_chain_chunk_at(PieceChain_t*, size_t offset, const unsigned char** data, size_t* start, size_t* len, PieceChainPin_t** pin);
+
+/** Adds a reference to a pin, so that its window stays mapped until every reference is dropped. Accepts NULL. */
+PieceChainPin_t* piece_chain_pin_ref(PieceChainPin_t*);
+
+/** Drops a reference to a pin. Pins can outlive the chain they come from. Accepts NULL. */
+void piece_chain_pin_unref(PieceChainPin_t*);
+
+/**
+ * Tells the kernel how the given section of the piece chain is going to be accessed.
+ * Only the parts of the section still backed by the file the chain has been opened from are affected.
+ * Saves and parallel visits advise sequential access on their own, and reset the hints to normal when they are done.
+ */
+bool piece_chain_advise(PieceChain_t*, size_t offset, size_t len, enum PieceChainAdvice);
+
+/**
+ * Finds the first occurrence of `pattern` starting at or after `from`, and stores its offset in `*out`.
+ * Returns `false` if there is no such occurrence.
+ */
+bool piece_chain_find(PieceChain_t*, size_t from, const unsigned char* pattern, size_t len, size_t* out);
+
+/**
+ * Finds the last occurrence of `pattern` starting at or before `from`, and stores its offset in `*out`.
+ * Returns `false` if there is no such occurrence.
+ */
+bool piece_chain_rfind(PieceChain_t*, size_t from, const unsigned char* pattern, size_t len, size_t* out);
+
+/**
+ * Finds the first occurrence of any of the `n` given patterns starting at or after `from`.
+ * The offset of the occurrence is stored in `*out`, and the index of the pattern in `*which`.
+ * If more patterns occur at the same offset, the first one in the list is reported.
+ * Returns `false` if none of the patterns occurs.
+ */
+bool piece_chain_find_any(PieceChain_t*, size_t from, const unsigned char* const* patterns, const size_t* lens, size_t n, size_t* out, size_t* which);
+
+/**
+ * Stores in `*out` the offset of the first byte of the given line (starting from 0).
+ * Requires the `line_index` option. Returns `false` if the line does not exist.
+ */
+bool piece_chain_line_to_offset(PieceChain_t*, size_t line, size_t* out);
+
+/**
+ * Stores in `*out` the line (starting from 0) containing the given offset, which is the number of newlines before it.
+ * Requires the `line_index` option. Returns `false` if the offset is past the end of the piece chain.
+ */
+bool piece_chain_offset_to_line(PieceChain_t*, size_t offset, size_t* out);
+
 /**
  * Visits a portion of the contents of this piece chain.
  * The visitor function may be called more than once with different fragments of contents.
@@ -78,6 +397,25 @@ bool piece_chain_visit(
     void* user
 );
 
+/**
+ * Visits a portion of the contents of a piece chain using multiple threads.
+ * The range is split in up to `chunks` parts of roughly the same size, preferably cut at piece boundaries
+ * (pass 0 to use one chunk per CPU), which are visited in parallel: `visitor` receives the index of the chunk
+ * the fragment belongs to, and fragments of the same chunk are visited in order by the same thread.
+ * When all the chunks have been visited, `reduce` (if not NULL) is called on the calling thread
+ * for each non-empty chunk in order, to combine the per-chunk results.
+ * The piece chain must not be modified during the visit.
+ */
+bool piece_chain_visit_parallel(
+    PieceChain_t*,
+    size_t start,
+    size_t len,
+    size_t chunks,
+    bool (*visitor)(PieceChain_t*, size_t chunk, size_t offset, const unsigned char* data, size_t len, void* user),
+    bool (*reduce)(PieceChain_t*, size_t chunk, void* user),
+    void* user
+);
+
 /**
  * Returns an iterator over the given section of a piece chain.
  * Altering the contents of the piece chain while an iterator is open will result in undefined behaviour.
@@ -95,9 +433,60 @@ PieceChainIterator_t* piece_chain_iter_clone(PieceChainIterator_t*);
  */
 bool piece_chain_iter_next(PieceChainIterator_t*, const unsigned char** data, size_t* len);
 
+/**
+ * Moves the iterator backwards from the end of its section.
+ * Returns `true` if there's more data to read, and `*data` and `*len` will contain the last fragment not yet returned.
+ * Returns `false` and does not alter the pointers if no more data is available.
+ * Calls to `next` and `prev` can be mixed: they consume the section from opposite ends, and they never return the same byte twice.
+ */
+bool piece_chain_iter_prev(PieceChainIterator_t*, const unsigned char** data, size_t* len);
+
 /** Releases all the resources held by the given iterator. */
 void piece_chain_iter_free(PieceChainIterator_t*);
 
+/**
+ * Takes a snapshot of the current contents of a piece chain.
+ * A snapshot never changes, and can be read from any number of threads while the chain keeps being edited,
+ * even after the chain has been destroyed. Creating a snapshot costs O(#pieces).
+ * The returned snapshot has a reference count of 1.
+ */
+PieceChainSnapshot_t* piece_chain_snapshot(PieceChain_t*);
+
+/** Increments the reference count of a snapshot. Can be called from any thread. */
+PieceChainSnapshot_t* piece_chain_snapshot_ref(PieceChainSnapshot_t*);
+
+/** Decrements the reference count of a snapshot, releasing it when it drops to zero. Can be called from any thread. */
+void piece_chain_snapshot_unref(PieceChainSnapshot_t*);
+
+/** Returns the size in bytes of the contents of a snapshot. */
+size_t piece_chain_snapshot_size(const PieceChainSnapshot_t*);
+
+/** Reads a single byte from a snapshot. */
+bool piece_chain_snapshot_read_byte(const PieceChainSnapshot_t*, size_t offset, unsigned char* out);
+
+/** Visits a portion of the contents of a snapshot, like `piece_chain_visit` does. */
+bool piece_chain_snapshot_visit(
+    const PieceChainSnapshot_t*,
+    size_t start,
+    size_t len,
+    bool (*visitor)(const PieceChainSnapshot_t*, size_t offset, const unsigned char* data, size_t len, void* user),
+    void* user
+);
+
+/**
+ * Compares two snapshots, calling `visitor` for each range of bytes that differs between them, in order:
+ * the `a_len` bytes at `a_offset` in `a` have been replaced by the `b_len` bytes at `b_offset` in `b`.
+ * Pieces shared by the two snapshots, as between two revisions of the same chain or between a chain and its clones,
+ * are skipped without looking at their contents, so that only the data that actually changed is compared.
+ * Returns false if the visitor stopped the comparison by returning false, or on error.
+ */
+bool piece_chain_snapshot_diff(
+    const PieceChainSnapshot_t* a,
+    const PieceChainSnapshot_t* b,
+    bool (*visitor)(size_t a_offset, size_t a_len, size_t b_offset, size_t b_len, void* user),
+    void* user
+);
+
 
 #ifdef __cplusplus
 }
@@ -2,9 +2,21 @@
 #define __PIECE_CHAIN_HPP__
 
 #include <string>
+#include <string_view>
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <future>
 #include <cstring>
 #include <iostream>
+#include <initializer_list>
+#include <iterator>
+#include <mutex>
 #include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include "PieceChain/PieceChain.h"
 
@@ -12,14 +24,31 @@ namespace piece_chain {
 
 
 
+/** Options controlling the behaviour of a `PieceChain`. Fields left to zero get their default value. */
+using PieceChainOptions = PieceChainOptions_t;
+
+/** A single edit of a batch: `delete_len` bytes at `offset` are replaced with the `len` bytes pointed by `data`. */
+using PieceChainEdit = PieceChainEdit_t;
+
+/** Memory held by a `PieceChain`. */
+using PieceChainStats = PieceChainStats_t;
+
+/** Counters of the work done on the hot paths, updated only if the library is built with `PIECE_CHAIN_INSTRUMENTATION`. */
+using PieceChainCounters = PieceChainCounters_t;
+
+/** An event reported to the tracing callback of a `PieceChain`. */
+using PieceChainTraceEvent = PieceChainTraceEvent_t;
+
+
+
 class PieceChainException : public std::runtime_error {
 public:
 
     PieceChainException(const PieceChainError_t* e)
-        : std::runtime_error(nullptr)
+        : std::runtime_error("PieceChain error")
     {
         constexpr size_t s = sizeof(_what) / sizeof(_what[0]);
-        snprintf(_what, s, "%s: %s.", e->message, strerror(e->err));
+        snprintf(_what, s, "%s: %s.", e->message != nullptr ? e->message : "Error", strerror(e->err));
         _what[s - 1] = '\0';
     }
 
@@ -53,13 +82,45 @@ enum class SaveMode {
      * If possible, use the `Atomic` mode, since the `InPlace` mode has the disadvantage of
      * possibly causing data loss in case of I/O error.
      */
-    InPlace = SAVE_MODE_INPLACE
+    InPlace = SAVE_MODE_INPLACE,
+
+    /**
+     * Like `InPlace`, but if the destination is the file the chain has been opened from
+     * and its size did not change, only the modified regions are written back.
+     * Falls back to `InPlace` in all the other cases.
+     */
+    Incremental = SAVE_MODE_INCREMENTAL
+
+};
+
+/** How a section of a `PieceChain` is going to be accessed. */
+enum class Advice {
+
+    /** No particular pattern: the default. */
+    Normal = ADVICE_NORMAL,
+
+    /** Data will be read in order: read ahead aggressively, and drop the pages already read sooner. */
+    Sequential = ADVICE_SEQUENTIAL,
+
+    /** Data will be read in random order: do not read ahead. */
+    Random = ADVICE_RANDOM,
+
+    /** Data will be read soon: start reading it ahead now. */
+    WillNeed = ADVICE_WILLNEED,
+
+    /** Data will not be read anytime soon: its pages can be released. */
+    DontNeed = ADVICE_DONTNEED
 
 };
 
 
 
-class PieceChainIterator {
+/**
+ * Iterator over the fragments of a section of a piece chain.
+ * A `Reverse` iterator walks the fragments backwards, starting from the end of the section.
+ */
+template <bool Reverse>
+class BasicPieceChainIterator {
 public:
     using iterator_category = std::output_iterator_tag;
     using value_type = const std::pair<const unsigned char*, size_t>;
@@ -67,12 +128,12 @@ public:
     using pointer = const std::pair<const unsigned char*, size_t>*;
     using reference = const std::pair<const unsigned char*, size_t>&;
 
-    PieceChainIterator(PieceChain_t* chain)
-        : PieceChainIterator(chain, nullptr)
+    BasicPieceChainIterator(PieceChain_t* chain)
+        : BasicPieceChainIterator(chain, nullptr)
     {
     }
 
-    PieceChainIterator(PieceChain_t* chain, PieceChainIterator_t* ptr)
+    BasicPieceChainIterator(PieceChain_t* chain, PieceChainIterator_t* ptr)
         : _chain(chain),
           _ptr(ptr)
     {
@@ -82,13 +143,13 @@ public:
         }
     }
 
-    ~PieceChainIterator() {
+    ~BasicPieceChainIterator() {
         destroy();
     }
 
     // Copy constructor and assignment
 
-    PieceChainIterator(const PieceChainIterator& other) {
+    BasicPieceChainIterator(const BasicPieceChainIterator& other) {
         PieceChainIterator_t* clone = nullptr;
         if (other._ptr != nullptr) {
             clone = piece_chain_iter_clone(other._ptr);
@@ -102,7 +163,7 @@ public:
         _currentData = other._currentData;
     }
 
-    PieceChainIterator& operator=(const PieceChainIterator& other) {
+    BasicPieceChainIterator& operator=(const BasicPieceChainIterator& other) {
         destroy();
 
         PieceChainIterator_t* clone = nullptr;
@@ -116,17 +177,18 @@ public:
         _chain = other._chain;
         _ptr = clone;
         _currentData = other._currentData;
+        return *this;
     }
 
     // Movable
-    PieceChainIterator(PieceChainIterator&&) = default;
-    PieceChainIterator& operator=(PieceChainIterator&&) = default;
+    BasicPieceChainIterator(BasicPieceChainIterator&&) = default;
+    BasicPieceChainIterator& operator=(BasicPieceChainIterator&&) = default;
 
-    bool operator==(const PieceChainIterator& other) const {
+    bool operator==(const BasicPieceChainIterator& other) const {
         return _ptr == other._ptr;
     }
 
-    bool operator!=(const PieceChainIterator& other) const {
+    bool operator!=(const BasicPieceChainIterator& other) const {
         return _ptr != other._ptr;
     }
     
@@ -138,11 +200,11 @@ public:
         return &_currentData;
     }
 
-    PieceChainIterator& operator++() {
+    BasicPieceChainIterator& operator++() {
         if (_ptr != nullptr) {
             const unsigned char* data;
             size_t len;
-            if (piece_chain_iter_next(_ptr, &data, &len)) {
+            if (Reverse ? piece_chain_iter_prev(_ptr, &data, &len) : piece_chain_iter_next(_ptr, &data, &len)) {
                 _currentData = std::make_pair(data, len);
             } else {
                 destroy();
@@ -151,8 +213,8 @@ public:
         return *this;
     }
 
-    PieceChainIterator operator++(int) {
-        PieceChainIterator tmp(*this);
+    BasicPieceChainIterator operator++(int) {
+        BasicPieceChainIterator tmp(*this);
         ++(*this);
         return tmp;
     }
@@ -170,6 +232,325 @@ private:
     }
 };
 
+using PieceChainIterator = BasicPieceChainIterator<false>;
+using PieceChainReverseIterator = BasicPieceChainIterator<true>;
+
+
+
+/**
+ * Random access iterator over the single bytes of a piece chain.
+ * The chunk containing the current byte is cached, so that stepping inside it costs as much as
+ * stepping over a raw array, while jumping elsewhere costs a lookup in the piece index.
+ * Altering the contents of the piece chain invalidates the iterator.
+ * On windowed files, the window holding the cached chunk stays mapped as long as the iterator, or any copy of it, is alive.
+ */
+class PieceChainByteIterator {
+public:
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = unsigned char;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const unsigned char*;
+    using reference = const unsigned char&;
+
+    PieceChainByteIterator()
+        : PieceChainByteIterator(nullptr, 0)
+    {
+    }
+
+    PieceChainByteIterator(PieceChain_t* chain, size_t offset)
+        : _chain(chain),
+          _offset(offset)
+    {
+    }
+
+    ~PieceChainByteIterator() {
+        unpin();
+    }
+
+    PieceChainByteIterator(const PieceChainByteIterator& other)
+        : _chain(other._chain),
+          _offset(other._offset),
+          _data(other._data),
+          _start(other._start),
+          _len(other._len),
+          _pin(other._pin ? piece_chain_pin_ref(other._pin) : nullptr)
+    {
+    }
+
+    PieceChainByteIterator& operator=(const PieceChainByteIterator& other) {
+        if (this != &other) {
+            unpin();
+            _chain = other._chain;
+            _offset = other._offset;
+            _data = other._data;
+            _start = other._start;
+            _len = other._len;
+            _pin = other._pin ? piece_chain_pin_ref(other._pin) : nullptr;
+        }
+        return *this;
+    }
+
+    PieceChainByteIterator(PieceChainByteIterator&& other)
+        : _chain(other._chain),
+          _offset(other._offset),
+          _data(other._data),
+          _start(other._start),
+          _len(other._len),
+          _pin(other._pin)
+    {
+        other._len = 0;
+        other._pin = nullptr;
+    }
+
+    PieceChainByteIterator& operator=(PieceChainByteIterator&& other) {
+        std::swap(_chain, other._chain);
+        std::swap(_offset, other._offset);
+        std::swap(_data, other._data);
+        std::swap(_start, other._start);
+        std::swap(_len, other._len);
+        std::swap(_pin, other._pin);
+        return *this;
+    }
+
+    /** Offset of the byte this iterator refers to. */
+    size_t offset() const {
+        return _offset;
+    }
+
+    reference operator*() const {
+        // Unsigned arithmetic makes offsets before the chunk wrap around and fail the check too
+        if (_offset - _start >= _len) {
+            load();
+        }
+        return _data[_offset - _start];
+    }
+
+    pointer operator->() const {
+        return &**this;
+    }
+
+    reference operator[](difference_type n) const {
+        return *(*this + n);
+    }
+
+    PieceChainByteIterator& operator++() {
+        ++_offset;
+        return *this;
+    }
+
+    PieceChainByteIterator operator++(int) {
+        PieceChainByteIterator tmp(*this);
+        ++_offset;
+        return tmp;
+    }
+
+    PieceChainByteIterator& operator--() {
+        --_offset;
+        return *this;
+    }
+
+    PieceChainByteIterator operator--(int) {
+        PieceChainByteIterator tmp(*this);
+        --_offset;
+        return tmp;
+    }
+
+    PieceChainByteIterator& operator+=(difference_type n) {
+        _offset += n;
+        return *this;
+    }
+
+    PieceChainByteIterator& operator-=(difference_type n) {
+        _offset -= n;
+        return *this;
+    }
+
+    PieceChainByteIterator operator+(difference_type n) const {
+        PieceChainByteIterator tmp(*this);
+        return tmp += n;
+    }
+
+    friend PieceChainByteIterator operator+(difference_type n, const PieceChainByteIterator& it) {
+        return it + n;
+    }
+
+    PieceChainByteIterator operator-(difference_type n) const {
+        PieceChainByteIterator tmp(*this);
+        return tmp -= n;
+    }
+
+    difference_type operator-(const PieceChainByteIterator& other) const {
+        return (difference_type) (_offset - other._offset);
+    }
+
+    bool operator==(const PieceChainByteIterator& other) const { return _offset == other._offset; }
+    bool operator!=(const PieceChainByteIterator& other) const { return _offset != other._offset; }
+    bool operator<(const PieceChainByteIterator& other) const { return _offset < other._offset; }
+    bool operator>(const PieceChainByteIterator& other) const { return _offset > other._offset; }
+    bool operator<=(const PieceChainByteIterator& other) const { return _offset <= other._offset; }
+    bool operator>=(const PieceChainByteIterator& other) const { return _offset >= other._offset; }
+
+private:
+    PieceChain_t* _chain;
+    size_t _offset;
+    mutable const unsigned char* _data = nullptr;
+    mutable size_t _start = 0;
+    mutable size_t _len = 0;
+    mutable PieceChainPin_t* _pin = nullptr; // Keeps the window of the cached chunk mapped, on windowed files
+
+    void load() const {
+        unpin();
+        if (!piece_chain_chunk_at(_chain, _offset, &_data, &_start, &_len, &_pin)) {
+            throw std::runtime_error("Out of bounds.");
+        }
+    }
+
+    void unpin() const {
+        if (_pin != nullptr) {
+            piece_chain_pin_unref(_pin);
+            _pin = nullptr;
+        }
+        _len = 0;
+    }
+};
+
+/** A range over the bytes of a section of a piece chain, usable with range-based for loops and the standard algorithms. */
+class PieceChainBytes {
+public:
+    using iterator = PieceChainByteIterator;
+    using const_iterator = PieceChainByteIterator;
+    using reverse_iterator = std::reverse_iterator<PieceChainByteIterator>;
+
+    PieceChainBytes(PieceChain_t* chain, size_t start, size_t end)
+        : _begin(chain, start),
+          _end(chain, end)
+    {
+    }
+
+    iterator begin() const { return _begin; }
+    iterator end() const { return _end; }
+    reverse_iterator rbegin() const { return reverse_iterator(_end); }
+    reverse_iterator rend() const { return reverse_iterator(_begin); }
+    size_t size() const { return _end.offset() - _begin.offset(); }
+    bool empty() const { return _begin == _end; }
+
+private:
+    PieceChainByteIterator _begin;
+    PieceChainByteIterator _end;
+};
+
+
+
+/**
+ * Immutable view of the contents of a `PieceChain` at a given moment.
+ * Snapshots are cheap to copy, can be read from any thread while the chain keeps being edited,
+ * and stay valid even after the chain they come from has been destroyed.
+ */
+class Snapshot {
+public:
+
+    explicit Snapshot(PieceChainSnapshot_t* ptr)
+        : _ptr(ptr)
+    {
+    }
+
+    ~Snapshot() {
+        piece_chain_snapshot_unref(_ptr);
+    }
+
+    Snapshot(const Snapshot& other)
+        : _ptr(other._ptr ? piece_chain_snapshot_ref(other._ptr) : nullptr)
+    {
+    }
+
+    Snapshot& operator=(const Snapshot& other) {
+        if (this != &other) {
+            piece_chain_snapshot_unref(_ptr);
+            _ptr = other._ptr ? piece_chain_snapshot_ref(other._ptr) : nullptr;
+        }
+        return *this;
+    }
+
+    Snapshot(Snapshot&& other)
+        : _ptr(other._ptr)
+    {
+        other._ptr = nullptr;
+    }
+
+    Snapshot& operator=(Snapshot&& other) {
+        std::swap(_ptr, other._ptr);
+        return *this;
+    }
+
+    /** Returns the size (in bytes) of the data in this snapshot. */
+    inline size_t size() const {
+        return piece_chain_snapshot_size(_ptr);
+    }
+
+    /** Returns a boolean value indicating whether or not this snapshot contains any data. */
+    inline bool empty() const {
+        return size() == 0;
+    }
+
+    /** Returns the byte at the given offset. */
+    inline unsigned char at(size_t offset) const {
+        unsigned char out;
+        if (piece_chain_snapshot_read_byte(_ptr, offset, &out)) {
+            return out;
+        } else {
+            throw std::runtime_error("Out of bounds.");
+        }
+    }
+
+    /**
+     * Calls `fn(data, len)` for each fragment of the given section of the snapshot.
+     * If `fn` returns `false`, the visit stops.
+     */
+    template<typename F>
+    inline void visit(size_t start, size_t len, F&& fn) const {
+        piece_chain_snapshot_visit(_ptr, start, len, [](const PieceChainSnapshot_t*, size_t, const unsigned char* data, size_t len, void* user) {
+            if constexpr (std::is_same_v<decltype((*(F*) user)(data, len)), void>) {
+                (*(F*) user)(data, len);
+                return true;
+            } else {
+                return (bool) (*(F*) user)(data, len);
+            }
+        }, &fn);
+    }
+
+    /**
+     * Calls `fn(offset, len, other_offset, other_len)` for each range of this snapshot replaced in `other`.
+     * Data shared by the two snapshots is skipped without being compared. If `fn` returns `false`, the comparison stops.
+     */
+    template<typename F>
+    inline void diff(const Snapshot& other, F&& fn) const {
+        piece_chain_snapshot_diff(_ptr, other._ptr, [](size_t a_offset, size_t a_len, size_t b_offset, size_t b_len, void* user) {
+            if constexpr (std::is_same_v<decltype((*(F*) user)(a_offset, a_len, b_offset, b_len)), void>) {
+                (*(F*) user)(a_offset, a_len, b_offset, b_len);
+                return true;
+            } else {
+                return (bool) (*(F*) user)(a_offset, a_len, b_offset, b_len);
+            }
+        }, &fn);
+    }
+
+    /** Returns the underlying `PieceChainSnapshot_t`. */
+    inline PieceChainSnapshot_t* get() const {
+        return _ptr;
+    }
+
+private:
+    PieceChainSnapshot_t* _ptr;
+};
+
+/** Writes the contents of the given `Snapshot` to the given stream. */
+inline static std::ostream& operator<<(std::ostream& stream, const Snapshot& snapshot) {
+    snapshot.visit(0, snapshot.size(), [&](const unsigned char* data, size_t len) {
+        stream.write((const char*) data, len);
+    });
+    return stream;
+}
+
 
 
 /**
@@ -191,6 +572,64 @@ public:
         }
     }
 
+    inline explicit PieceChain(const PieceChainOptions& options) {
+        if ((_ptr = piece_chain_open_ex(nullptr, &options)) == nullptr) {
+            throw std::system_error(errno, std::generic_category());
+        }
+    }
+
+    inline PieceChain(const std::string& path, const PieceChainOptions& options) {
+        if ((_ptr = piece_chain_open_ex(path.c_str(), &options)) == nullptr) {
+            throw std::system_error(errno, std::generic_category());
+        }
+    }
+
+    /** Opens the file referred to by the given descriptor. The descriptor is duplicated, not taken over. */
+    inline static PieceChain from_fd(int fd, const PieceChainOptions& options = {}) {
+        if (auto ptr = piece_chain_open_fd(fd, &options); ptr != nullptr) {
+            return PieceChain(ptr);
+        } else {
+            throw std::system_error(errno, std::generic_category());
+        }
+    }
+
+    /**
+     * Uses the given buffer as the initial contents, without copying it.
+     * `release` is called when the buffer is not needed anymore, possibly from another thread.
+     */
+    inline static PieceChain from_buffer(const unsigned char* data, size_t len, std::function<void()> release, const PieceChainOptions& options = {}) {
+        auto fn = new std::function<void()>(std::move(release));
+        auto ptr = piece_chain_open_buffer(data, len, [](const unsigned char*, size_t, void* user) {
+            auto fn = (std::function<void()>*) user;
+            if (*fn) {
+                (*fn)();
+            }
+            delete fn;
+        }, fn, &options);
+        if (ptr == nullptr) {
+            throw std::system_error(errno, std::generic_category());
+        }
+        return PieceChain(ptr);
+    }
+
+    /** Uses the given string as the initial contents, without copying it. */
+    inline static PieceChain from_buffer(std::string buffer, const PieceChainOptions& options = {}) {
+        auto str = new std::string(std::move(buffer));
+        return from_buffer((const unsigned char*) str->data(), str->size(), [str]() { delete str; }, options);
+    }
+
+    /**
+     * Opens the given file (or an empty chain, if `path` is empty) keeping a journal of the changes in `journal`.
+     * Opening it again after a crash replays the journal, so that nothing committed is lost.
+     */
+    inline static PieceChain with_journal(const std::string& path, const std::string& journal, const PieceChainOptions& options = {}) {
+        if (auto ptr = piece_chain_open_with_journal(path.empty() ? nullptr : path.c_str(), journal.c_str(), &options); ptr != nullptr) {
+            return PieceChain(ptr);
+        } else {
+            throw std::system_error(errno, std::generic_category());
+        }
+    }
+
     inline ~PieceChain() {
         piece_chain_destroy(_ptr);
     }
@@ -200,8 +639,31 @@ public:
     PieceChain& operator=(const PieceChain&) = delete;
 
     // Movable
-    PieceChain(PieceChain&&) = default;
-    PieceChain& operator=(PieceChain&&) = default;
+    PieceChain(PieceChain&& other) noexcept
+        : _ptr(std::exchange(other._ptr, nullptr))
+    {
+    }
+
+    PieceChain& operator=(PieceChain&& other) noexcept {
+        if (this != &other) {
+            piece_chain_destroy(_ptr);
+            _ptr = std::exchange(other._ptr, nullptr);
+        }
+        return *this;
+    }
+
+    /**
+     * Returns a new `PieceChain` with the same contents (but not the history) of this one.
+     * The two chains share the data, so cloning costs only the copy of the pieces.
+     */
+    inline PieceChain clone() const {
+        if (auto ptr = piece_chain_clone(_ptr); ptr != nullptr) {
+            return PieceChain(ptr);
+        } else {
+            auto e = piece_chain_last_error(_ptr);
+            throw PieceChainException(e);
+        }
+    }
 
     /** Returns the size (in bytes) of the data stored in this `PieceChain`. */
     inline size_t size() const {
@@ -218,6 +680,33 @@ public:
         return piece_chain_dirty(_ptr);
     }
 
+    /** Returns the memory currently held by this `PieceChain`. Takes time linear in the number of pieces. */
+    inline PieceChainStats stats() const {
+        PieceChainStats out;
+        piece_chain_stats(_ptr, &out);
+        return out;
+    }
+
+    /** Returns the instrumentation counters of this `PieceChain`. */
+    inline PieceChainCounters counters() const {
+        PieceChainCounters out;
+        piece_chain_counters(_ptr, &out);
+        return out;
+    }
+
+    /** Sets all the instrumentation counters back to zero. */
+    inline void reset_counters() {
+        piece_chain_counters_reset(_ptr);
+    }
+
+    /**
+     * Registers a callback receiving the instrumentation events, or removes it if `trace` is null.
+     * `user` must outlive the registration. Waits for the background saves, which report their events from their own thread.
+     */
+    inline void set_trace(void (*trace)(PieceChain_t*, const PieceChainTraceEvent* event, void* user), void* user) {
+        piece_chain_set_trace(_ptr, trace, user);
+    }
+
     /** Reads a single byte from the data. Access out of bounds throws a runtime_error. */
     inline unsigned char at(size_t offset) const {
         unsigned char out;
@@ -233,7 +722,43 @@ public:
         return at(offset);
     }
 
-    /** Saves the contents of this `PieceChain` to a file. */
+    /** Copies up to `len` bytes starting at `offset` to `buf`. Returns the number of bytes copied. */
+    inline size_t read(size_t offset, unsigned char* buf, size_t len) const {
+        return piece_chain_read(_ptr, offset, buf, len);
+    }
+
+    /** Returns up to `len` bytes starting at `offset`. */
+    inline std::string read(size_t offset, size_t len) const {
+        std::string out;
+        if (offset < size()) {
+            out.resize(std::min(len, size() - offset));
+            read(offset, (unsigned char*) out.data(), out.size());
+        }
+        return out;
+    }
+
+    /**
+     * Returns a view of the `len` bytes starting at `offset` without copying them, if they are stored contiguously.
+     * The view is valid until this `PieceChain` is modified. Data still backed by a windowed file is never viewed directly.
+     */
+    inline std::optional<std::string_view> view(size_t offset, size_t len) const {
+        const unsigned char* out;
+        if (piece_chain_read_direct(_ptr, offset, len, &out)) {
+            return std::string_view((const char*) out, len);
+        } else {
+            return std::nullopt;
+        }
+    }
+
+    /** Tells how the given section is going to be accessed. Only the parts backed by the original file are affected. */
+    inline void advise(size_t offset, size_t len, Advice advice) {
+        if (!piece_chain_advise(_ptr, offset, len, (PieceChainAdvice) advice)) {
+            auto e = piece_chain_last_error(_ptr);
+            throw PieceChainException(e);
+        }
+    }
+
+    /** Saves the contents of this `PieceChain` to a file, after waiting for the saves running in the background. */
     inline void save(const std::string& path, SaveMode mode = SaveMode::Auto) {
         if (!piece_chain_save(_ptr, path.c_str(), (PieceChainSaveMode) mode)) {
             auto e = piece_chain_last_error(_ptr);
@@ -241,6 +766,30 @@ public:
         }
     }
 
+    /**
+     * Saves the current contents of this `PieceChain` in `SaveMode::Atomic` on a background thread,
+     * while this `PieceChain` can keep being edited. The returned future throws the error of the save, if any.
+     */
+    inline std::future<void> save_async(const std::string& path) {
+        auto promise = new std::promise<void>();
+        auto future = promise->get_future();
+        bool success = piece_chain_save_async(_ptr, path.c_str(), [](PieceChain_t*, bool success, const PieceChainError_t* error, void* user) {
+            auto promise = (std::promise<void>*) user;
+            if (success) {
+                promise->set_value();
+            } else {
+                promise->set_exception(std::make_exception_ptr(PieceChainException(error)));
+            }
+            delete promise;
+        }, promise);
+        if (!success) {
+            delete promise;
+            auto e = piece_chain_last_error(_ptr);
+            throw PieceChainException(e);
+        }
+        return future;
+    }
+
     /** Inserts the given data at the given offset. */
     inline void insert(size_t offset, const unsigned char* data, size_t len) {
         if (!piece_chain_insert(_ptr, offset, data, len)) {
@@ -285,6 +834,35 @@ public:
         return replace(offset, (const unsigned char*) data.c_str(), data.size());
     }
 
+    /**
+     * Applies a batch of edits in a single pass, recording them as a single revision.
+     * Offsets refer to the contents before the batch is applied, and the deleted ranges must not overlap.
+     */
+    inline void apply(const PieceChainEdit* edits, size_t n) {
+        if (!piece_chain_apply_edits(_ptr, edits, n)) {
+            auto e = piece_chain_last_error(_ptr);
+            throw PieceChainException(e);
+        }
+    }
+
+    /**
+     * Applies a batch of edits in a single pass, recording them as a single revision.
+     * Offsets refer to the contents before the batch is applied, and the deleted ranges must not overlap.
+     */
+    template <typename Range>
+    inline void apply(const Range& edits) {
+        std::vector<PieceChainEdit> v(std::begin(edits), std::end(edits));
+        apply(v.data(), v.size());
+    }
+
+    /**
+     * Applies a batch of edits in a single pass, recording them as a single revision.
+     * Offsets refer to the contents before the batch is applied, and the deleted ranges must not overlap.
+     */
+    inline void apply(std::initializer_list<PieceChainEdit> edits) {
+        apply(edits.begin(), edits.size());
+    }
+
     /** Commits any pending change in a new revision, snapshotting the current file status. */
     inline void commit() {
         if (!piece_chain_commit(_ptr)) {
@@ -293,6 +871,14 @@ public:
         }
     }
 
+    /** Commits any pending change right away, even in coalescing mode. */
+    inline void commit_now() {
+        if (!piece_chain_commit_now(_ptr)) {
+            auto e = piece_chain_last_error(_ptr);
+            throw PieceChainException(e);
+        }
+    }
+
     /** Undoes a recent modification. Returns the location of the last change, if the file changed. */
     inline std::optional<size_t> undo() {
         size_t out;
@@ -313,6 +899,174 @@ public:
         }
     }
 
+    /** Returns the identifier of the current revision. */
+    inline uint64_t revision() const {
+        return piece_chain_revision(_ptr);
+    }
+
+    /** Returns the identifier of the parent of the given revision, or 0 if there is none. */
+    inline uint64_t revision_parent(uint64_t id) const {
+        return piece_chain_revision_parent(_ptr, id);
+    }
+
+    /**
+     * Brings the contents to the given revision, swapping only the revisions in between.
+     * Returns the location of the last change, if the file changed.
+     */
+    inline std::optional<size_t> goto_revision(uint64_t id) {
+        size_t out;
+        if (piece_chain_commit_now(_ptr) && piece_chain_revision(_ptr) == id) {
+            return std::nullopt;
+        }
+        if (piece_chain_goto_revision(_ptr, id, &out)) {
+            return out;
+        } else {
+            auto e = piece_chain_last_error(_ptr);
+            throw PieceChainException(e);
+        }
+    }
+
+    /**
+     * Merges runs of adjacent pieces shorter than `threshold` bytes, so that reads get fast again
+     * after long editing sessions. Discards redo history, and undo history too if `discard_history` is true.
+     */
+    inline void compact(size_t threshold = 0, bool discard_history = false) {
+        if (!piece_chain_compact(_ptr, threshold, discard_history)) {
+            auto e = piece_chain_last_error(_ptr);
+            throw PieceChainException(e);
+        }
+    }
+
+    /** Returns the offset of the first byte of the given line. Requires the `line_index` option. */
+    inline std::optional<size_t> line_to_offset(size_t line) const {
+        size_t out;
+        if (piece_chain_line_to_offset(_ptr, line, &out)) {
+            return out;
+        } else {
+            return std::nullopt;
+        }
+    }
+
+    /** Returns the line containing the given offset. Requires the `line_index` option. */
+    inline std::optional<size_t> offset_to_line(size_t offset) const {
+        size_t out;
+        if (piece_chain_offset_to_line(_ptr, offset, &out)) {
+            return out;
+        } else {
+            return std::nullopt;
+        }
+    }
+
+    /** Returns the offset of the first occurrence of `pattern` starting at or after `from`. */
+    inline std::optional<size_t> find(const std::string& pattern, size_t from = 0) const {
+        size_t out;
+        if (piece_chain_find(_ptr, from, (const unsigned char*) pattern.data(), pattern.size(), &out)) {
+            return out;
+        } else {
+            return std::nullopt;
+        }
+    }
+
+    /** Returns the offset of the last occurrence of `pattern` starting at or before `from`. */
+    inline std::optional<size_t> rfind(const std::string& pattern, size_t from = std::string::npos) const {
+        size_t out;
+        if (piece_chain_rfind(_ptr, from, (const unsigned char*) pattern.data(), pattern.size(), &out)) {
+            return out;
+        } else {
+            return std::nullopt;
+        }
+    }
+
+    /**
+     * Returns the offset of the first occurrence of any of the given patterns starting at or after `from`,
+     * together with the index of the pattern found.
+     */
+    inline std::optional<std::pair<size_t, size_t>> find_any(const std::vector<std::string>& patterns, size_t from = 0) const {
+        std::vector<const unsigned char*> data;
+        std::vector<size_t> lens;
+        for (auto& p : patterns) {
+            data.push_back((const unsigned char*) p.data());
+            lens.push_back(p.size());
+        }
+        size_t out, which;
+        if (piece_chain_find_any(_ptr, from, data.data(), lens.data(), patterns.size(), &out, &which)) {
+            return std::make_pair(out, which);
+        } else {
+            return std::nullopt;
+        }
+    }
+
+    /**
+     * Visits a section of the file using multiple threads, and combines the results.
+     * The section is split in up to `chunks` parts (by default, one per hardware thread):
+     * for each of them, `visit(T& acc, size_t offset, const unsigned char* data, size_t len)` is called
+     * for the fragments of the chunk in order, starting from an accumulator equal to `init`.
+     * The accumulators of the chunks are then combined in order with `reduce(T acc, T chunk) -> T`, starting from `init`.
+     * The first exception thrown by `visit` stops the visit and is rethrown.
+     */
+    template<typename T, typename Visit, typename Reduce>
+    inline T visit_parallel(size_t start, size_t len, T init, Visit&& visit, Reduce&& reduce, size_t chunks = 0) const {
+        if (chunks == 0) {
+            chunks = std::max(std::thread::hardware_concurrency(), 1u);
+        }
+
+        // Each accumulator is wrapped, so that std::vector<bool> does not pack them in shared words
+        struct Partial {
+            T acc;
+        };
+        struct State {
+            Visit& visit;
+            Reduce& reduce;
+            std::vector<Partial> partials;
+            T result;
+            std::mutex mutex;
+            std::exception_ptr error;
+        } state { visit, reduce, std::vector<Partial>(chunks, Partial { init }), init, {}, nullptr };
+
+        bool success = piece_chain_visit_parallel(_ptr, start, len, chunks,
+            [](PieceChain_t*, size_t chunk, size_t offset, const unsigned char* data, size_t len, void* user) {
+                auto& s = *(State*) user;
+                try {
+                    s.visit(s.partials[chunk].acc, offset, data, len);
+                    return true;
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(s.mutex);
+                    if (!s.error) {
+                        s.error = std::current_exception();
+                    }
+                    return false;
+                }
+            },
+            [](PieceChain_t*, size_t chunk, void* user) {
+                auto& s = *(State*) user;
+                s.result = s.reduce(std::move(s.result), std::move(s.partials[chunk].acc));
+                return true;
+            },
+            &state
+        );
+        if (state.error) {
+            std::rethrow_exception(state.error);
+        }
+        if (!success) {
+            auto e = piece_chain_last_error(_ptr);
+            throw PieceChainException(e);
+        }
+        return state.result;
+    }
+
+    /**
+     * Takes an immutable snapshot of the current contents, which can be read
+     * from other threads while this `PieceChain` keeps being modified.
+     */
+    inline Snapshot snapshot() {
+        if (auto snap = piece_chain_snapshot(_ptr); snap != nullptr) {
+            return Snapshot(snap);
+        } else {
+            auto e = piece_chain_last_error(_ptr);
+            throw PieceChainException(e);
+        }
+    }
+
     /**
      * Discards all the data stored in this `PieceChain`.
      * Note that this does NOT discard undo history.
@@ -349,8 +1103,56 @@ public:
         return PieceChainIterator(_ptr);
     }
 
+    /**
+     * Returns an iterator over the fragments of the given section of a file, starting from its end.
+     * Altering the contents of the file while an iterator is open will result in undefined behaviour.
+     */
+    inline PieceChainReverseIterator rbegin() const {
+        return rbegin(0, size());
+    }
+
+    /**
+     * Returns an iterator over the fragments of the given section of a file, starting from its end.
+     * Altering the contents of the file while an iterator is open will result in undefined behaviour.
+     */
+    inline PieceChainReverseIterator rbegin(size_t start, size_t len) const {
+        if (auto it = piece_chain_iter(_ptr, start, len); it != nullptr) {
+            return PieceChainReverseIterator(_ptr, it);
+        } else {
+            auto e = piece_chain_last_error(_ptr);
+            throw PieceChainException(e);
+        }
+    }
+
+    /** Returns a reverse iterator referring to the past-the-end element. */
+    inline PieceChainReverseIterator rend() const {
+        return PieceChainReverseIterator(_ptr);
+    }
+
+    /**
+     * Returns a range over the single bytes of the whole file.
+     * Altering the contents of the file while the range is in use will result in undefined behaviour.
+     */
+    inline PieceChainBytes bytes() const {
+        return bytes(0, size());
+    }
+
+    /**
+     * Returns a range over the single bytes of the given section of a file.
+     * Altering the contents of the file while the range is in use will result in undefined behaviour.
+     */
+    inline PieceChainBytes bytes(size_t start, size_t len) const {
+        start = std::min(start, size());
+        return PieceChainBytes(_ptr, start, start + std::min(len, size() - start));
+    }
+
 private:
     PieceChain_t* _ptr;
+
+    inline explicit PieceChain(PieceChain_t* ptr)
+        : _ptr(ptr)
+    {
+    }
 };
 
 /** Writes the contents of the given `PieceChain` to the given stream. */
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdbool.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -7,33 +9,119 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <linux/fs.h>
 #include <fcntl.h>
 #include <libgen.h>
 #include <assert.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
 
+#define MEM_BLOCK_INITIAL_SIZE ((size_t) (4 * 1024)) /* 4KiB */
 #define MEM_BLOCK_SIZE ((size_t) (1024 * 1024)) /* 1MiB */
+#define CURSOR_MAX_STEPS 16 /* Pieces walked from the cursor before falling back to the index */
+#define COMPACT_THRESHOLD ((size_t) 256) /* Default size under which pieces get merged by compaction */
+#define PARALLEL_MIN_CHUNK ((size_t) (64 * 1024)) /* Smallest range worth visiting on its own thread */
+#define FIND_STACK_CARRY 256 /* Patterns up to half this size do not need to allocate the carry buffer */
+#define LINES_CHUNK ((size_t) (64 * 1024)) /* Granularity of the newline counts of mapped files */
+#define LINES_UNKNOWN SIZE_MAX /* Newlines of a piece not counted yet */
+#define WINDOW_MAX_COUNT ((size_t) 64) /* Default number of windows of a file kept mapped */
+#define BLOCK_FREE_MAX ((size_t) 4) /* Memory blocks kept for reuse after no piece points into them anymore */
+#define DIFF_CHUNK 4096 /* Bytes compared at a time when trimming the ranges found by a diff */
+#define JOURNAL_MAGIC "PCJ1"
+#define JOURNAL_HEADER_SIZE (4 + 3 * sizeof(uint64_t)) /* Magic, then size and modification time of the file */
+#define JOURNAL_RECORD_SIZE (1 + 2 * sizeof(uint64_t)) /* Type, offset and length of an edit */
+
+// Instrumentation of the hot paths, which compiles to nothing unless enabled at build time
+#ifdef PIECE_CHAIN_INSTRUMENTATION
+#define INSTRUMENT(...) __VA_ARGS__
+#define COUNT(file, counter, n) ((file)->counters.counter += (n))
+#define TRACE(file, ...) trace_event((file), (PieceChainTraceEvent_t) { __VA_ARGS__ })
+#else
+#define INSTRUMENT(...)
+#define COUNT(file, counter, n) ((void) (file))
+#define TRACE(file, ...) ((void) (file))
+#endif
 
 #include "PieceChain/PieceChain.h"
 #include "list.h"
+#include "pool.h"
+#include "search.h"
 #include "util.h"
 
+// Types of the records of a journal.
+// All the numbers are 64 bit integers in the byte order of the machine.
+enum {
+    JOURNAL_INSERT = 'I', // Offset, length and data
+    JOURNAL_DELETE = 'D', // Offset and length
+    JOURNAL_REPLACE = 'R', // Offset, length and data
+    JOURNAL_EDITS = 'E', // Number of edits, then offset, length deleted, length and data of each one
+    JOURNAL_COMMIT = 'C',
+    JOURNAL_GROUP = 'G' // A commit coalesced with the following ones: the records before it are complete, but not a revision yet
+};
+
+typedef struct {
+    size_t index; // Position of the window in the file, in windows
+    unsigned int users; // Readers currently holding the window
+    bool pinned; // The window holds private copies of its pages, and must never be unmapped
+    unsigned long used; // Time of the last acquisition, for LRU eviction
+} Window;
+
+typedef struct {
+    pthread_mutex_t lock; // Snapshots can acquire windows from any thread
+    size_t size; // Size of every window but the last
+    size_t max; // Maximum number of unpinned windows kept mapped, unless all of them are in use
+    size_t mapped; // Unpinned windows currently mapped
+    size_t count;
+    size_t capacity;
+    unsigned long clock;
+    Window* slots;
+} BlockWindows;
+
 typedef struct {
     unsigned char* data;
     size_t size;
     size_t len;
     enum {
         BLOCK_MMAP,
-        BLOCK_MALLOC
+        BLOCK_MALLOC,
+        BLOCK_ANONYMOUS,
+        BLOCK_WINDOWED,
+        BLOCK_BUFFER
     } type;
+    int fd; // File the block has been mapped from, or -1
+    bool written; // The file has been written to after it has been mapped
+    uint64_t owner; // Identifier of the chain that allocated the block
+    size_t pieces; // Pieces of the owner pointing into the block, including the ones kept for undo and redo
+    atomic_uint refs; // References from the chain and from snapshots
+    size_t* lines; // For mapped files, newlines before each LINES_CHUNK bytes, or NULL
+    BlockWindows* windows; // For windowed blocks, the parts of the file currently mapped
+    void (*release)(const unsigned char* data, size_t len, void* user); // For buffer blocks, gives the buffer back to its owner
+    void* user;
     struct list_head list;
 } Block;
 
-typedef struct {
+typedef struct Piece {
     unsigned char* data;
     size_t size;
-    struct list_head global_list;
+    Block* block; // Block containing the data
     struct list_head list; // This is not used as a list at all, so maybe we should not use a `list_head`.
+
+    // Node of the piece index: a treap ordered by position in the chain,
+    // where each node knows the number of pieces and bytes in its subtree.
+    struct Piece* left;
+    struct Piece* right;
+    struct Piece* parent;
+    size_t subtree_count;
+    size_t subtree_size;
+    unsigned int priority;
+
+    // Newlines in the piece and in its subtree, if the line index is enabled
+    size_t lines;
+    size_t subtree_lines;
 } Piece;
 
 typedef struct {
@@ -49,63 +137,278 @@ typedef struct {
     struct list_head list;
 } Change;
 
-typedef struct {
+typedef struct Revision {
+    uint64_t id;
+    struct Revision* parent; // Revision this one has been committed over, or NULL for the first one
+    struct Revision* redo; // Child last committed or undone, which redo goes to
+    size_t depth; // Distance from the first revision, give or take the revisions dropped
+    bool mark; // Scratch flag for the walks over the whole history
     struct list_head changes;
-    struct list_head list;
+    struct list_head list; // Revisions in order of creation, so parents always come before their children
 } Revision;
 
 struct PieceChain_t {
+    uint64_t id; // Tells apart the blocks of this chain from the ones shared with other chains
     size_t size;
-    bool dirty;
+    uint64_t edits; // Edits made to the chain, to tell whether the contents are still the ones saved
+    atomic_uint_fast64_t saved_edits; // Value of `edits` when the saved contents were captured
+
+    PieceChainOptions_t options;
+    size_t next_block_size; // Size of the next memory block to allocate
+    size_t heap_size; // Total size of the memory blocks
 
     struct list_head all_blocks; // List of all the blocks (for freeing)
-    struct list_head all_pieces; // List of all the pieces (for freeing)
+    struct list_head free_blocks; // Memory blocks no piece points into anymore, kept for reuse
+    size_t free_count;
+    Block** shared; // Blocks of the chain this one has been cloned from, kept alive until the end
+    size_t shared_count;
     struct list_head all_revisions; // File history
 
+    struct pool piece_pool; // Memory for pieces, changes and revisions
+    struct pool change_pool;
+    struct pool revision_pool;
+
     struct list_head pieces; // Current active pieces
+    Piece* index; // Root of the index over the current active pieces
+    unsigned int index_seed; // State of the generator of the index priorities
     Piece* cache; // Last modified piece for caching
+    Piece* cursor; // Piece where the last lookup landed
+    size_t cursor_offset; // Absolute offset of the first byte of `cursor`
 
     Revision* current_revision; // Pointer to the current active revision
+    uint64_t revision_ids; // Identifier of the last revision created
     struct list_head pending_changes; // Changes not yet attached to a revision
+    size_t group_bytes; // Bytes edited by the pending changes, for coalescing
+    uint64_t group_start; // Time of the first pending edit, in milliseconds
+
+    PieceChainCounters_t counters;
+    PieceChainCounters_t saves_counters; // Counters of the completed background saves, guarded by `saves_lock`
+    void (*trace)(PieceChain_t*, const PieceChainTraceEvent_t*, void*); // Callback receiving the instrumentation events
+    void* trace_user;
+    PieceChain_t* trace_chain; // Chain reported to the callback, if not this one: background saves report as their chain
+
+    int journal_fd; // Journal the committed changes are appended to, or -1
+    size_t journal_size; // Bytes of the journal known to be complete
+    unsigned char* journal_buf; // Records not written to the journal yet
+    size_t journal_len;
+    size_t journal_cap;
+
+    pthread_mutex_t saves_lock; // Saves running in the background, which the chain has to outlive
+    pthread_cond_t saves_done;
+    size_t saves_running;
+    uint64_t saves_started; // Saves run one at a time, in the order they were started
+    uint64_t saves_finished;
 
     PieceChainError_t last_error;
 };
 
+typedef struct {
+    PieceChain_t* file;
+    PieceChain_t* clone; // Frozen copy of the contents to save
+    char* path;
+    uint64_t edits;
+    uint64_t ticket; // Position of the save in the order they were started
+    void (*done)(PieceChain_t*, bool success, const PieceChainError_t* error, void* user);
+    void* user;
+} SaveJob;
+
+typedef struct {
+    const unsigned char* data;
+    size_t size;
+    size_t offset; // Absolute offset of the first byte
+    Block* block;
+} SnapshotPiece;
+
+struct PieceChainSnapshot_t {
+    atomic_uint refs;
+    size_t size;
+    size_t count;
+    SnapshotPiece* pieces;
+    size_t block_count;
+    Block** blocks; // Blocks kept alive by the snapshot
+};
+
+typedef struct {
+    Piece* piece; // Piece containing the first byte of the chunk
+    size_t piece_offset;
+    size_t start;
+    size_t end;
+} ParallelChunk;
+
+typedef struct {
+    PieceChain_t* file;
+    bool (*visitor)(PieceChain_t*, size_t chunk, size_t offset, const unsigned char* data, size_t len, void* user);
+    void* user;
+    size_t count;
+    ParallelChunk* chunks;
+    atomic_size_t next; // Next chunk to be picked up by a worker
+    atomic_bool failed;
+    atomic_int err; // Error reading the data, if any
+} ParallelVisit;
+
+struct PieceChainPin_t {
+    atomic_uint refs;
+    Block* block; // Windowed block, kept alive along with the window
+    const unsigned char* data; // Any byte of the window
+};
+
 struct PieceChainIterator_t {
     PieceChain_t* file;
-    size_t max_off; // Maximum offset requested by the user
+    size_t max_off; // Maximum offset requested by the user, or iterated back to with `prev`
     size_t current_off; // Offset we have iterated to until now
     Piece* current_piece;
+    size_t current_piece_off; // Bytes of `current_piece` already returned by `next`
+    Piece* back_piece; // Piece last returned by `prev`
+    size_t back_piece_off; // Bytes of `back_piece` not yet returned by `prev`
+    Block* held_block; // Windowed block holding the last fragment returned, or NULL
+    const unsigned char* held;
 };
 
 
 // Functions to manage blocks
 static Block* block_alloc(PieceChain_t*, size_t);
 static Block* block_alloc_mmap(PieceChain_t*, int fd, size_t size);
+static Block* block_alloc_windowed(PieceChain_t*, int fd, size_t size);
+static Block* block_alloc_buffer(PieceChain_t*, const unsigned char* data, size_t size, void (*release)(const unsigned char*, size_t, void*), void* user);
 static void block_free(PieceChain_t*, Block*);
+static void block_release(PieceChain_t*, Block*);
+static bool block_owned(PieceChain_t*, Block*);
+static void block_unref(Block*);
 static bool block_can_fit(Block*, size_t len);
 static unsigned char* block_append(Block*, const unsigned char* data, size_t len);
+static Block* block_find_file(PieceChain_t*, int fd);
+static bool block_pin(PieceChain_t*, Block*, size_t offset, size_t len);
+static bool block_advise(Block*, size_t offset, size_t len, enum PieceChainAdvice);
+
+// Functions to manage the windows of windowed blocks
+static size_t window_clip(Block*, const unsigned char* data, size_t len);
+static size_t window_clip_back(Block*, const unsigned char* end, size_t len);
+static bool window_map(Block*, size_t index);
+static void window_unmap(Block*, size_t index);
+static bool window_acquire(Block*, const unsigned char* data);
+static void window_hold(Block*, const unsigned char* data);
+static void window_release(Block*, const unsigned char* data);
+static bool window_pin(Block*, size_t index);
+static bool window_copy(Block*, unsigned char* dst, const unsigned char* src, size_t len);
+static size_t window_count(Block*, const unsigned char* data, size_t len, unsigned char c);
+static const unsigned char* window_nth(Block*, const unsigned char* data, size_t len, unsigned char c, size_t n);
+
+// Functions to open piece chains
+static PieceChain_t* chain_alloc(const PieceChainOptions_t*);
+static PieceChain_t* chain_load_fd(PieceChain_t*, int fd);
+static bool fd_size(int fd, const struct stat*, size_t* size);
+static PieceChain_t* chain_load_block(PieceChain_t*, Block*);
 
 // Functions to manage pieces
-static Piece* piece_alloc(PieceChain_t*);
-static void piece_free(Piece*);
+static Piece* piece_alloc(PieceChain_t*, Block*);
+static void piece_free(PieceChain_t*, Piece*);
 static bool piece_find(PieceChain_t*, size_t abs, Piece** piece, size_t* offset);
 
+// Functions to manage the piece index
+static void index_update(Piece*);
+static void index_refresh(Piece*);
+static Piece* index_merge(Piece* a, Piece* b);
+static void index_split(Piece* root, size_t count, Piece** left, Piece** right);
+static size_t index_rank(Piece*, size_t* offset);
+static Piece* index_build(PieceChain_t*, Piece* start, Piece* end);
+static size_t index_swap(PieceChain_t*, Span* original, Span* replacement);
+
+// Functions to manage the line index
+static bool lines_init(PieceChain_t*, Block*);
+static size_t lines_count(Block*, const unsigned char* data, size_t len);
+static size_t lines_find(Block*, const unsigned char* data, size_t len, size_t n);
+
+// Functions to manage the lookup cursor
+static void cursor_put(PieceChain_t*, Piece*, size_t offset);
+static void cursor_resize(PieceChain_t*, Piece*, size_t old_size);
+
 // Functions to manage the piece cache
 static void cache_put(PieceChain_t*, Piece*);
 static bool cache_insert(PieceChain_t*, Piece*, size_t piece_offset, const unsigned char* data, size_t len);
 static bool cache_delete(PieceChain_t*, Piece*, size_t piece_offset, size_t len);
+static bool cache_replace(PieceChain_t*, Piece*, size_t piece_offset, const unsigned char* data, size_t len);
 
 // Functions to manage spans and changes
 static void span_init(Span*, Piece* start, Piece* end);
-static void span_swap(PieceChain_t*, Span* original, Span* replacement);
+static size_t span_swap(PieceChain_t*, Span* original, Span* replacement);
 static Change* change_alloc(PieceChain_t*, size_t pos);
-static void change_free(Change*, bool free_pieces);
+static void change_free(PieceChain_t*, Change*, bool free_pieces);
+
+// Functions to apply batches of edits
+static Piece* edits_emit(PieceChain_t*, Piece** first, Piece* last, Block*, unsigned char* data, size_t size);
+static bool edits_apply(PieceChain_t*, const PieceChainEdit_t* const* edits, size_t n, size_t total);
 
 // Functions to manage revisions
 static Revision* revision_alloc(PieceChain_t*);
-static void revision_free(Revision*, bool free_pieces);
+static void revision_free(PieceChain_t*, Revision*, bool free_pieces);
 static bool revision_purge(PieceChain_t*);
+static void revision_branch(PieceChain_t*);
+static void revision_mark(PieceChain_t*, Revision* rev);
+static Revision* revision_find(PieceChain_t*, uint64_t id);
+static void revision_undo(PieceChain_t*, size_t* pos);
+static void revision_redo(PieceChain_t*, Revision*, size_t* pos);
+
+// Functions to keep the history within its budget
+static void history_forget(PieceChain_t*, Revision*);
+static bool history_drop(PieceChain_t*);
+static void history_trim(PieceChain_t*);
+
+// Functions to journal the changes
+static bool journal_reserve(PieceChain_t*, size_t len);
+static void journal_put(PieceChain_t*, const void* data, size_t len);
+static bool journal_record(PieceChain_t*, unsigned char type, size_t offset, size_t len, const unsigned char* data);
+static bool journal_edits(PieceChain_t*, const PieceChainEdit_t* edits, size_t n);
+static void journal_swap(PieceChain_t*, size_t offset, Span* removed, Span* inserted);
+static bool journal_flush(PieceChain_t*, unsigned char type);
+static void journal_abandon(PieceChain_t*);
+static bool journal_header(const char* path, unsigned char* out);
+static bool journal_replay(PieceChain_t*, const unsigned char* pos, const unsigned char* end, const unsigned char** valid);
+static bool journal_load(PieceChain_t*, int fd, const char* path);
+static bool journal_reset(PieceChain_t*, const char* path);
+
+// Functions to write files
+static bool write_all(PieceChain_t*, int fd, const unsigned char* data, size_t len);
+static bool write_dirty(PieceChain_t*, int fd, Block*);
+static int sync_fd(PieceChain_t*, int fd);
+static bool save_mode(PieceChain_t*, const char* path, enum PieceChainSaveMode);
+static void* save_worker(void*);
+static void saves_wait(PieceChain_t*);
+static void counters_add(PieceChainCounters_t* to, const PieceChainCounters_t* from);
+
+// Functions to edit the chain
+static bool chain_insert(PieceChain_t*, size_t offset, const unsigned char* data, size_t len);
+static bool chain_delete(PieceChain_t*, size_t offset, size_t len);
+static bool chain_replace(PieceChain_t*, size_t offset, const unsigned char* data, size_t len);
+static bool group_begin(PieceChain_t*);
+static void group_add(PieceChain_t*, size_t len);
+static bool commit_defer(PieceChain_t*);
+static bool chain_commit(PieceChain_t*);
+
+// Functions to iterate over the chain
+static bool iter_hold(PieceChainIterator_t*, Block*, const unsigned char* data);
+
+// Functions to give access hints
+static bool advise_range(PieceChain_t*, size_t start, size_t len, enum PieceChainAdvice);
+static void advise_blocks(PieceChain_t*, enum PieceChainAdvice);
+
+// Functions to visit in parallel
+static bool parallel_visit_chunk(ParallelVisit*, size_t chunk);
+static void* parallel_worker(void*);
+
+// Functions to search the chain
+static bool find_forward(PieceChain_t*, size_t from, size_t end, const unsigned char* pat, size_t plen, unsigned char* carry, size_t* out);
+static bool find_backward(PieceChain_t*, size_t lo, size_t end, const unsigned char* pat, size_t plen, unsigned char* carry, size_t* out);
+
+// Functions to compact the chain
+static Piece* compact_run(PieceChain_t*, Piece** end, size_t threshold, size_t* len);
+static Piece* compact_merge(PieceChain_t*, Piece* start, Piece* end, size_t len);
+static bool compact_flatten(PieceChain_t*, size_t threshold);
+
+// Functions to compare snapshots
+static bool snapshot_copy(const PieceChainSnapshot_t*, size_t offset, unsigned char* dst, size_t len);
+static int diff_compare(const void*, const void*);
+static size_t diff_lookup(const PieceChainSnapshot_t*, const SnapshotPiece** sorted, const unsigned char* data, size_t* len);
+static bool diff_trim(const PieceChainSnapshot_t* a, size_t* a_offset, size_t* a_len, const PieceChainSnapshot_t* b, size_t* b_offset, size_t* b_len);
 
 
 inline static void set_error(PieceChain_t* file, const char* message, int err) {
@@ -113,19 +416,83 @@ inline static void set_error(PieceChain_t* file, const char* message, int err) {
     file->last_error.err = err;
 }
 
+inline static uint64_t clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+#ifdef PIECE_CHAIN_INSTRUMENTATION
+inline static uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static void trace_event(PieceChain_t* file, PieceChainTraceEvent_t event) {
+    // The callback must not clobber the errno of a failed operation
+    if (file->trace != NULL) {
+        int err = errno;
+        file->trace(file->trace_chain != NULL ? file->trace_chain : file, &event, file->trace_user);
+        errno = err;
+    }
+}
+#endif
+
 static Block* block_alloc(PieceChain_t* file, size_t size) {
+
+    // Blocks released earlier are reused before asking for new memory
+    list_for_each_member(b, &file->free_blocks, Block, list) {
+        if (b->size >= size) {
+            list_del(&b->list);
+            file->free_count--;
+            list_add_tail(&file->all_blocks, &b->list);
+            file->heap_size += b->size;
+            return b;
+        }
+    }
     
     Block* block = malloc(sizeof(Block));
     if (block == NULL) {
         set_error(file, "Out of memory", ENOMEM);
         return NULL;
     }
-    block->size = MAX(size, MEM_BLOCK_SIZE);
+    block->size = MAX(size, file->next_block_size);
     block->len = 0;
     block->type = BLOCK_MALLOC;
+    block->fd = -1;
+    block->written = false;
+    block->owner = file->id;
+    block->pieces = 0;
+    atomic_init(&block->refs, 1);
+    block->lines = NULL;
+    block->windows = NULL;
+    block->release = NULL;
+    block->user = NULL;
     list_init(&block->list);
 
-    block->data = malloc(sizeof(char) * block->size);
+    // Small chains start with small blocks, while chains receiving lots of data
+    // get geometrically bigger blocks, up to the configured maximum
+    file->next_block_size = MIN(file->next_block_size * 2, file->options.max_block_size);
+
+    // Big blocks can be mapped directly from the kernel, possibly on huge pages
+    block->data = NULL;
+    if (file->options.mmap_threshold != 0 && block->size >= file->options.mmap_threshold) {
+        size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+        size_t mapsize = (block->size + pagesize - 1) / pagesize * pagesize;
+        void* ptr = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+            madvise(ptr, mapsize, MADV_HUGEPAGE); // Just a hint, we don't care if it fails
+#endif
+            block->data = ptr;
+            block->size = mapsize;
+            block->type = BLOCK_ANONYMOUS;
+        }
+    }
+    if (block->data == NULL) {
+        block->data = malloc(sizeof(char) * block->size);
+    }
     if (block->data == NULL) {
         set_error(file, "Out of memory", ENOMEM);
         free(block);
@@ -134,6 +501,10 @@ static Block* block_alloc(PieceChain_t* file, size_t size) {
 
     // Add the created block to the list of all blocks for tracking
     list_add_tail(&file->all_blocks, &block->list);
+    file->heap_size += block->size;
+    COUNT(file, blocks_allocated, 1);
+    COUNT(file, block_bytes, block->size);
+    TRACE(file, .type = TRACE_BLOCK_ALLOC, .bytes = block->size, .success = true);
 
     return block;
 
@@ -149,11 +520,21 @@ static Block* block_alloc_mmap(PieceChain_t* file, int fd, size_t size) {
     block->size = size;
     block->len = size;
     block->type = BLOCK_MMAP;
+    block->fd = fd; // Keep the file around to be able to copy unchanged data without reading it
+    block->written = false;
+    block->owner = file->id;
+    block->pieces = 0;
+    atomic_init(&block->refs, 1);
+    block->lines = NULL;
+    block->windows = NULL;
+    block->release = NULL;
+    block->user = NULL;
     list_init(&block->list);
 
     block->data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
     if (block->data == MAP_FAILED) {
         set_error(file, "Cannot mmap", errno);
+        free(block);
         return NULL;
     }
 
@@ -164,20 +545,150 @@ static Block* block_alloc_mmap(PieceChain_t* file, int fd, size_t size) {
    
 }
 
+static Block* block_alloc_windowed(PieceChain_t* file, int fd, size_t size) {
+
+    Block* block = malloc(sizeof(Block));
+    BlockWindows* windows = malloc(sizeof(BlockWindows));
+    if (block == NULL || windows == NULL) {
+        set_error(file, "Out of memory", ENOMEM);
+        free(block);
+        free(windows);
+        return NULL;
+    }
+    block->size = size;
+    block->len = size;
+    block->type = BLOCK_WINDOWED;
+    block->fd = fd; // Windows are mapped or read from here
+    block->written = false;
+    block->owner = file->id;
+    block->pieces = 0;
+    atomic_init(&block->refs, 1);
+    block->lines = NULL;
+    block->windows = windows;
+    block->release = NULL;
+    block->user = NULL;
+    list_init(&block->list);
+
+    // Windows are multiples of the line index chunks, so that a chunk never spans two windows
+    pthread_mutex_init(&windows->lock, NULL);
+    windows->size = (file->options.window_size + LINES_CHUNK - 1) / LINES_CHUNK * LINES_CHUNK;
+    windows->max = file->options.max_windows;
+    windows->mapped = 0;
+    windows->count = 0;
+    windows->capacity = 0;
+    windows->clock = 0;
+    windows->slots = NULL;
+
+    // Reserve the address space for the whole file, without mapping any of it:
+    // pieces keep pointing in the reservation, and windows are mapped there only when read from
+    block->data = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (block->data == MAP_FAILED) {
+        set_error(file, "Cannot mmap", errno);
+        pthread_mutex_destroy(&windows->lock);
+        free(windows);
+        free(block);
+        return NULL;
+    }
+
+    list_add_tail(&file->all_blocks, &block->list);
+
+    return block;
+
+}
+
+static Block* block_alloc_buffer(PieceChain_t* file, const unsigned char* data, size_t size, void (*release)(const unsigned char*, size_t, void*), void* user) {
+
+    Block* block = malloc(sizeof(Block));
+    if (block == NULL) {
+        set_error(file, "Out of memory", ENOMEM);
+        return NULL;
+    }
+    block->data = (unsigned char*) data; // Never written to, since the block is full from the start
+    block->size = size;
+    block->len = size;
+    block->type = BLOCK_BUFFER;
+    block->fd = -1;
+    block->written = false;
+    block->owner = file->id;
+    block->pieces = 0;
+    atomic_init(&block->refs, 1);
+    block->lines = NULL;
+    block->windows = NULL;
+    block->release = release;
+    block->user = user;
+    list_init(&block->list);
+
+    list_add_tail(&file->all_blocks, &block->list);
+
+    return block;
+
+}
+
 static void block_free(PieceChain_t* file, Block* block) {
-    (void) file;
+    if (block->type == BLOCK_MALLOC || block->type == BLOCK_ANONYMOUS) {
+        file->heap_size -= block->size;
+    }
+
+    // Snapshots might still be using the block, so just drop the reference of the chain
+    list_del(&block->list);
+    block_unref(block);
+}
+
+static bool block_owned(PieceChain_t* file, Block* block) {
+    // Blocks shared by clones are never released before the chain itself,
+    // so only their owner keeps track of the pieces pointing into them
+    return block->owner == file->id;
+}
+
+static void block_release(PieceChain_t* file, Block* block) {
+
+    // The last piece pointing into the block is gone.
+    // Memory blocks of the usual size are cleared and kept aside for the next allocations,
+    // unless a snapshot is still reading them, while all the others are freed.
+    bool heap = block->type == BLOCK_MALLOC || block->type == BLOCK_ANONYMOUS;
+    bool usual = block->size >= file->options.max_block_size && block->size / 2 < file->options.max_block_size;
+    if (heap && usual && file->free_count < BLOCK_FREE_MAX && atomic_load_explicit(&block->refs, memory_order_acquire) == 1) {
+        list_del(&block->list);
+        file->heap_size -= block->size;
+        block->len = 0;
+        list_add(&file->free_blocks, &block->list);
+        file->free_count++;
+        return;
+    }
+    block_free(file, block);
+}
+
+static void block_unref(Block* block) {
+    if (atomic_fetch_sub_explicit(&block->refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
 
     switch (block->type) {
         case BLOCK_MALLOC:
             free(block->data);
             break;
         case BLOCK_MMAP:
+        case BLOCK_ANONYMOUS:
             munmap(block->data, block->size);
             break;
+        case BLOCK_WINDOWED:
+            munmap(block->data, block->size); // Takes down the reservation along with all the windows mapped in it
+            pthread_mutex_destroy(&block->windows->lock);
+            free(block->windows->slots);
+            free(block->windows);
+            break;
+        case BLOCK_BUFFER:
+            if (block->release != NULL) {
+                block->release(block->data, block->size, block->user);
+            }
+            break;
         default:
             abort();
     }
-    list_del(&block->list);
+    if (block->fd != -1) {
+        close(block->fd);
+    }
+    free(block->lines);
     free(block);
 }
 
@@ -195,956 +706,3990 @@ static unsigned char* block_append(Block* block, const unsigned char* data, size
     return ptr;
 }
 
-static Piece* piece_alloc(PieceChain_t* file) {
-    Piece* piece = malloc(sizeof(Piece));
-    if (piece == NULL) {
-        set_error(file, "Out of memory", ENOMEM);
+static Block* block_find_file(PieceChain_t* file, int fd) {
+    struct stat target;
+    if (fstat(fd, &target) < 0) {
         return NULL;
     }
-    piece->data = NULL;
-    piece->size = 0;
-    list_init(&piece->list);
-    list_init(&piece->global_list);
+    list_for_each_member(b, &file->all_blocks, Block, list) {
+        struct stat st;
+        if ((b->type == BLOCK_MMAP || b->type == BLOCK_WINDOWED) && fstat(b->fd, &st) == 0 && st.st_dev == target.st_dev && st.st_ino == target.st_ino) {
+            return b;
+        }
+    }
+    for (size_t i = 0; i < file->shared_count; ++i) {
+        Block* b = file->shared[i];
+        struct stat st;
+        if ((b->type == BLOCK_MMAP || b->type == BLOCK_WINDOWED) && fstat(b->fd, &st) == 0 && st.st_dev == target.st_dev && st.st_ino == target.st_ino) {
+            return b;
+        }
+    }
+    return NULL;
+}
 
-    list_add_tail(&file->all_pieces, &piece->global_list);
+static bool block_pin(PieceChain_t* file, Block* block, size_t offset, size_t len) {
+    assert(block->type == BLOCK_MMAP || block->type == BLOCK_WINDOWED);
 
-    return piece;
+    // The file is mapped with MAP_PRIVATE, so pages we have never written to still show
+    // any change made to the file. Before overwriting a region of the file, replace the pages mapping it
+    // with anonymous copies, so that all the pieces still pointing there (even the ones in the undo history)
+    // keep seeing the old contents. Private copies made by writing to the pages would not do:
+    // truncating the file drops them too.
+    if (len == 0 || offset >= block->size) {
+        return true;
+    }
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t start = offset & ~(pagesize - 1);
+    size_t end = MIN(offset + len + pagesize - 1, block->size + pagesize - 1) & ~(pagesize - 1);
+    if (block->windows != NULL) {
+        for (size_t i = start / block->windows->size; i <= (end - 1) / block->windows->size; ++i) {
+            if (!window_pin(block, i)) {
+                set_error(file, "Cannot map window", errno);
+                return false;
+            }
+        }
+    }
+    void* copy = mmap(NULL, end - start, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (copy == MAP_FAILED) {
+        set_error(file, "Cannot mmap", errno);
+        return false;
+    }
+    memcpy(copy, block->data + start, end - start);
+    mprotect(copy, end - start, PROT_READ);
+    if (mremap(copy, end - start, end - start, MREMAP_MAYMOVE | MREMAP_FIXED, block->data + start) == MAP_FAILED) {
+        set_error(file, "Cannot mremap", errno);
+        munmap(copy, end - start);
+        return false;
+    }
+    return true;
 }
 
-static void piece_free(Piece* piece) {
-    list_del(&piece->global_list);
-    free(piece);
-}
+static bool block_advise(Block* block, size_t offset, size_t len, enum PieceChainAdvice advice) {
+    static const int fadvice[] = { POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM, POSIX_FADV_WILLNEED, POSIX_FADV_DONTNEED };
+    static const int madvice[] = { MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED, MADV_DONTNEED };
+    if ((block->type != BLOCK_MMAP && block->type != BLOCK_WINDOWED) || len == 0) {
+        return true;
+    }
 
-static bool piece_find(PieceChain_t* file, size_t abs, Piece** piece, size_t* offset) {
-    if (abs > file->size) {
+    // The page cache reads ahead for the data copied straight from the file too
+    int err = posix_fadvise(block->fd, offset, len, fadvice[advice]);
+    if (err != 0) {
+        errno = err;
         return false;
     }
 
-    size_t abspos = 0;
-    list_for_each_member(p, &file->pieces, Piece, list) {
-        if (abs < abspos + p->size) {
-            *piece = p;
-            *offset = abs - abspos;
-            return true;
-        } else {
-            abspos += p->size;
-        }
+    // Windows are mapped and unmapped on their own, so only the page cache is advised for them.
+    // Pinned pages hold the only copy of the old contents of the file, and must not be dropped.
+    if (block->type == BLOCK_WINDOWED || (advice == ADVICE_DONTNEED && block->written)) {
+        return true;
     }
-
-    return false;
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t start = offset & ~(pagesize - 1);
+    return madvise(block->data + start, offset + len - start, madvice[advice]) == 0;
 }
 
-static void cache_put(PieceChain_t* file, Piece* piece) {
-    file->cache = piece;
+static size_t window_clip(Block* block, const unsigned char* data, size_t len) {
+    if (block == NULL || block->windows == NULL) {
+        return len;
+    }
+    size_t size = block->windows->size;
+    return MIN(len, size - (size_t) (data - block->data) % size);
+}
 
-#ifdef DEBUG
-    if (piece != NULL) {
-        // The piece we use as cache must use as a backing block the last one
-        // and must end exactly where the last block ends
-        Block* blk = list_last(&file->all_blocks, Block, list);
-        assert(piece->data + piece->size == blk->data + blk->len);
+static size_t window_clip_back(Block* block, const unsigned char* end, size_t len) {
+    if (block == NULL || block->windows == NULL) {
+        return len;
     }
-#endif
+    size_t size = block->windows->size;
+    return MIN(len, (size_t) (end - 1 - block->data) % size + 1);
 }
 
-static bool cache_insert(PieceChain_t* file, Piece* piece, size_t piece_offset, const unsigned char* data, size_t len) {
-    if (file->cache == NULL || file->cache != piece) {
+static bool window_map(Block* block, size_t index) {
+    size_t off = index * block->windows->size;
+    size_t len = MIN(block->windows->size, block->size - off);
+    if (mmap(block->data + off, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, block->fd, off) != MAP_FAILED) {
+        return true;
+    }
+
+    // Some files cannot be mapped: read the window in anonymous memory in their place
+    if (mmap(block->data + off, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        int err = errno;
+        window_unmap(block, index);
+        errno = err;
         return false;
     }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n;
+        while ((n = pread(block->fd, block->data + off + done, len - done, off + done)) == -1 && errno == EINTR);
+        if (n <= 0) {
+            int err = n == 0 ? EIO : errno;
+            window_unmap(block, index);
+            errno = err;
+            return false;
+        }
+        done += n;
+    }
+    mprotect(block->data + off, len, PROT_READ);
+    return true;
+}
 
-    // The cached piece must always be the last one created
-    Block* blk = list_last(&file->all_blocks, Block, list);
-    assert(piece->data + piece->size == blk->data + blk->len);
+static void window_unmap(Block* block, size_t index) {
+    // Mapping the reservation back over the window releases its pages.
+    // There is nothing sensible to do if this fails: the window just stays mapped.
+    size_t off = index * block->windows->size;
+    size_t len = MIN(block->windows->size, block->size - off);
+    mmap(block->data + off, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+}
 
-    // Insertion can happen only if the block can fit the new data
-    if (!block_can_fit(blk, len)) {
-        return false;
+static bool window_acquire(Block* block, const unsigned char* data) {
+    if (block == NULL || block->windows == NULL) {
+        return true;
     }
 
-    // Insert the data in the block
-    unsigned char* blk_insertion = blk->data + blk->len - (piece->size - piece_offset);
-    assert(blk_insertion >= blk->data);
-    if (blk_insertion == blk->data + blk->len) {
-        block_append(blk, data, len);
-    } else {
-        memmove(blk_insertion + len, blk_insertion, piece->size - piece_offset);
-        memmove(blk_insertion, data, len);
-        blk->len += len;
+    BlockWindows* w = block->windows;
+    size_t index = (size_t) (data - block->data) / w->size;
+    pthread_mutex_lock(&w->lock);
+
+    // Look for the window among the mapped ones, keeping track of the least recently used one nobody is reading
+    Window* slot = NULL;
+    Window* victim = NULL;
+    for (size_t i = 0; i < w->count; ++i) {
+        Window* s = &w->slots[i];
+        if (s->index == index) {
+            slot = s;
+            break;
+        }
+        if (!s->pinned && s->users == 0 && (victim == NULL || s->used < victim->used)) {
+            victim = s;
+        }
     }
 
-    // Update the counters
-    piece->size += len;
-    file->size += len;
-    Change* change = list_last(&file->pending_changes, Change, list);
-    change->replacement.len += len;
+    if (slot == NULL) {
+        if (w->mapped < w->max || victim == NULL) {
+            if (w->count == w->capacity) {
+                size_t capacity = MAX(w->capacity * 2, w->max);
+                Window* slots = realloc(w->slots, sizeof(Window) * capacity);
+                if (slots == NULL) {
+                    pthread_mutex_unlock(&w->lock);
+                    errno = ENOMEM;
+                    return false;
+                }
+                w->slots = slots;
+                w->capacity = capacity;
+            }
+            slot = &w->slots[w->count++];
+            w->mapped++;
+        } else {
+            window_unmap(block, victim->index);
+            slot = victim;
+        }
+        if (!window_map(block, index)) {
+            int err = errno;
+            *slot = w->slots[--w->count];
+            w->mapped--;
+            pthread_mutex_unlock(&w->lock);
+            errno = err;
+            return false;
+        }
+        slot->index = index;
+        slot->users = 0;
+        slot->pinned = false;
+    }
 
+    slot->users++;
+    slot->used = ++w->clock;
+    pthread_mutex_unlock(&w->lock);
     return true;
 }
 
-static bool cache_delete(PieceChain_t* file, Piece* piece, size_t piece_offset, size_t len) {
-    if (file->cache == NULL || file->cache != piece) {
-        return false;
+static void window_hold(Block* block, const unsigned char* data) {
+    // Used where a read cannot fail: data that cannot be mapped nor read
+    // is treated like a fault on a plain mapping would be
+    if (!window_acquire(block, data)) {
+        abort();
     }
-    
-    // The cached piece must always be the last one created
-    Block* blk = list_last(&file->all_blocks, Block, list);
-    assert(piece->data + piece->size == blk->data + blk->len);
+}
 
-    // Deletion can happen only if the whole deletion range is in the cached piece
-    if (piece->size - piece_offset < len) {
-        return false;
+static void window_release(Block* block, const unsigned char* data) {
+    if (block == NULL || block->windows == NULL) {
+        return;
     }
 
-    // Delete the data from the block
-    unsigned char* blk_del = blk->data + blk->len - (piece->size - piece_offset);
-    assert(blk_del >= blk->data);
-    if (blk_del < blk->data + blk->len) {
-        memmove(blk_del, blk_del + len, piece->size - piece_offset - len);
+    BlockWindows* w = block->windows;
+    size_t index = (size_t) (data - block->data) / w->size;
+    pthread_mutex_lock(&w->lock);
+    for (size_t i = 0; i < w->count; ++i) {
+        if (w->slots[i].index == index) {
+            w->slots[i].users--;
+            break;
+        }
     }
-    blk->len -= len;
-
-    // Update the counters
-    piece->size -= len;
-    file->size -= len;
-    Change* change = list_last(&file->pending_changes, Change, list);
-    change->replacement.len -= len;
+    pthread_mutex_unlock(&w->lock);
+}
 
+static bool window_pin(Block* block, size_t index) {
+    // Once its pages are made private, unmapping a window would lose them:
+    // pinned windows stay mapped for the whole life of the block, and do not count against the limit
+    const unsigned char* data = block->data + index * block->windows->size;
+    if (!window_acquire(block, data)) {
+        return false;
+    }
+    BlockWindows* w = block->windows;
+    pthread_mutex_lock(&w->lock);
+    for (size_t i = 0; i < w->count; ++i) {
+        if (w->slots[i].index == index && !w->slots[i].pinned) {
+            w->slots[i].pinned = true;
+            w->mapped--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    window_release(block, data);
     return true;
 }
 
-static void span_init(Span* span, Piece* start, Piece* end) {
-    span->start = start;
-    span->end = end;
-    if (start == NULL && end == NULL) {
-        span->len = 0;
-        return;
+static bool window_copy(Block* block, unsigned char* dst, const unsigned char* src, size_t len) {
+    while (len > 0) {
+        size_t n = window_clip(block, src, len);
+        if (!window_acquire(block, src)) {
+            return false;
+        }
+        memcpy(dst, src, n);
+        window_release(block, src);
+        dst += n;
+        src += n;
+        len -= n;
     }
-    assert(start != NULL && end != NULL);
+    return true;
+}
 
-    list_for_each_interval(p, start, end, Piece, list) {
-        span->len += p->size;
+static size_t window_count(Block* block, const unsigned char* data, size_t len, unsigned char c) {
+    size_t count = 0;
+    while (len > 0) {
+        size_t n = window_clip(block, data, len);
+        window_hold(block, data);
+        count += search_count(data, n, c);
+        window_release(block, data);
+        data += n;
+        len -= n;
     }
+    return count;
 }
 
-static void span_swap(PieceChain_t* file, Span* original, Span* replacement) {
-    if (original->len == 0 && replacement->len == 0) {
-        return;
-    } else if (original->len == 0) {
-        // An insertion
-        replacement->start->list.prev->next = &replacement->start->list;
-        replacement->end->list.next->prev = &replacement->end->list;
-    } else if (replacement->len == 0) {
-        // A deletion
-        original->start->list.prev->next = original->end->list.next;
-        original->end->list.next->prev = original->start->list.prev;
-    } else {
-        original->start->list.prev->next = &replacement->start->list;
-        original->end->list.next->prev = &replacement->end->list;
+static const unsigned char* window_nth(Block* block, const unsigned char* data, size_t len, unsigned char c, size_t n) {
+    while (len > 0) {
+        size_t k = window_clip(block, data, len);
+        window_hold(block, data);
+        size_t count = search_count(data, k, c);
+        const unsigned char* m = count >= n ? search_nth(data, k, c, n) : NULL;
+        window_release(block, data);
+        if (m != NULL) {
+            return m;
+        }
+        n -= count;
+        data += k;
+        len -= k;
     }
-    file->size -= original->len;
-    file->size += replacement->len;
+    return NULL;
 }
 
-static Change* change_alloc(PieceChain_t* file, size_t pos) {
-    Change* change = malloc(sizeof(Change));
-    if (change == NULL) {
+static Piece* piece_alloc(PieceChain_t* file, Block* block) {
+    Piece* piece = pool_alloc(&file->piece_pool);
+    if (piece == NULL) {
         set_error(file, "Out of memory", ENOMEM);
         return NULL;
     }
-    change->pos = pos;
-    span_init(&change->original, NULL, NULL);
-    span_init(&change->replacement, NULL, NULL);
+    piece->data = NULL;
+    piece->size = 0;
+    piece->block = block;
+    if (block_owned(file, block)) {
+        block->pieces++;
+    }
+    piece->lines = LINES_UNKNOWN;
+    list_init(&piece->list);
 
-    list_add_tail(&file->pending_changes, &change->list);
-    return change;
+    return piece;
 }
 
-static void change_free(Change* change, bool free_pieces) {
-    // We don't need to free the pieces of the original span, since they will be referenced by a previous change
-    if (free_pieces && change->replacement.start != NULL) {
-        list_for_each_interval(p, change->replacement.start, change->replacement.end, Piece, list) {
-            piece_free(p);
-        }
+static void piece_free(PieceChain_t* file, Piece* piece) {
+    Block* block = piece->block;
+    pool_free(&file->piece_pool, piece);
+    if (block_owned(file, block) && --block->pieces == 0) {
+        block_release(file, block);
     }
-    free(change);
 }
 
-static Revision* revision_alloc(PieceChain_t* file) {
-    Revision* rev = malloc(sizeof(Revision));
-    if (rev == NULL) {
-        set_error(file, "Out of memory", ENOMEM);
-        return NULL;
+static bool piece_find(PieceChain_t* file, size_t abs, Piece** piece, size_t* offset) {
+    if (abs >= file->size) {
+        return false;
+    }
+    COUNT(file, lookups, 1);
+
+    // Edits tend to be clustered, so first try to walk a few pieces from where the last lookup landed
+    if (file->cursor != NULL) {
+        Piece* p = file->cursor;
+        size_t off = file->cursor_offset;
+        for (int steps = 0; steps < CURSOR_MAX_STEPS; ++steps) {
+            COUNT(file, lookup_steps, 1);
+            if (abs < off) {
+                p = list_prev(p, Piece, list);
+                off -= p->size;
+            } else if (abs - off >= p->size) {
+                off += p->size;
+                p = list_next(p, Piece, list);
+            } else {
+                COUNT(file, cursor_hits, 1);
+                cursor_put(file, p, off);
+                *piece = p;
+                *offset = abs - off;
+                return true;
+            }
+        }
     }
-    list_init(&rev->changes);
-    list_init(&rev->list);
 
-    list_add_tail(&file->all_revisions, &rev->list);
+    // Descend the index choosing the subtree that contains the offset
+    size_t target = abs;
+    Piece* p = file->index;
+    while (p != NULL) {
+        size_t left_size = p->left != NULL ? p->left->subtree_size : 0;
+        COUNT(file, lookup_steps, 1);
+        if (abs < left_size) {
+            p = p->left;
+        } else if (abs - left_size < p->size) {
+            cursor_put(file, p, target - (abs - left_size));
+            *piece = p;
+            *offset = abs - left_size;
+            return true;
+        } else {
+            abs -= left_size + p->size;
+            p = p->right;
+        }
+    }
 
-    return rev;
+    return false;
 }
 
-static void revision_free(Revision* rev, bool free_pieces) {
-    list_for_each_rev_member(change, &rev->changes, Change, list) {
-        change_free(change, free_pieces);
+static void index_update(Piece* p) {
+    p->subtree_count = 1;
+    p->subtree_size = p->size;
+    p->subtree_lines = p->lines;
+    if (p->left != NULL) {
+        p->subtree_count += p->left->subtree_count;
+        p->subtree_size += p->left->subtree_size;
+        p->subtree_lines += p->left->subtree_lines;
+    }
+    if (p->right != NULL) {
+        p->subtree_count += p->right->subtree_count;
+        p->subtree_size += p->right->subtree_size;
+        p->subtree_lines += p->right->subtree_lines;
     }
-    free(rev);
 }
 
-static bool revision_purge(PieceChain_t* file) {
-
-    // The history of revisions is linear:
-    // If you undo a change, than perform a new operation, you cannot redo to the original state.
-    // This function purges any revision after the current active one:
-    // in other words, discards redo history.
-
-    if (list_empty(&file->all_revisions)) {
-        // No revision committed yet
-        return false;
+static void index_refresh(Piece* p) {
+    // Propagates a change of the size of a piece up to the root
+    for (; p != NULL; p = p->parent) {
+        index_update(p);
     }
+}
 
-    if (list_last(&file->all_revisions, Revision, list) == file->current_revision) {
-        // We are already at the last revision
-        return false;
+static Piece* index_merge(Piece* a, Piece* b) {
+    if (a == NULL) {
+        return b;
     }
-
-    list_for_each_rev_interval(rev, list_next(file->current_revision, Revision, list), list_last(&file->all_revisions, Revision, list), Revision, list) {
-        list_del(&rev->list);
-        revision_free(rev, true);
+    if (b == NULL) {
+        return a;
     }
 
-    assert(file->current_revision == list_last(&file->all_revisions, Revision, list));
-
-    return true;
-}
-
-PieceChain_t* piece_chain_open(const char* path) {
-
-    // Initialize a new File structure
-    PieceChain_t* file = calloc(1, sizeof(PieceChain_t));
-    if (file == NULL) {
-        errno = ENOMEM;
-        return NULL;
+    // All the pieces of `a` come before the ones of `b`,
+    // so we only have to preserve the heap property on the priorities
+    if (a->priority > b->priority) {
+        a->right = index_merge(a->right, b);
+        a->right->parent = a;
+        index_update(a);
+        return a;
+    } else {
+        b->left = index_merge(a, b->left);
+        b->left->parent = b;
+        index_update(b);
+        return b;
     }
-    list_init(&file->all_blocks);
-    list_init(&file->all_revisions);
-    list_init(&file->all_pieces);
-    list_init(&file->pieces);
-    list_init(&file->pending_changes);
-
-    if (path == NULL) {
-
-        // Allocate an initial empty revision
-        Revision* initial_rev = revision_alloc(file);
-        if (initial_rev == NULL) {
-            free(file);
-            return NULL;
-        }
-        file->current_revision = initial_rev;
+}
 
-        return file;
-    }
+static void index_split(Piece* root, size_t count, Piece** left, Piece** right) {
 
-    // Open the file r/w, if we fail try r/o
-    int fd;
-    errno = 0;
-    while ((fd = open(path, O_RDONLY)) == -1 && errno == EINTR);
-    if (errno != 0) {
-        piece_chain_destroy(file);
-        return NULL;
-    }
+    // Splits a tree so that the first `count` pieces end up in `*left` and the others in `*right`.
+    // Note that the parent pointers of the two resulting roots are not reset.
 
-    // Stat the file to get some info about it
-    struct stat s;
-    if (fstat(fd, &s) < 0) {
-        close(fd);
-        piece_chain_destroy(file);
-        return NULL;
+    if (root == NULL) {
+        *left = NULL;
+        *right = NULL;
+        return;
     }
 
-    // Get file size.
-    // Block devices need a specific ioctl.
-    size_t size = 0;
-    if (S_ISBLK(s.st_mode)) {
-        if (ioctl(fd, BLKGETSIZE64, &size) < 0) {
-            close(fd);
-            piece_chain_destroy(file);
-            return NULL;
+    size_t left_count = root->left != NULL ? root->left->subtree_count : 0;
+    if (count <= left_count) {
+        index_split(root->left, count, left, &root->left);
+        if (root->left != NULL) {
+            root->left->parent = root;
         }
-    } else if (S_ISREG(s.st_mode)) {
-        size = s.st_size;
+        *right = root;
     } else {
-        close(fd);
-        piece_chain_destroy(file);
-        return NULL;
+        index_split(root->right, count - left_count - 1, &root->right, right);
+        if (root->right != NULL) {
+            root->right->parent = root;
+        }
+        *left = root;
     }
+    index_update(root);
+}
 
-    // mmap the file to memory and create the initial piece
-    Piece* p = NULL;
-    if (size > 0) {
-        Block* b = block_alloc_mmap(file, fd, size);
-        if (b == NULL) {
-            close(fd);
-            piece_chain_destroy(file);
-            return NULL;
-        }
-        p = piece_alloc(file);
-        if (p == NULL) {
-            close(fd);
-            piece_chain_destroy(file);
-            return NULL;
+static size_t index_rank(Piece* p, size_t* offset) {
+    // Returns the number of active pieces preceding `p` in the chain,
+    // and, if `offset` is not NULL, the number of bytes preceding it
+    size_t rank = p->left != NULL ? p->left->subtree_count : 0;
+    size_t bytes = p->left != NULL ? p->left->subtree_size : 0;
+    for (; p->parent != NULL; p = p->parent) {
+        if (p->parent->right == p) {
+            Piece* sibling = p->parent->left;
+            rank += 1 + (sibling != NULL ? sibling->subtree_count : 0);
+            bytes += p->parent->size + (sibling != NULL ? sibling->subtree_size : 0);
         }
-        p->data = b->data;
-        p->size = b->size;
-        p->list.prev = &file->pieces;
-        p->list.next = &file->pieces;
     }
-
-    // Prepare the initial change
-    Change* change = change_alloc(file, 0);
-    if (change == NULL) {
-        piece_chain_destroy(file);
-        return NULL;
+    if (offset != NULL) {
+        *offset = bytes;
     }
-    span_init(&change->original, NULL, NULL);
-    span_init(&change->replacement, p, p);
-    span_swap(file, &change->original, &change->replacement);
+    return rank;
+}
 
-    // Commit the change to a revision
-    if (!piece_chain_commit(file)) {
-        piece_chain_destroy(file);
-        return NULL;
+static void index_update_all(Piece* p) {
+    if (p != NULL) {
+        index_update_all(p->left);
+        index_update_all(p->right);
+        index_update(p);
     }
+}
 
-    // Now that we have the file mapped in memory, we can safely close the fd
-    close(fd);
-
-    return file;
+static Piece* index_build(PieceChain_t* file, Piece* start, Piece* end) {
 
-}
+    // Builds a treap from the pieces linked from `start` to `end` in linear time:
+    // each piece is attached to the right spine of the tree built so far,
+    // below the last node with an higher priority.
 
-void piece_chain_destroy(PieceChain_t* file) {
-    if (file == NULL) {
-        return;
-    }
+    Piece* root = NULL;
+    Piece* last = NULL;
+    list_for_each_interval(p, start, end, Piece, list) {
 
-    piece_chain_commit(file); // Commits any pending change
+        // xorshift32
+        file->index_seed ^= file->index_seed << 13;
+        file->index_seed ^= file->index_seed >> 17;
+        file->index_seed ^= file->index_seed << 5;
+        p->priority = file->index_seed;
 
-    list_for_each_rev_member(rev, &file->all_revisions, Revision, list) {
-        // Note: here we are freeing revisions and changes, but not pieces.
-        // This is because we are going to free all the pieces later,
-        // and if we free some pieces without a proper undo, we end up with
-        // a screwed chain.
-        revision_free(rev, false);
-    }
+        // New pieces are counted the first time they enter the index
+        if (p->lines == LINES_UNKNOWN) {
+            p->lines = file->options.line_index ? lines_count(p->block, p->data, p->size) : 0;
+        }
 
-    list_for_each_rev_member(p, &file->all_pieces, Piece, global_list) {
-        piece_free(p);
-    }
+        Piece* parent = last;
+        Piece* child = NULL;
+        while (parent != NULL && parent->priority < p->priority) {
+            child = parent;
+            parent = parent->parent;
+        }
 
-    list_for_each_rev_member(b, &file->all_blocks, Block, list) {
-        block_free(file, b);
+        p->left = child;
+        p->right = NULL;
+        if (child != NULL) {
+            child->parent = p;
+        }
+        p->parent = parent;
+        if (parent != NULL) {
+            parent->right = p;
+        } else {
+            root = p;
+        }
+        last = p;
     }
 
-    free(file);
+    index_update_all(root);
+    return root;
 }
 
-static bool write_to_fd_visitor(PieceChain_t* file, size_t unused, const unsigned char* data, size_t len, void* user) {
-    (void) unused;
+static size_t index_swap(PieceChain_t* file, Span* original, Span* replacement) {
 
-    int fd = (int)(long) user;
+    // Mirrors in the index the relinking performed by `span_swap`:
+    // finds the range of active pieces that is going to be unlinked and replaces it with the new span.
+    // Returns the absolute offset at which the swap happens.
 
-    const size_t blocksize = 64 * 1024;
-    size_t offset = 0;
-    while (offset < len) {
-        ssize_t written;
-        while ((written = write(fd, data + offset, MIN(blocksize, len - offset))) == -1 && errno == EINTR);
-        if (written < 0) {
-            set_error(file, "Cannot write", errno);
-            return false;
+    size_t pos;
+    size_t count;
+    size_t offset;
+    if (original->len != 0) {
+        pos = index_rank(original->start, &offset);
+        count = index_rank(original->end, NULL) + 1 - pos;
+    } else {
+        struct list_head* prev = replacement->start->list.prev;
+        struct list_head* next = replacement->end->list.next;
+        size_t total = file->index != NULL ? file->index->subtree_count : 0;
+        if (prev == &file->pieces) {
+            pos = 0;
+            offset = 0;
+        } else {
+            Piece* p = container_of(prev, Piece, list);
+            pos = index_rank(p, &offset) + 1;
+            offset += p->size;
         }
-        offset += written;
+        count = (next == &file->pieces ? total : index_rank(container_of(next, Piece, list), NULL)) - pos;
     }
 
-    return true;
-}
+    Piece* left;
+    Piece* middle;
+    Piece* right;
+    index_split(file->index, pos, &left, &right);
+    index_split(right, count, &middle, &right);
 
-static bool write_to_fd(PieceChain_t* file, int fd) {
-    return piece_chain_visit(file, 0, file->size, write_to_fd_visitor, (void*)(long) fd);
-}
+    Piece* inserted = replacement->len != 0 ? index_build(file, replacement->start, replacement->end) : NULL;
+    file->index = index_merge(index_merge(left, inserted), right);
+    if (file->index != NULL) {
+        file->index->parent = NULL;
+    }
 
-static bool piece_chain_save_atomic(PieceChain_t* file, const char* path) {
+    return offset;
 
-    // File is first saved to a temp directory,
-    // then moved to the target destination with a rename.
-    // This will fail of the original file is a synbolic or hard link,
-    // and if there are problems in restoring the original file permissions.
+}
 
-    int oldfd = -1;
-    int dirfd = -1;
-    int tmpfd = -1;
-    char* tmpname = NULL;
-    char* pathdup = strdup(path);
+static bool lines_init(PieceChain_t* file, Block* block) {
 
-    if (pathdup == NULL) {
+    // Pieces of a mapped file can be huge, and are split over and over while editing:
+    // counting the newlines of each chunk once allows to count the ones of any piece
+    // looking only at the partial chunks at its ends.
+    size_t chunks = block->size / LINES_CHUNK;
+    block->lines = malloc(sizeof(size_t) * (chunks + 1));
+    if (block->lines == NULL) {
         set_error(file, "Out of memory", ENOMEM);
-        goto error;
-    }
-
-    // Open the original file and get some info about it
-    while ((oldfd = open(path, O_RDONLY)) == -1 && errno == EINTR);
-    if (oldfd < 0 && errno != ENOENT) {
-        set_error(file, "Cannot open file", errno);
-        goto error;
+        return false;
     }
-    struct stat oldstat = { 0 };
-    if (oldfd != -1) {
-        if (lstat(path, &oldstat) < 0) {
-            set_error(file, "Cannot stat file", errno);
-            goto error;
-        }
-
-        // The rename method does not work if the target is not a regular file or if it is a hard link
-        if (!S_ISREG(oldstat.st_mode) || oldstat.st_nlink > 1) {
-			goto error;
-        }
+    block->lines[0] = 0;
+    for (size_t i = 0; i < chunks; ++i) {
+        block->lines[i + 1] = block->lines[i] + window_count(block, block->data + i * LINES_CHUNK, LINES_CHUNK, '\n');
     }
+    return true;
+}
 
-    size_t tmpnamelen = strlen(path) + 6 /* ~~save */ + 1 /* '\0' */;
-    tmpname = malloc(sizeof(char) * tmpnamelen);
-    if (tmpname == NULL) {
-        set_error(file, "Out of memory", ENOMEM);
-        goto error;
+static size_t lines_count(Block* block, const unsigned char* data, size_t len) {
+    if (block == NULL || block->lines == NULL) {
+        return window_count(block, data, len, '\n');
     }
-    snprintf(tmpname, tmpnamelen, "%s~~save", path);
 
-    // Create the temp file
-    while ((tmpfd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, oldfd == -1 ? 0666 : oldstat.st_mode)) == -1 && errno == EINTR);
-    if (tmpfd < 0) {
-        set_error(file, "Cannot open temp file", errno);
-        goto error;
+    // Whole chunks come from the precomputed counts
+    size_t start = data - block->data;
+    size_t end = start + len;
+    size_t first = (start + LINES_CHUNK - 1) / LINES_CHUNK;
+    size_t last = end / LINES_CHUNK;
+    if (first >= last) {
+        return window_count(block, data, len, '\n');
     }
+    return window_count(block, data, first * LINES_CHUNK - start, '\n')
+        + block->lines[last] - block->lines[first]
+        + window_count(block, block->data + last * LINES_CHUNK, end - last * LINES_CHUNK, '\n');
+}
 
-    // If the old file existed, try to copy the owner to the temp file
-    int res;
-    if (oldfd != -1) {
-        if (oldstat.st_uid != getuid()) {
-            while ((res = fchown(tmpfd, oldstat.st_uid, (uid_t) -1)) == -1 && errno == EINTR);
-            if (res < 0) {
-                goto error;
+static size_t lines_find(Block* block, const unsigned char* data, size_t len, size_t n) {
+
+    // Returns the offset of the n-th newline (starting from 1), which must exist
+    if (block != NULL && block->lines != NULL) {
+        size_t start = data - block->data;
+        size_t first = (start + LINES_CHUNK - 1) / LINES_CHUNK;
+        size_t last = (start + len) / LINES_CHUNK;
+        size_t head = first * LINES_CHUNK - start;
+        if (first < last) {
+            size_t in_head = window_count(block, data, head, '\n');
+            size_t in_middle = block->lines[last] - block->lines[first];
+            if (n > in_head + in_middle) {
+                const unsigned char* m = window_nth(block, block->data + last * LINES_CHUNK, start + len - last * LINES_CHUNK, '\n', n - in_head - in_middle);
+                assert(m != NULL);
+                return m - data;
             }
-        }
-        if (oldstat.st_gid != getgid()) {
-            while ((res = fchown(tmpfd, (uid_t) -1, oldstat.st_gid)) == -1 && errno == EINTR);
-            if (res < 0) {
-                goto error;
+            if (n > in_head) {
+
+                // Binary search of the chunk containing the newline
+                size_t target = block->lines[first] + n - in_head;
+                size_t lo = first;
+                size_t hi = last;
+                while (hi - lo > 1) {
+                    size_t mid = lo + (hi - lo) / 2;
+                    if (block->lines[mid] < target) {
+                        lo = mid;
+                    } else {
+                        hi = mid;
+                    }
+                }
+                const unsigned char* m = window_nth(block, block->data + lo * LINES_CHUNK, LINES_CHUNK, '\n', target - block->lines[lo]);
+                assert(m != NULL);
+                return m - data;
             }
         }
     }
+    const unsigned char* m = window_nth(block, data, len, '\n', n);
+    assert(m != NULL);
+    return m - data;
+}
 
-    // We don't need the old file anymore
-    if (oldfd != -1 ) {
-        close(oldfd);
-        oldfd = -1;
-    }
+static void cursor_put(PieceChain_t* file, Piece* piece, size_t offset) {
+    file->cursor = piece;
+    file->cursor_offset = offset;
+}
 
-    // Write to the temp file
-    if (!write_to_fd(file, tmpfd)) {
-        goto error;
+static void cursor_resize(PieceChain_t* file, Piece* piece, size_t old_size) {
+
+    // The size of `piece` changed in place: the cursor is still valid if it points to the piece itself,
+    // while if it points to the following one we can just shift it.
+    // Lookups always move the cursor to the piece being edited, so anything else is unlikely.
+
+    if (file->cursor == NULL || file->cursor == piece) {
+        return;
     }
-    
-    while ((res = fsync(tmpfd)) == -1 && errno == EINTR);
-    if (res < 0) {
-        set_error(file, "Cannot fsync temp file", errno);
-        goto error;
+    if (piece->list.next == &file->cursor->list) {
+        file->cursor_offset = file->cursor_offset - old_size + piece->size;
+    } else {
+        cursor_put(file, NULL, 0);
     }
+}
 
-    while ((res = close(tmpfd)) == -1 && errno == EINTR);
-    if (res < 0) {
-        set_error(file, "Cannot close temp file", errno);
-        goto error;
-    }
+static void cache_put(PieceChain_t* file, Piece* piece) {
+    file->cache = piece;
 
-    // Move the temp file over the original one
-    while ((res = rename(tmpname, path)) == -1 && errno == EINTR);
-    if (res < 0) {
-        set_error(file, "Cannot rename temp flie to destination", errno);
-        goto error;
+#ifdef DEBUG
+    if (piece != NULL) {
+        // The piece we use as cache must use as a backing block the last one
+        // and must end exactly where the last block ends
+        Block* blk = list_last(&file->all_blocks, Block, list);
+        assert(piece->data + piece->size == blk->data + blk->len);
     }
+#endif
+}
+
+static bool cache_insert(PieceChain_t* file, Piece* piece, size_t piece_offset, const unsigned char* data, size_t len) {
+    if (file->cache == NULL || file->cache != piece) {
+        return false;
+    }
+
+    // The cached piece must always be the last one created
+    Block* blk = list_last(&file->all_blocks, Block, list);
+    assert(piece->data + piece->size == blk->data + blk->len);
+
+    // Insertion can happen only if the block can fit the new data
+    if (!block_can_fit(blk, len)) {
+        return false;
+    }
+
+    // Insert the data in the block
+    unsigned char* blk_insertion = blk->data + blk->len - (piece->size - piece_offset);
+    assert(blk_insertion >= blk->data);
+    if (blk_insertion == blk->data + blk->len) {
+        block_append(blk, data, len);
+    } else {
+        memmove(blk_insertion + len, blk_insertion, piece->size - piece_offset);
+        memmove(blk_insertion, data, len);
+        blk->len += len;
+    }
+
+    // Update the counters
+    piece->size += len;
+    if (file->options.line_index) {
+        piece->lines += search_count(data, len, '\n');
+    }
+    index_refresh(piece);
+    cursor_resize(file, piece, piece->size - len);
+    file->size += len;
+    Change* change = list_last(&file->pending_changes, Change, list);
+    change->replacement.len += len;
+
+    return true;
+}
+
+static bool cache_delete(PieceChain_t* file, Piece* piece, size_t piece_offset, size_t len) {
+    if (file->cache == NULL || file->cache != piece) {
+        return false;
+    }
+    
+    // The cached piece must always be the last one created
+    Block* blk = list_last(&file->all_blocks, Block, list);
+    assert(piece->data + piece->size == blk->data + blk->len);
+
+    // Deletion can happen only if the whole deletion range is in the cached piece
+    if (piece->size - piece_offset < len) {
+        return false;
+    }
+
+    // Delete the data from the block
+    unsigned char* blk_del = blk->data + blk->len - (piece->size - piece_offset);
+    assert(blk_del >= blk->data);
+    if (file->options.line_index) {
+        piece->lines -= search_count(blk_del, len, '\n');
+    }
+    if (blk_del < blk->data + blk->len) {
+        memmove(blk_del, blk_del + len, piece->size - piece_offset - len);
+    }
+    blk->len -= len;
+
+    // Update the counters
+    piece->size -= len;
+    index_refresh(piece);
+    cursor_resize(file, piece, piece->size + len);
+    file->size -= len;
+    Change* change = list_last(&file->pending_changes, Change, list);
+    change->replacement.len -= len;
+
+    return true;
+}
+
+static bool cache_replace(PieceChain_t* file, Piece* piece, size_t piece_offset, const unsigned char* data, size_t len) {
+    if (file->cache == NULL || file->cache != piece) {
+        return false;
+    }
+
+    // The cached piece must always be the last one created
+    Block* blk = list_last(&file->all_blocks, Block, list);
+    assert(piece->data + piece->size == blk->data + blk->len);
+
+    // A range entirely inside the cached piece can be overwritten in place
+    if (piece->size - piece_offset >= len) {
+        if (file->options.line_index) {
+            piece->lines -= search_count(piece->data + piece_offset, len, '\n');
+            piece->lines += search_count(data, len, '\n');
+            index_refresh(piece);
+        }
+        memmove(piece->data + piece_offset, data, len);
+        return true;
+    }
+
+    // When overwriting sequentially, the range starts right after the cached piece.
+    // If the following piece has been created by the same pending change, nobody else references it,
+    // so we can append the data to the cached piece and shrink the following one.
+    Change* change = list_last(&file->pending_changes, Change, list);
+    if (piece_offset != piece->size || change->replacement.end == piece || !block_can_fit(blk, len)) {
+        return false;
+    }
+    Piece* next = list_next(piece, Piece, list);
+    if (next->size < len) {
+        return false;
+    }
+
+    if (file->options.line_index) {
+        size_t lines = search_count(data, len, '\n');
+        piece->lines += lines;
+        next->lines -= lines_count(next->block, next->data, len);
+    }
+    block_append(blk, data, len);
+
+    // A following piece overwritten entirely is unlinked, both from the chain and from the pending change
+    if (next->size == len) {
+        Piece* left;
+        Piece* middle;
+        Piece* right;
+        index_split(file->index, index_rank(next, NULL), &left, &right);
+        index_split(right, 1, &middle, &right);
+        file->index = index_merge(left, right);
+        file->index->parent = NULL;
+        if (change->replacement.end == next) {
+            change->replacement.end = piece;
+        }
+        if (file->cursor != NULL && (file->cursor == next || next->list.next == &file->cursor->list)) {
+            cursor_put(file, NULL, 0);
+        }
+        list_del(&next->list);
+        piece_free(file, next);
+
+        piece->size += len;
+        index_refresh(piece);
+        cursor_resize(file, piece, piece->size - len);
+        return true;
+    }
+
+    piece->size += len;
+    index_refresh(piece);
+    cursor_resize(file, piece, piece->size - len);
+    next->data += len;
+    next->size -= len;
+    index_refresh(next);
+    cursor_resize(file, next, next->size + len);
+
+    return true;
+}
+
+static void span_init(Span* span, Piece* start, Piece* end) {
+    span->start = start;
+    span->end = end;
+    if (start == NULL && end == NULL) {
+        span->len = 0;
+        return;
+    }
+    assert(start != NULL && end != NULL);
+
+    list_for_each_interval(p, start, end, Piece, list) {
+        span->len += p->size;
+    }
+}
+
+static size_t span_swap(PieceChain_t* file, Span* original, Span* replacement) {
+
+    // Returns the offset at which the swap took place
+    if (original->len == 0 && replacement->len == 0) {
+        return 0;
+    }
+
+    // Leave the cursor at the location of the swap, where the next edit will most likely happen
+    size_t offset = index_swap(file, original, replacement);
+    if (replacement->len != 0) {
+        cursor_put(file, replacement->start, offset);
+    } else if (original->end->list.next != &file->pieces) {
+        cursor_put(file, list_next(original->end, Piece, list), offset);
+    } else {
+        cursor_put(file, NULL, 0);
+    }
+
+    if (original->len == 0) {
+        // An insertion
+        replacement->start->list.prev->next = &replacement->start->list;
+        replacement->end->list.next->prev = &replacement->end->list;
+    } else if (replacement->len == 0) {
+        // A deletion
+        original->start->list.prev->next = original->end->list.next;
+        original->end->list.next->prev = original->start->list.prev;
+    } else {
+        original->start->list.prev->next = &replacement->start->list;
+        original->end->list.next->prev = &replacement->end->list;
+    }
+    file->size -= original->len;
+    file->size += replacement->len;
+    return offset;
+}
+
+static Change* change_alloc(PieceChain_t* file, size_t pos) {
+    Change* change = pool_alloc(&file->change_pool);
+    if (change == NULL) {
+        set_error(file, "Out of memory", ENOMEM);
+        return NULL;
+    }
+    change->pos = pos;
+    span_init(&change->original, NULL, NULL);
+    span_init(&change->replacement, NULL, NULL);
+
+    list_add_tail(&file->pending_changes, &change->list);
+    return change;
+}
+
+static void change_free(PieceChain_t* file, Change* change, bool free_pieces) {
+    // We don't need to free the pieces of the original span, since they will be referenced by a previous change
+    if (free_pieces && change->replacement.start != NULL) {
+        list_for_each_interval(p, change->replacement.start, change->replacement.end, Piece, list) {
+            piece_free(file, p);
+        }
+    }
+    pool_free(&file->change_pool, change);
+}
+
+static Revision* revision_alloc(PieceChain_t* file) {
+    Revision* rev = pool_alloc(&file->revision_pool);
+    if (rev == NULL) {
+        set_error(file, "Out of memory", ENOMEM);
+        return NULL;
+    }
+    rev->id = ++file->revision_ids;
+    rev->parent = NULL;
+    rev->redo = NULL;
+    rev->depth = 0;
+    rev->mark = false;
+    list_init(&rev->changes);
+    list_init(&rev->list);
+
+    list_add_tail(&file->all_revisions, &rev->list);
+
+    return rev;
+}
+
+static void revision_free(PieceChain_t* file, Revision* rev, bool free_pieces) {
+    list_for_each_rev_member(change, &rev->changes, Change, list) {
+        change_free(file, change, free_pieces);
+    }
+    pool_free(&file->revision_pool, rev);
+}
+
+static bool revision_purge(PieceChain_t* file) {
+
+    // This function purges any revision which is not an ancestor of the current active one:
+    // in other words, discards redo history. Undo tree mode never discards any branch.
+    assert(!file->options.undo_tree);
+
+    if (list_empty(&file->all_revisions)) {
+        // No revision committed yet
+        return false;
+    }
+
+    if (list_last(&file->all_revisions, Revision, list) == file->current_revision) {
+        // We are already at the last revision
+        return false;
+    }
+
+    // The history is linear, so the redo history is made of the revisions after the current one
+    list_for_each_rev_interval(rev, list_next(file->current_revision, Revision, list), list_last(&file->all_revisions, Revision, list), Revision, list) {
+        list_del(&rev->list);
+        revision_free(file, rev, true);
+    }
+    file->current_revision->redo = NULL;
+
+    assert(file->current_revision == list_last(&file->all_revisions, Revision, list));
+
+    return true;
+}
+
+static void revision_branch(PieceChain_t* file) {
+
+    // A new edit after an undo discards the redo history,
+    // unless in undo tree mode, where it starts a new branch from the current revision
+    if (!file->options.undo_tree) {
+        revision_purge(file);
+    }
+}
+
+static void revision_mark(PieceChain_t* file, Revision* rev) {
+    // Marks `rev` with all its ancestors
+    list_for_each_member(r, &file->all_revisions, Revision, list) {
+        r->mark = false;
+    }
+    for (; rev != NULL; rev = rev->parent) {
+        rev->mark = true;
+    }
+}
+
+static Revision* revision_find(PieceChain_t* file, uint64_t id) {
+    // Recent revisions are the most likely targets
+    list_for_each_rev_member(rev, &file->all_revisions, Revision, list) {
+        if (rev->id == id) {
+            return rev;
+        }
+        if (rev->id < id) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void revision_undo(PieceChain_t* file, size_t* pos) {
+
+    // Revert all the changes in the current revision, going back to its parent
+    Revision* rev = file->current_revision;
+    list_for_each_rev_member(c, &rev->changes, Change, list) {
+        size_t offset = span_swap(file, &c->replacement, &c->original);
+        journal_swap(file, offset, &c->replacement, &c->original);
+        *pos = c->pos;
+    }
+    file->current_revision = rev->parent;
+    file->current_revision->redo = rev;
+}
+
+static void revision_redo(PieceChain_t* file, Revision* rev, size_t* pos) {
+
+    // Reapply the changes in a child of the current revision
+    list_for_each_member(c, &rev->changes, Change, list) {
+        size_t offset = span_swap(file, &c->original, &c->replacement);
+        journal_swap(file, offset, &c->original, &c->replacement);
+        *pos = c->pos;
+    }
+    file->current_revision->redo = rev;
+    file->current_revision = rev;
+}
+
+static void history_forget(PieceChain_t* file, Revision* rev) {
+
+    // The revision is becoming the first one, so its changes will never be undone:
+    // the pieces they replaced are not referenced by anything else, and can go.
+    // Unlike replacements, the original spans of the undo history are still intact,
+    // since their pieces have not been part of the chain since the change.
+    list_for_each_member(c, &rev->changes, Change, list) {
+        if (c->original.start != NULL) {
+            list_for_each_interval(p, c->original.start, c->original.end, Piece, list) {
+                piece_free(file, p);
+            }
+            span_init(&c->original, NULL, NULL);
+        }
+    }
+}
+
+static bool history_drop(PieceChain_t* file) {
+
+    // Drops the first revision of the history, but never the current one.
+    // Returns false if there was nothing to drop.
+    Revision* first = list_first(&file->all_revisions, Revision, list);
+    if (first == file->current_revision) {
+        return false;
+    }
+    Revision* next = list_next(first, Revision, list);
+
+    if (file->options.undo_tree) {
+
+        // The child leading to the current revision becomes the first one,
+        // and the branches starting from the other children go along with the first revision
+        revision_mark(file, file->current_revision);
+        list_for_each_member(rev, &file->all_revisions, Revision, list) {
+            if (rev->mark && rev->parent == first) {
+                next = rev;
+            }
+        }
+        list_for_each_member(rev, &file->all_revisions, Revision, list) {
+            if (rev != first && rev->parent != first && rev->parent->mark) {
+                rev->mark = true;
+            }
+        }
+        list_for_each_rev_member(rev, &file->all_revisions, Revision, list) {
+            if (!rev->mark) {
+                list_del(&rev->list);
+                revision_free(file, rev, true);
+            }
+        }
+    }
+
+    history_forget(file, first);
+    history_forget(file, next);
+    list_del(&first->list);
+    revision_free(file, first, false);
+    next->parent = NULL;
+    return true;
+}
+
+static void history_trim(PieceChain_t* file) {
+    // Blocks are released as soon as the last piece pointing into them is freed
+    while (file->heap_size > file->options.history_budget && history_drop(file));
+}
+
+static bool journal_reserve(PieceChain_t* file, size_t len) {
+    if (file->journal_cap - file->journal_len >= len) {
+        return true;
+    }
+    size_t cap = MAX(file->journal_cap * 2, file->journal_len + len);
+    unsigned char* buf = realloc(file->journal_buf, cap);
+    if (buf == NULL) {
+        set_error(file, "Out of memory", ENOMEM);
+        return false;
+    }
+    file->journal_buf = buf;
+    file->journal_cap = cap;
+    return true;
+}
+
+static void journal_put(PieceChain_t* file, const void* data, size_t len) {
+    // The space must have been reserved already
+    memcpy(file->journal_buf + file->journal_len, data, len);
+    file->journal_len += len;
+}
+
+static void journal_put_size(PieceChain_t* file, size_t n) {
+    uint64_t v = n;
+    journal_put(file, &v, sizeof(v));
+}
+
+static bool journal_record(PieceChain_t* file, unsigned char type, size_t offset, size_t len, const unsigned char* data) {
+
+    // Adds an insertion, a deletion or a replacement to the records not written yet.
+    // `data` is NULL for deletions.
+    if (file->journal_fd == -1 || len == 0) {
+        return true;
+    }
+    if (!journal_reserve(file, JOURNAL_RECORD_SIZE + (data != NULL ? len : 0))) {
+        return false;
+    }
+    journal_put(file, &type, 1);
+    journal_put_size(file, offset);
+    journal_put_size(file, len);
+    if (data != NULL) {
+        journal_put(file, data, len);
+    }
+    return true;
+}
+
+static bool journal_edits(PieceChain_t* file, const PieceChainEdit_t* edits, size_t n) {
+    if (file->journal_fd == -1) {
+        return true;
+    }
+    size_t size = 1 + sizeof(uint64_t);
+    for (size_t i = 0; i < n; ++i) {
+        size += 3 * sizeof(uint64_t) + edits[i].len;
+    }
+    if (!journal_reserve(file, size)) {
+        return false;
+    }
+    unsigned char type = JOURNAL_EDITS;
+    journal_put(file, &type, 1);
+    journal_put_size(file, n);
+    for (size_t i = 0; i < n; ++i) {
+        journal_put_size(file, edits[i].offset);
+        journal_put_size(file, edits[i].delete_len);
+        journal_put_size(file, edits[i].len);
+        journal_put(file, edits[i].data, edits[i].len);
+    }
+    return true;
+}
+
+static void journal_swap(PieceChain_t* file, size_t offset, Span* removed, Span* inserted) {
+
+    // Undo and redo are journaled as the edits they make, so that replaying them does not depend
+    // on the history the journal started from. Since they have already happened,
+    // a record that cannot be written makes the rest of the journal meaningless.
+    if (file->journal_fd == -1) {
+        return;
+    }
+    if (!journal_reserve(file, 2 * JOURNAL_RECORD_SIZE + inserted->len)) {
+        journal_abandon(file);
+        return;
+    }
+    if (removed->len != 0) {
+        journal_record(file, JOURNAL_DELETE, offset, removed->len, NULL);
+    }
+    if (inserted->len != 0) {
+        unsigned char type = JOURNAL_INSERT;
+        journal_put(file, &type, 1);
+        journal_put_size(file, offset);
+        journal_put_size(file, inserted->len);
+        list_for_each_interval(p, inserted->start, inserted->end, Piece, list) {
+            if (!window_copy(p->block, file->journal_buf + file->journal_len, p->data, p->size)) {
+                journal_abandon(file);
+                return;
+            }
+            file->journal_len += p->size;
+        }
+    }
+}
+
+static bool journal_flush(PieceChain_t* file, unsigned char type) {
+
+    // Writes the records not written yet, closing them with a commit or a group record
+    if (file->journal_fd == -1 || file->journal_len == 0) {
+        return true;
+    }
+    if (!journal_reserve(file, 1)) {
+        return false;
+    }
+    journal_put(file, &type, 1);
+    if (!write_all(file, file->journal_fd, file->journal_buf, file->journal_len)) {
+        // Drop whatever made it to the disk, so that the next attempt starts from a complete journal
+        int err = errno;
+        while (ftruncate(file->journal_fd, file->journal_size) == -1 && errno == EINTR);
+        file->journal_len--;
+        set_error(file, "Cannot write the journal", err);
+        return false;
+    }
+    file->journal_size += file->journal_len;
+    file->journal_len = 0;
+    return true;
+}
+
+static void journal_abandon(PieceChain_t* file) {
+    // Stops journaling: what has been written so far is still a valid journal, just not an up to date one
+    close(file->journal_fd);
+    file->journal_fd = -1;
+    file->journal_len = 0;
+}
+
+static bool journal_header(const char* path, unsigned char* out) {
+
+    // The header ties the journal to the contents of the file the edits apply to
+    uint64_t fields[3] = { 0, 0, 0 };
+    if (path != NULL) {
+        struct stat s;
+        if (stat(path, &s) < 0) {
+            return false;
+        }
+        fields[0] = (uint64_t) s.st_size;
+        fields[1] = (uint64_t) s.st_mtim.tv_sec;
+        fields[2] = (uint64_t) s.st_mtim.tv_nsec;
+    }
+    memcpy(out, JOURNAL_MAGIC, 4);
+    memcpy(out + 4, fields, sizeof(fields));
+    return true;
+}
+
+static bool journal_take(const unsigned char** pos, const unsigned char* end, size_t len, const unsigned char** out) {
+    if ((size_t) (end - *pos) < len) {
+        return false;
+    }
+    *out = *pos;
+    *pos += len;
+    return true;
+}
+
+static bool journal_take_size(const unsigned char** pos, const unsigned char* end, size_t* out) {
+    const unsigned char* p;
+    if (!journal_take(pos, end, sizeof(uint64_t), &p)) {
+        return false;
+    }
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    *out = v;
+    return true;
+}
+
+static bool journal_replay(PieceChain_t* file, const unsigned char* pos, const unsigned char* end, const unsigned char** valid) {
+
+    // Walks the records between `pos` and `end`. If `valid` is NULL, the records are applied to the chain,
+    // otherwise `*valid` is left pointing past the last commit, since anything after it is the tail
+    // of a write interrupted by a crash. Returns false if a record cannot be read or applied.
+    while (pos < end) {
+        unsigned char type = *pos++;
+        size_t offset, len, n;
+        const unsigned char* data;
+        bool ok = true;
+        switch (type) {
+            case JOURNAL_INSERT:
+            case JOURNAL_REPLACE:
+                if (!journal_take_size(&pos, end, &offset) || !journal_take_size(&pos, end, &len) || !journal_take(&pos, end, len, &data)) {
+                    return false;
+                }
+                if (valid == NULL) {
+                    ok = type == JOURNAL_INSERT ? piece_chain_insert(file, offset, data, len) : piece_chain_replace(file, offset, data, len);
+                }
+                break;
+            case JOURNAL_DELETE:
+                if (!journal_take_size(&pos, end, &offset) || !journal_take_size(&pos, end, &len)) {
+                    return false;
+                }
+                if (valid == NULL) {
+                    ok = piece_chain_delete(file, offset, len);
+                }
+                break;
+            case JOURNAL_EDITS: {
+                if (!journal_take_size(&pos, end, &n) || n > (size_t) (end - pos) / (3 * sizeof(uint64_t))) {
+                    return false;
+                }
+                PieceChainEdit_t* edits = valid == NULL ? malloc(sizeof(PieceChainEdit_t) * MAX(n, (size_t) 1)) : NULL;
+                if (valid == NULL && edits == NULL) {
+                    set_error(file, "Out of memory", ENOMEM);
+                    return false;
+                }
+                for (size_t i = 0; i < n && ok; ++i) {
+                    PieceChainEdit_t e;
+                    ok = journal_take_size(&pos, end, &e.offset) && journal_take_size(&pos, end, &e.delete_len) &&
+                         journal_take_size(&pos, end, &e.len) && journal_take(&pos, end, e.len, &e.data);
+                    if (ok && edits != NULL) {
+                        edits[i] = e;
+                    }
+                }
+                if (ok && edits != NULL) {
+                    ok = piece_chain_apply_edits(file, edits, n);
+                }
+                free(edits);
+                break;
+            }
+            case JOURNAL_COMMIT:
+            case JOURNAL_GROUP:
+                // The edits of a group stay pending, as they were when the journal was written
+                if (valid != NULL) {
+                    *valid = pos;
+                } else if (type == JOURNAL_COMMIT) {
+                    ok = chain_commit(file);
+                }
+                break;
+            default:
+                return false;
+        }
+        if (!ok) {
+            if (file->last_error.message == NULL) {
+                set_error(file, "Corrupted journal", EINVAL);
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool journal_load(PieceChain_t* file, int fd, const char* path) {
+
+    unsigned char header[JOURNAL_HEADER_SIZE];
+    if (!journal_header(path, header)) {
+        set_error(file, "Cannot stat", errno);
+        return false;
+    }
+    struct stat s;
+    if (fstat(fd, &s) < 0) {
+        set_error(file, "Cannot stat", errno);
+        return false;
+    }
+
+    // A new journal just needs its header
+    if (s.st_size == 0) {
+        if (!write_all(file, fd, header, JOURNAL_HEADER_SIZE)) {
+            return false;
+        }
+        file->journal_size = JOURNAL_HEADER_SIZE;
+        return true;
+    }
+
+    void* map = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        set_error(file, "Cannot mmap", errno);
+        return false;
+    }
+    const unsigned char* start = map;
+    const unsigned char* end = start + s.st_size;
+    if ((size_t) s.st_size < JOURNAL_HEADER_SIZE || memcmp(start, header, JOURNAL_HEADER_SIZE) != 0) {
+        munmap(map, s.st_size);
+        set_error(file, "The journal does not belong to the file", EINVAL);
+        return false;
+    }
+
+    // Find where the last complete commit ends, then replay everything up to there
+    const unsigned char* valid = start + JOURNAL_HEADER_SIZE;
+    journal_replay(file, valid, end, &valid);
+    file->last_error.message = NULL;
+    bool success = journal_replay(file, start + JOURNAL_HEADER_SIZE, valid, NULL);
+    munmap(map, s.st_size);
+    if (!success) {
+        return false;
+    }
+
+    file->journal_size = valid - start;
+    if (file->journal_size < (size_t) s.st_size) {
+        while (ftruncate(fd, file->journal_size) == -1) {
+            if (errno != EINTR) {
+                set_error(file, "Cannot truncate", errno);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool journal_reset(PieceChain_t* file, const char* path) {
+
+    // The saved file is the new starting point of the journal, and the unwritten records are already in it
+    unsigned char header[JOURNAL_HEADER_SIZE];
+    if (!journal_header(path, header)) {
+        set_error(file, "Cannot stat", errno);
+        return false;
+    }
+    file->journal_len = 0;
+    while (ftruncate(file->journal_fd, 0) == -1) {
+        if (errno != EINTR) {
+            set_error(file, "Cannot truncate", errno);
+            return false;
+        }
+    }
+    if (!write_all(file, file->journal_fd, header, JOURNAL_HEADER_SIZE)) {
+        return false;
+    }
+    file->journal_size = JOURNAL_HEADER_SIZE;
+    return true;
+}
+
+PieceChain_t* piece_chain_open(const char* path) {
+    return piece_chain_open_ex(path, NULL);
+}
+
+static atomic_uint_fast64_t chain_ids = 1;
+
+static PieceChain_t* chain_alloc(const PieceChainOptions_t* options) {
+
+    // Initialize a new File structure
+    PieceChain_t* file = calloc(1, sizeof(PieceChain_t));
+    if (file == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Fill in the defaults for the options not specified
+    if (options != NULL) {
+        file->options = *options;
+    }
+    if (file->options.max_block_size == 0) {
+        file->options.max_block_size = MEM_BLOCK_SIZE;
+    }
+    if (file->options.initial_block_size == 0) {
+        file->options.initial_block_size = MIN(MEM_BLOCK_INITIAL_SIZE, file->options.max_block_size);
+    }
+    file->next_block_size = MIN(file->options.initial_block_size, file->options.max_block_size);
+    if (file->options.max_windows == 0) {
+        file->options.max_windows = WINDOW_MAX_COUNT;
+    }
+
+    list_init(&file->all_blocks);
+    list_init(&file->free_blocks);
+    list_init(&file->all_revisions);
+    list_init(&file->pieces);
+    list_init(&file->pending_changes);
+    file->index_seed = 2463534242u;
+    file->journal_fd = -1;
+    file->id = atomic_fetch_add_explicit(&chain_ids, 1, memory_order_relaxed);
+    atomic_init(&file->saved_edits, 0);
+    pthread_mutex_init(&file->saves_lock, NULL);
+    pthread_cond_init(&file->saves_done, NULL);
+    pool_init(&file->piece_pool, sizeof(Piece));
+    pool_init(&file->change_pool, sizeof(Change));
+    pool_init(&file->revision_pool, sizeof(Revision));
+
+    return file;
+
+}
+
+static bool fd_size(int fd, const struct stat* s, size_t* size) {
+    // Block devices need a specific ioctl
+    if (S_ISBLK(s->st_mode)) {
+        uint64_t bytes;
+        if (ioctl(fd, BLKGETSIZE64, &bytes) < 0) {
+            return false;
+        }
+        *size = bytes;
+        return true;
+    } else if (S_ISREG(s->st_mode)) {
+        *size = s->st_size;
+        return true;
+    }
+    errno = EINVAL;
+    return false;
+}
+
+static PieceChain_t* chain_load_fd(PieceChain_t* file, int fd) {
+
+    // Stat the file to get some info about it
+    struct stat s;
+    if (fstat(fd, &s) < 0) {
+        close(fd);
+        piece_chain_destroy(file);
+        return NULL;
+    }
+
+    // Get file size
+    size_t size = 0;
+    if (!fd_size(fd, &s, &size)) {
+        int err = errno;
+        close(fd);
+        piece_chain_destroy(file);
+        errno = err;
+        return NULL;
+    }
+
+    // mmap the file to memory: it will be the contents of the initial piece.
+    // Big files are just reserved a range of addresses to be mapped lazily.
+    // From now on, the fd is owned by the block.
+    if (size == 0) {
+        close(fd);
+        return chain_load_block(file, NULL);
+    }
+    bool windowed = file->options.window_size != 0 && size > file->options.window_size;
+    Block* b = windowed ? block_alloc_windowed(file, fd, size) : block_alloc_mmap(file, fd, size);
+    if (b == NULL) {
+        close(fd);
+        piece_chain_destroy(file);
+        return NULL;
+    }
+    return chain_load_block(file, b);
+
+}
+
+static PieceChain_t* chain_load_block(PieceChain_t* file, Block* b) {
+
+    // Create the initial piece with all the contents of the block
+    Piece* p = NULL;
+    if (b != NULL && b->size > 0) {
+        if (file->options.line_index && !lines_init(file, b)) {
+            piece_chain_destroy(file);
+            return NULL;
+        }
+        p = piece_alloc(file, b);
+        if (p == NULL) {
+            piece_chain_destroy(file);
+            return NULL;
+        }
+        p->data = b->data;
+        p->size = b->size;
+        p->list.prev = &file->pieces;
+        p->list.next = &file->pieces;
+    }
+
+    // Prepare the initial change
+    Change* change = change_alloc(file, 0);
+    if (change == NULL) {
+        piece_chain_destroy(file);
+        return NULL;
+    }
+    span_init(&change->original, NULL, NULL);
+    span_init(&change->replacement, p, p);
+    span_swap(file, &change->original, &change->replacement);
+
+    // Commit the change to a revision
+    if (!chain_commit(file)) {
+        piece_chain_destroy(file);
+        return NULL;
+    }
+
+    return file;
+
+}
+
+PieceChain_t* piece_chain_open_ex(const char* path, const PieceChainOptions_t* options) {
+
+    PieceChain_t* file = chain_alloc(options);
+    if (file == NULL) {
+        return NULL;
+    }
+
+    if (path == NULL) {
+
+        // Allocate an initial empty revision
+        Revision* initial_rev = revision_alloc(file);
+        if (initial_rev == NULL) {
+            piece_chain_destroy(file);
+            errno = ENOMEM;
+            return NULL;
+        }
+        file->current_revision = initial_rev;
+
+        return file;
+    }
+
+    // Open the file r/w, if we fail try r/o
+    int fd;
+    errno = 0;
+    while ((fd = open(path, O_RDONLY)) == -1 && errno == EINTR);
+    if (errno != 0) {
+        piece_chain_destroy(file);
+        return NULL;
+    }
+
+    return chain_load_fd(file, fd);
+
+}
+
+PieceChain_t* piece_chain_open_fd(int fd, const PieceChainOptions_t* options) {
+
+    // The caller keeps its own descriptor. The duplicate shares the open file description,
+    // and with it the file offset: it must only be read at explicit offsets (pread, or copy_file_range
+    // and sendfile given an offset), never with read or lseek, which would move the offset of the caller too.
+    int dupfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (dupfd < 0) {
+        return NULL;
+    }
+
+    PieceChain_t* file = chain_alloc(options);
+    if (file == NULL) {
+        close(dupfd);
+        return NULL;
+    }
+    return chain_load_fd(file, dupfd);
+
+}
+
+PieceChain_t* piece_chain_open_buffer(
+    const unsigned char* data,
+    size_t len,
+    void (*release)(const unsigned char* data, size_t len, void* user),
+    void* user,
+    const PieceChainOptions_t* options
+) {
+
+    // The buffer is adopted even on failure, so that the caller does not have to tell the two cases apart
+    PieceChain_t* file = chain_alloc(options);
+    Block* b = file != NULL ? block_alloc_buffer(file, data, len, release, user) : NULL;
+    if (b == NULL) {
+        if (release != NULL) {
+            release(data, len, user);
+        }
+        piece_chain_destroy(file);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return chain_load_block(file, b);
+
+}
+
+PieceChain_t* piece_chain_open_with_journal(const char* path, const char* journal, const PieceChainOptions_t* options) {
+
+    PieceChain_t* file = piece_chain_open_ex(path, options);
+    if (file == NULL) {
+        return NULL;
+    }
+
+    int fd;
+    while ((fd = open(journal, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == -1 && errno == EINTR);
+    if (fd == -1) {
+        int err = errno;
+        piece_chain_destroy(file);
+        errno = err;
+        return NULL;
+    }
+
+    // The journal is attached only after the replay, so that the replayed edits are not journaled again
+    if (!journal_load(file, fd, path)) {
+        int err = file->last_error.err;
+        close(fd);
+        piece_chain_destroy(file);
+        errno = err;
+        return NULL;
+    }
+    file->journal_fd = fd;
+    return file;
+
+}
+
+PieceChain_t* piece_chain_clone(PieceChain_t* file) {
+
+    // Like for snapshots, once the cache is invalidated the bytes of the active pieces never change again,
+    // so the clone can point into the very same blocks and needs to copy only the pieces themselves
+    cache_put(file, NULL);
+
+    PieceChainOptions_t options = file->options;
+    PieceChain_t* clone = chain_alloc(&options);
+    if (clone == NULL) {
+        set_error(file, "Out of memory", ENOMEM);
+        return NULL;
+    }
+
+    // Rather than finding the blocks actually used by the pieces, share all of them
+    size_t count = file->shared_count;
+    list_for_each(pos, &file->all_blocks) {
+        count++;
+    }
+    clone->shared = malloc(sizeof(Block*) * MAX(count, (size_t) 1));
+    if (clone->shared == NULL) {
+        goto error;
+    }
+    list_for_each_member(b, &file->all_blocks, Block, list) {
+        atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
+        clone->shared[clone->shared_count++] = b;
+    }
+    for (size_t i = 0; i < file->shared_count; ++i) {
+        atomic_fetch_add_explicit(&file->shared[i]->refs, 1, memory_order_relaxed);
+        clone->shared[clone->shared_count++] = file->shared[i];
+    }
+
+    // Copy the active pieces: they become the original contents of the clone, which starts with no history
+    Piece* first = NULL;
+    Piece* last = NULL;
+    list_for_each_member(p, &file->pieces, Piece, list) {
+        Piece* copy = piece_alloc(clone, p->block);
+        if (copy == NULL) {
+            goto error;
+        }
+        copy->data = p->data;
+        copy->size = p->size;
+        copy->lines = p->lines;
+        if (last == NULL) {
+            first = copy;
+        } else {
+            last->list.next = &copy->list;
+            copy->list.prev = &last->list;
+        }
+        last = copy;
+    }
+    if (first != NULL) {
+        first->list.prev = &clone->pieces;
+        last->list.next = &clone->pieces;
+    }
+
+    Change* change = change_alloc(clone, 0);
+    if (change == NULL) {
+        goto error;
+    }
+    span_init(&change->original, NULL, NULL);
+    span_init(&change->replacement, first, last);
+    span_swap(clone, &change->original, &change->replacement);
+    if (!chain_commit(clone)) {
+        goto error;
+    }
+    clone->edits = piece_chain_dirty(file) ? 1 : 0;
+
+    return clone;
+
+error:
+    set_error(file, "Out of memory", ENOMEM);
+    piece_chain_destroy(clone);
+    return NULL;
+
+}
+
+void piece_chain_destroy(PieceChain_t* file) {
+    if (file == NULL) {
+        return;
+    }
+
+    // The saves running in the background still refer to the chain
+    saves_wait(file);
+    pthread_mutex_destroy(&file->saves_lock);
+    pthread_cond_destroy(&file->saves_done);
+
+    chain_commit(file); // Commits any pending change
+
+    // Pieces, changes and revisions do not own any other resource,
+    // so there's no need to walk the history: we can just release their memory in bulk.
+    pool_destroy(&file->revision_pool);
+    pool_destroy(&file->change_pool);
+    pool_destroy(&file->piece_pool);
+
+    list_for_each_rev_member(b, &file->all_blocks, Block, list) {
+        block_free(file, b);
+    }
+    list_for_each_member(b, &file->free_blocks, Block, list) {
+        block_unref(b);
+    }
+    for (size_t i = 0; i < file->shared_count; ++i) {
+        block_unref(file->shared[i]);
+    }
+    free(file->shared);
+
+    if (file->journal_fd != -1) {
+        close(file->journal_fd);
+    }
+    free(file->journal_buf);
+    free(file);
+}
+
+static bool write_all(PieceChain_t* file, int fd, const unsigned char* data, size_t len) {
+
+    const size_t blocksize = 64 * 1024;
+    size_t offset = 0;
+    while (offset < len) {
+        ssize_t written;
+        while ((written = write(fd, data + offset, MIN(blocksize, len - offset))) == -1 && errno == EINTR);
+        if (written < 0) {
+            set_error(file, "Cannot write", errno);
+            return false;
+        }
+        COUNT(file, bytes_written, written);
+        offset += written;
+    }
+
+    return true;
+}
+
+static int sync_fd(PieceChain_t* file, int fd) {
+    INSTRUMENT(uint64_t start = clock_ns());
+    int res;
+    while ((res = fsync(fd)) == -1 && errno == EINTR);
+    COUNT(file, fsyncs, 1);
+    COUNT(file, fsync_ns, clock_ns() - start);
+    TRACE(file, .type = TRACE_FSYNC, .duration_ns = clock_ns() - start, .success = res == 0);
+    return res;
+}
+
+static void iov_consume(struct iovec** iov, int* count, size_t written) {
+    // Skip the buffers that have been completely written, and advance into the first partial one
+    while (*count > 0 && written >= (*iov)->iov_len) {
+        written -= (*iov)->iov_len;
+        (*iov)++;
+        (*count)--;
+    }
+    if (*count > 0) {
+        (*iov)->iov_base = (unsigned char*) (*iov)->iov_base + written;
+        (*iov)->iov_len -= written;
+    }
+}
+
+static bool writev_all(PieceChain_t* file, int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t written;
+        while ((written = writev(fd, iov, count)) == -1 && errno == EINTR);
+        if (written < 0) {
+            set_error(file, "Cannot write", errno);
+            return false;
+        }
+        COUNT(file, bytes_written, written);
+        iov_consume(&iov, &count, written);
+    }
+    return true;
+}
+
+static bool pwritev_all(PieceChain_t* file, int fd, struct iovec* iov, int count, off_t offset) {
+    while (count > 0) {
+        ssize_t written;
+        while ((written = pwritev(fd, iov, count, offset)) == -1 && errno == EINTR);
+        if (written < 0) {
+            set_error(file, "Cannot write", errno);
+            return false;
+        }
+        COUNT(file, bytes_written, written);
+        offset += written;
+        iov_consume(&iov, &count, written);
+    }
+    return true;
+}
+
+static bool write_piece(PieceChain_t* file, int fd, Piece* p, size_t done, off_t offset) {
+
+    // Writes the piece from `done` on, to the current position of the file if `offset` is negative.
+    // Windowed data is written one window at a time, to keep it mapped while writing.
+    while (done < p->size) {
+        const unsigned char* data = p->data + done;
+        struct iovec iov = { (void*) data, window_clip(p->block, data, p->size - done) };
+        if (!window_acquire(p->block, data)) {
+            set_error(file, "Cannot map window", errno);
+            return false;
+        }
+        bool success = offset < 0 ? write_all(file, fd, data, iov.iov_len) : pwritev_all(file, fd, &iov, 1, offset + done);
+        window_release(p->block, data);
+        if (!success) {
+            return false;
+        }
+        done += iov.iov_len;
+    }
+    return true;
+}
+
+static bool copy_all(PieceChain_t* file, int fd, Piece* p, bool* zero_copy) {
+
+    // Pieces pointing to a mmapped file can be copied directly from the original file,
+    // without ever faulting the pages in our address space. copy_file_range allows the kernel
+    // to share extents or do a server side copy, and sendfile at least avoids the copy to user space.
+    // The original file must not have been modified since it has been opened.
+    int in = p->block->fd;
+    off_t offset = p->data - p->block->data;
+    size_t done = 0;
+    while (*zero_copy && done < p->size) {
+        ssize_t copied;
+        loff_t off_in = offset + done;
+        while ((copied = copy_file_range(in, &off_in, fd, NULL, p->size - done, 0)) == -1 && errno == EINTR);
+        if (copied < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            off_t sf_off = offset + done;
+            while ((copied = sendfile(fd, in, &sf_off, p->size - done)) == -1 && errno == EINTR);
+        }
+        if (copied <= 0) {
+            // Something unexpected: stop trying and fall back to plain writes from the mapping
+            // for the rest of the save. A short copy means that the file has been truncated under our feet.
+            *zero_copy = false;
+            break;
+        }
+        COUNT(file, bytes_written, copied);
+        done += copied;
+    }
+
+    return write_piece(file, fd, p, done, -1);
+}
+
+static bool write_pieces(PieceChain_t* file, int fd, bool zero_copy) {
+
+    // Pieces written from memory are gathered, so that a fragmented chain
+    // does not need a syscall for each one of its pieces
+    struct iovec iov[IOV_MAX];
+    int count = 0;
+    list_for_each_member(p, &file->pieces, Piece, list) {
+        bool copy = zero_copy && p->block != NULL && p->block->fd != -1 && !p->block->written;
+        bool windowed = p->block != NULL && p->block->windows != NULL;
+        if (count > 0 && (copy || windowed || count == IOV_MAX)) {
+            if (!writev_all(file, fd, iov, count)) {
+                return false;
+            }
+            count = 0;
+        }
+        if (copy) {
+            if (!copy_all(file, fd, p, &zero_copy)) {
+                return false;
+            }
+        } else if (windowed) {
+            if (!write_piece(file, fd, p, 0, -1)) {
+                return false;
+            }
+        } else {
+            iov[count].iov_base = p->data;
+            iov[count].iov_len = p->size;
+            count++;
+        }
+    }
+    return count == 0 || writev_all(file, fd, iov, count);
+}
+
+static bool write_to_fd(PieceChain_t* file, int fd, bool zero_copy) {
+
+    // Files are read from start to end while saving
+    advise_blocks(file, ADVICE_SEQUENTIAL);
+    bool success = write_pieces(file, fd, zero_copy);
+    advise_blocks(file, ADVICE_NORMAL);
+    return success;
+}
+
+static bool write_dirty(PieceChain_t* file, int fd, Block* b) {
+
+    // Writes the chain over the file mapped by `b`. Pieces still backed by the same region of the mapping
+    // are already in place, so only the other ones are written.
+
+    #define PIECE_CLEAN(p, offset) ((p)->block == b && (size_t) ((p)->data - b->data) == (offset))
+
+    // Before writing anything, privatize the pages we are going to overwrite with different contents,
+    // and the ones past the new end of the file, which are lost when it is truncated
+    size_t offset = 0;
+    list_for_each_member(p, &file->pieces, Piece, list) {
+        if (!PIECE_CLEAN(p, offset) && !block_pin(file, b, offset, p->size)) {
+            return false;
+        }
+        offset += p->size;
+    }
+    if (file->size < b->size && !block_pin(file, b, file->size, b->size - file->size)) {
+        return false;
+    }
+    b->written = true;
+
+    // Write runs of consecutive dirty pieces with a single call
+    struct iovec iov[IOV_MAX];
+    int count = 0;
+    off_t run = 0;
+    offset = 0;
+    list_for_each_member(p, &file->pieces, Piece, list) {
+        bool clean = PIECE_CLEAN(p, offset);
+        bool windowed = p->block != NULL && p->block->windows != NULL;
+        if (count > 0 && (clean || windowed || count == IOV_MAX)) {
+            if (!pwritev_all(file, fd, iov, count, run)) {
+                return false;
+            }
+            count = 0;
+        }
+        if (!clean && windowed) {
+            if (!write_piece(file, fd, p, 0, offset)) {
+                return false;
+            }
+        } else if (!clean) {
+            if (count == 0) {
+                run = offset;
+            }
+            iov[count].iov_base = p->data;
+            iov[count].iov_len = p->size;
+            count++;
+        }
+        offset += p->size;
+    }
+
+    #undef PIECE_CLEAN
+
+    return count == 0 || pwritev_all(file, fd, iov, count, run);
+}
+
+static atomic_uint save_ids;
+
+static bool piece_chain_save_atomic(PieceChain_t* file, const char* path) {
+
+    // File is first saved to a temp directory,
+    // then moved to the target destination with a rename.
+    // This will fail of the original file is a synbolic or hard link,
+    // and if there are problems in restoring the original file permissions.
+
+    int oldfd = -1;
+    int dirfd = -1;
+    int tmpfd = -1;
+    char* tmpname = NULL;
+    bool tmpcreated = false;
+    char* pathdup = strdup(path);
+
+    if (pathdup == NULL) {
+        set_error(file, "Out of memory", ENOMEM);
+        goto error;
+    }
+
+    // Open the original file and get some info about it
+    while ((oldfd = open(path, O_RDONLY)) == -1 && errno == EINTR);
+    if (oldfd < 0 && errno != ENOENT) {
+        set_error(file, "Cannot open file", errno);
+        goto error;
+    }
+    struct stat oldstat = { 0 };
+    if (oldfd != -1) {
+        if (lstat(path, &oldstat) < 0) {
+            set_error(file, "Cannot stat file", errno);
+            goto error;
+        }
+
+        // The rename method does not work if the target is not a regular file or if it is a hard link
+        if (!S_ISREG(oldstat.st_mode) || oldstat.st_nlink > 1) {
+			goto error;
+        }
+    }
+
+    size_t tmpnamelen = strlen(path) + 6 /* ~~save */ + 2 * 10 /* pid and id */ + 1 /* . */ + 1 /* '\0' */;
+    tmpname = malloc(sizeof(char) * tmpnamelen);
+    if (tmpname == NULL) {
+        set_error(file, "Out of memory", ENOMEM);
+        goto error;
+    }
+
+    // Create the temp file. Every save gets its own, so that saves running at the same time
+    // (from background threads or from other processes) do not write over each other
+    do {
+        snprintf(tmpname, tmpnamelen, "%s~~save%u.%u", path, (unsigned) getpid(), atomic_fetch_add_explicit(&save_ids, 1, memory_order_relaxed));
+        while ((tmpfd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL, oldfd == -1 ? 0666 : oldstat.st_mode)) == -1 && errno == EINTR);
+    } while (tmpfd < 0 && errno == EEXIST);
+    if (tmpfd < 0) {
+        set_error(file, "Cannot open temp file", errno);
+        goto error;
+    }
+    tmpcreated = true;
+
+    // If the old file existed, try to copy the owner to the temp file
+    int res;
+    if (oldfd != -1) {
+        if (oldstat.st_uid != getuid()) {
+            while ((res = fchown(tmpfd, oldstat.st_uid, (uid_t) -1)) == -1 && errno == EINTR);
+            if (res < 0) {
+                goto error;
+            }
+        }
+        if (oldstat.st_gid != getgid()) {
+            while ((res = fchown(tmpfd, (uid_t) -1, oldstat.st_gid)) == -1 && errno == EINTR);
+            if (res < 0) {
+                goto error;
+            }
+        }
+    }
+
+    // We don't need the old file anymore
+    if (oldfd != -1 ) {
+        close(oldfd);
+        oldfd = -1;
+    }
+
+    // Write to the temp file
+    if (!write_to_fd(file, tmpfd, true)) {
+        goto error;
+    }
+    
+    res = sync_fd(file, tmpfd);
+    if (res < 0) {
+        set_error(file, "Cannot fsync temp file", errno);
+        goto error;
+    }
+
+    while ((res = close(tmpfd)) == -1 && errno == EINTR);
+    tmpfd = -1;
+    if (res < 0) {
+        set_error(file, "Cannot close temp file", errno);
+        goto error;
+    }
+
+    // Move the temp file over the original one
+    INSTRUMENT(uint64_t start = clock_ns());
+    while ((res = rename(tmpname, path)) == -1 && errno == EINTR);
+    COUNT(file, renames, 1);
+    COUNT(file, rename_ns, clock_ns() - start);
+    TRACE(file, .type = TRACE_RENAME, .duration_ns = clock_ns() - start, .success = res == 0);
+    if (res < 0) {
+        set_error(file, "Cannot rename temp flie to destination", errno);
+        goto error;
+    }
+    tmpcreated = false;
+
+    // Open the parent directory and sync it to be sure that the rename has been committed to disk
+    while ((dirfd = open(dirname(pathdup), O_DIRECTORY | O_RDONLY)) == -1 && errno == EINTR);
+    if (dirfd < 0) {
+        set_error(file, "Cannot open destination directory", errno);
+        goto error;
+    }
+    res = sync_fd(file, dirfd);
+    if (res < 0) {
+        set_error(file, "Cannot fsync destination directory", errno);
+        goto error;
+    }
+    close(dirfd);
+
+    free(tmpname);
+    free(pathdup);
+    return true;
+
+error:
+    if (oldfd != -1) {
+        close(oldfd);
+    }
+    if (tmpfd != -1) {
+        close(tmpfd);
+    }
+    if (dirfd != -1) {
+        close(dirfd);
+    }
+    if (tmpcreated) {
+        unlink(tmpname);
+    }
+    free(tmpname);
+    if (pathdup != NULL) {
+        free(pathdup);
+    }
+    return false;
+
+}
+
+static bool piece_chain_save_inplace(PieceChain_t* file, const char* path) {
+    
+    int fd;
+    while ((fd = open(path, O_WRONLY | O_CREAT, 0666)) == -1 && errno == EINTR);
+    if (fd < 0) {
+        set_error(file, "Cannot open file", errno);
+        return false;
+    }
+
+    // If we are overwriting the very same file we have mapped, only the regions that changed are written,
+    // after taking a private copy of them. Data must then be read back from memory and not copied from the file.
+    Block* b = block_find_file(file, fd);
+    bool success;
+    if (b != NULL) {
+        advise_blocks(file, ADVICE_SEQUENTIAL);
+        success = write_dirty(file, fd, b);
+        advise_blocks(file, ADVICE_NORMAL);
+    } else {
+        success = write_to_fd(file, fd, false);
+    }
+    if (!success) {
+        close(fd);
+        return false;
+    }
+
+    // Devices cannot be truncated, and keep whatever follows the contents
+    int res;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        set_error(file, "Cannot stat file", errno);
+        close(fd);
+        return false;
+    }
+    if (S_ISREG(st.st_mode)) {
+        while ((res = ftruncate(fd, file->size)) == -1 && errno == EINTR);
+        if (res < 0) {
+            set_error(file, "Cannot truncate file", errno);
+            close(fd);
+            return false;
+        }
+    }
+
+    res = sync_fd(file, fd);
+    if (res < 0) {
+        set_error(file, "Cannot fsync file", errno);
+        close(fd);
+        return false;
+    }
+
+    close(fd);
+
+    return true;
+
+}
+
+static bool piece_chain_save_incremental(PieceChain_t* file, const char* path) {
+
+    int fd;
+    while ((fd = open(path, O_WRONLY)) == -1 && errno == EINTR);
+    if (fd < 0) {
+        return piece_chain_save_inplace(file, path);
+    }
+
+    // Only the regions of the file not backed anymore by the same region of the mapping need to be written.
+    // This works only if the target is the file we have mapped, and its size did not change.
+    struct stat st;
+    size_t size;
+    Block* b = block_find_file(file, fd);
+    if (b == NULL || fstat(fd, &st) < 0 || !fd_size(fd, &st, &size) || size != b->size || file->size != b->size) {
+        close(fd);
+        return piece_chain_save_inplace(file, path);
+    }
+
+    if (!write_dirty(file, fd, b)) {
+        close(fd);
+        return false;
+    }
+
+    int res;
+    res = sync_fd(file, fd);
+    if (res < 0) {
+        set_error(file, "Cannot fsync file", errno);
+        close(fd);
+        return false;
+    }
+
+    close(fd);
+
+    return true;
+
+}
+
+static bool save_mode(PieceChain_t* file, const char* path, enum PieceChainSaveMode mode) {
+    INSTRUMENT(uint64_t start = clock_ns(); uint64_t written = file->counters.bytes_written);
+    bool success;
+    if (mode == SAVE_MODE_ATOMIC) {
+        success = piece_chain_save_atomic(file, path);
+    } else if (mode == SAVE_MODE_INPLACE) {
+        success = piece_chain_save_inplace(file, path);
+    } else {
+        success = piece_chain_save_incremental(file, path);
+    }
+    COUNT(file, save_bytes[mode], file->counters.bytes_written - written);
+    TRACE(file, .type = TRACE_SAVE, .mode = mode, .duration_ns = clock_ns() - start, .bytes = file->counters.bytes_written - written, .success = success);
+    return success;
+}
+
+bool piece_chain_save(PieceChain_t* file, const char* path, enum PieceChainSaveMode savemode) {    
+
+    // Background saves share the blocks of the chain, and may still be reading the very file we are
+    // going to overwrite: let them complete, which also keeps the file with the contents saved last
+    saves_wait(file);
+
+    bool success = false;
+    switch (savemode) {
+        
+        case SAVE_MODE_ATOMIC:
+        case SAVE_MODE_INPLACE:
+        case SAVE_MODE_INCREMENTAL:
+            success = save_mode(file, path, savemode);
+            break;
+        
+        case SAVE_MODE_AUTO:
+            success = save_mode(file, path, SAVE_MODE_ATOMIC);
+            if (!success) {
+                success = save_mode(file, path, SAVE_MODE_INPLACE);
+            }
+            break;
+
+        default:
+            abort();
+    }
+
+    // The chain is clean only once the journal restarts from the file just written. If it cannot,
+    // journaling stops rather than keep appending records that could never be replayed over the new file:
+    // the save reports the failure, and the next one succeeds without a journal.
+    if (success && file->journal_fd != -1 && !journal_reset(file, path)) {
+        journal_abandon(file);
+        success = false;
+    }
+    if (success) {
+        atomic_store_explicit(&file->saved_edits, file->edits, memory_order_release);
+    }
+    return success;
+
+}
+
+static void saves_wait(PieceChain_t* file) {
+    pthread_mutex_lock(&file->saves_lock);
+    while (file->saves_running > 0) {
+        pthread_cond_wait(&file->saves_done, &file->saves_lock);
+    }
+    pthread_mutex_unlock(&file->saves_lock);
+}
+
+static void* save_worker(void* arg) {
+    SaveJob* job = arg;
+    PieceChain_t* file = job->file;
+
+    // Wait for the saves started before this one, so that the file ends up with the newest contents
+    pthread_mutex_lock(&file->saves_lock);
+    while (file->saves_finished != job->ticket) {
+        pthread_cond_wait(&file->saves_done, &file->saves_lock);
+    }
+    pthread_mutex_unlock(&file->saves_lock);
+
+    bool success = piece_chain_save(job->clone, job->path, SAVE_MODE_ATOMIC);
+    if (success) {
+        // Saves of the chain itself wait for this one, so nothing newer can have been saved in the meantime
+        atomic_store_explicit(&file->saved_edits, job->edits, memory_order_release);
+    }
+
+    // The work done by the clone is accounted to the chain before anybody is told that the save is over
+    pthread_mutex_lock(&file->saves_lock);
+    counters_add(&file->saves_counters, &job->clone->counters);
+    pthread_mutex_unlock(&file->saves_lock);
+    if (job->done != NULL) {
+        job->done(file, success, success ? NULL : &job->clone->last_error, job->user);
+    }
+
+    piece_chain_destroy(job->clone);
+    free(job->path);
+    free(job);
+
+    pthread_mutex_lock(&file->saves_lock);
+    file->saves_finished++;
+    file->saves_running--;
+    pthread_cond_broadcast(&file->saves_done);
+    pthread_mutex_unlock(&file->saves_lock);
+    return NULL;
+}
+
+bool piece_chain_save_async(PieceChain_t* file, const char* path, void (*done)(PieceChain_t*, bool success, const PieceChainError_t* error, void* user), void* user) {
+
+    // After a save the journal restarts from the file just written,
+    // which would lose the edits made while the save is running
+    if (file->journal_fd != -1) {
+        set_error(file, "Cannot save a chain with a journal in the background", EINVAL);
+        return false;
+    }
+
+    // The save works on a clone, which shares all the data with the chain but not the pieces:
+    // the chain can keep being edited, while the clone is owned by the thread saving it
+    SaveJob* job = malloc(sizeof(SaveJob));
+    char* pathdup = strdup(path);
+    if (job == NULL || pathdup == NULL) {
+        free(job);
+        free(pathdup);
+        set_error(file, "Out of memory", ENOMEM);
+        return false;
+    }
+    job->clone = piece_chain_clone(file);
+    if (job->clone == NULL) {
+        free(job);
+        free(pathdup);
+        return false;
+    }
+    job->clone->trace = file->trace;
+    job->clone->trace_user = file->trace_user;
+    job->clone->trace_chain = file;
+    job->file = file;
+    job->path = pathdup;
+    job->edits = file->edits;
+    job->done = done;
+    job->user = user;
+
+    pthread_mutex_lock(&file->saves_lock);
+    file->saves_running++;
+    job->ticket = file->saves_started++;
+    pthread_mutex_unlock(&file->saves_lock);
+
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, save_worker, job);
+    if (err != 0) {
+        pthread_mutex_lock(&file->saves_lock);
+        file->saves_running--;
+        file->saves_started--;
+        pthread_mutex_unlock(&file->saves_lock);
+        piece_chain_destroy(job->clone);
+        free(job->path);
+        free(job);
+        set_error(file, "Cannot start the save", err);
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+
+}
+
+size_t piece_chain_size(PieceChain_t* file) {
+    return file->size;
+}
+
+bool piece_chain_dirty(PieceChain_t* file) {
+    return file->edits != atomic_load_explicit(&file->saved_edits, memory_order_acquire);
+}
+
+static void counters_add(PieceChainCounters_t* to, const PieceChainCounters_t* from) {
+    // All the counters are 64 bit integers
+    uint64_t* dst = (uint64_t*) to;
+    const uint64_t* src = (const uint64_t*) from;
+    for (size_t i = 0; i < sizeof(PieceChainCounters_t) / sizeof(uint64_t); ++i) {
+        dst[i] += src[i];
+    }
+}
+
+void piece_chain_counters(PieceChain_t* file, PieceChainCounters_t* out) {
+    *out = file->counters;
+    pthread_mutex_lock(&file->saves_lock);
+    counters_add(out, &file->saves_counters);
+    pthread_mutex_unlock(&file->saves_lock);
+}
+
+void piece_chain_counters_reset(PieceChain_t* file) {
+    memset(&file->counters, 0, sizeof(PieceChainCounters_t));
+    pthread_mutex_lock(&file->saves_lock);
+    memset(&file->saves_counters, 0, sizeof(PieceChainCounters_t));
+    pthread_mutex_unlock(&file->saves_lock);
+}
+
+void piece_chain_set_trace(PieceChain_t* file, void (*trace)(PieceChain_t*, const PieceChainTraceEvent_t*, void*), void* user) {
+    // Background saves took a copy of the old callback and its data, which the caller may free as soon as we return
+    saves_wait(file);
+    file->trace = trace;
+    file->trace_user = user;
+}
+
+void piece_chain_stats(PieceChain_t* file, PieceChainStats_t* out) {
+    memset(out, 0, sizeof(PieceChainStats_t));
+    list_for_each_member(b, &file->all_blocks, Block, list) {
+        out->blocks++;
+        switch (b->type) {
+            case BLOCK_MALLOC:
+            case BLOCK_ANONYMOUS:
+                out->heap_bytes += b->size;
+                break;
+            case BLOCK_MMAP:
+                out->mapped_bytes += b->size;
+                break;
+            case BLOCK_WINDOWED:
+                pthread_mutex_lock(&b->windows->lock);
+                for (size_t i = 0; i < b->windows->count; i++) {
+                    size_t start = b->windows->slots[i].index * b->windows->size;
+                    out->mapped_bytes += MIN(b->windows->size, b->size - start);
+                }
+                pthread_mutex_unlock(&b->windows->lock);
+                break;
+            case BLOCK_BUFFER:
+                out->buffer_bytes += b->size;
+                break;
+        }
+    }
+    list_for_each_member(b, &file->free_blocks, Block, list) {
+        out->free_bytes += b->size;
+    }
+    for (size_t i = 0; i < file->shared_count; ++i) {
+        out->shared_bytes += file->shared[i]->size;
+    }
+    list_for_each_member(p, &file->pieces, Piece, list) {
+        if (block_owned(file, p->block) && (p->block->type == BLOCK_MALLOC || p->block->type == BLOCK_ANONYMOUS)) {
+            out->heap_live_bytes += p->size;
+        }
+    }
+    out->bookkeeping_bytes = pool_size(&file->piece_pool) + pool_size(&file->change_pool) + pool_size(&file->revision_pool);
+    out->pieces = file->index != NULL ? file->index->subtree_count : 0;
+    out->total_pieces = file->piece_pool.count;
+    out->changes = file->change_pool.count;
+    out->revisions = file->revision_pool.count;
+    out->fragmentation = out->heap_bytes != 0 ? 1.0 - (double) out->heap_live_bytes / (double) out->heap_bytes : 0.0;
+}
+
+PieceChainError_t* piece_chain_last_error(PieceChain_t* file) {
+    return &file->last_error;
+}
+
+bool piece_chain_insert(PieceChain_t* file, size_t offset, const unsigned char* data, size_t len) {
+    if (!group_begin(file)) {
+        return false;
+    }
+    size_t mark = file->journal_len;
+    if (!journal_record(file, JOURNAL_INSERT, offset, len, data)) {
+        return false;
+    }
+    if (!chain_insert(file, offset, data, len)) {
+        file->journal_len = mark;
+        return false;
+    }
+    group_add(file, len);
+    return true;
+}
+
+bool piece_chain_delete(PieceChain_t* file, size_t offset, size_t len) {
+    if (!group_begin(file)) {
+        return false;
+    }
+    size_t mark = file->journal_len;
+    if (!journal_record(file, JOURNAL_DELETE, offset, len, NULL)) {
+        return false;
+    }
+    if (!chain_delete(file, offset, len)) {
+        file->journal_len = mark;
+        return false;
+    }
+    group_add(file, len);
+    return true;
+}
+
+bool piece_chain_replace(PieceChain_t* file, size_t offset, const unsigned char* data, size_t len) {
+    if (!group_begin(file)) {
+        return false;
+    }
+    size_t mark = file->journal_len;
+    if (!journal_record(file, JOURNAL_REPLACE, offset, len, data)) {
+        return false;
+    }
+    if (!chain_replace(file, offset, data, len)) {
+        file->journal_len = mark;
+        return false;
+    }
+    group_add(file, len);
+    return true;
+}
+
+static bool group_begin(PieceChain_t* file) {
+    // In coalescing mode, an edit coming after the pending ones timed out starts a new group
+    if (file->options.coalesce_ms != 0 && file->group_bytes != 0 && clock_ms() - file->group_start >= file->options.coalesce_ms) {
+        return chain_commit(file);
+    }
+    return true;
+}
+
+static void group_add(PieceChain_t* file, size_t len) {
+    if (file->group_bytes == 0 && file->options.coalesce_ms != 0) {
+        file->group_start = clock_ms();
+    }
+    file->group_bytes += len;
+}
+
+static bool chain_insert(PieceChain_t* file, size_t offset, const unsigned char* data, size_t len) {
+
+    if (len == 0) {
+        return true;
+    }
+    if (offset > file->size) {
+        return false;
+    }
+
+    // Find the piece at offset `offset`
+    Piece* piece;
+    size_t piece_offset;
+    if (!piece_find(file, offset, &piece, &piece_offset)) {
+        if (list_empty(&file->pieces)) {
+            piece = NULL;
+            piece_offset = 0;
+        } else if (offset == file->size) {
+            piece = list_last(&file->pieces, Piece, list);
+            piece_offset = piece->size;
+        } else {
+            return false;
+        }
+    }
+
+    // Discard any redo history
+    revision_branch(file);
+
+    // First try with the cached piece.
+    // If we are inserting at the beginning of a piece, check if the previous one was cached and try using it
+    if (piece != NULL) {
+        if (cache_insert(file, piece, piece_offset, data, len)) {
+            COUNT(file, cache_hits, 1);
+            goto success;
+        }
+        if (piece_offset == 0 && list_first(&file->pieces, Piece, list) != piece) {
+            Piece* prev = list_prev(piece, Piece, list);
+            if (cache_insert(file, prev, prev->size, data, len)) {
+                COUNT(file, cache_hits, 1);
+                goto success;
+            }
+        }
+    }
+    COUNT(file, cache_misses, 1);
+
+    // Let's see if we can reuse the last block to store the new data
+    Block* b;
+    if (!list_empty(&file->all_blocks) && block_can_fit(list_last(&file->all_blocks, Block, list), len)) {
+        b = list_last(&file->all_blocks, Block, list);
+    } else {
+        b = block_alloc(file, len);
+        if (b == NULL) {
+            return false;
+        }
+    }
+
+    unsigned char* ptr = block_append(b, data, len);
+    if (ptr == NULL) {
+        return false;
+    }
+
+    // There might be two cases for insertion, depending on the offset:
+    // - At the boundary of an already existing piece
+    // - In the middle of an existing piece
+    // In the first case, we can just allocate a new piece and insert it,
+    // while in the other we have to replace the existing piece with three new ones.
+
+    Change* change = change_alloc(file, offset);
+    if (change == NULL) {
+        return false;
+    }
+
+    Piece* new;
+
+    if (piece == NULL) {
+        // We have no piece to attach to because this is the first insertion to an empty file
+
+        new = piece_alloc(file, b);
+        if (new == NULL) {
+            return false;
+        }
+        new->data = ptr;
+        new->size = len;
+
+        // Insert as the first piece
+        new->list.prev = new->list.next = &file->pieces;
+
+        span_init(&change->original, NULL, NULL);
+        span_init(&change->replacement, new, new);       
+
+    } else if (piece_offset == 0 || piece_offset == piece->size) {
+        // For how we counted offsets, the only way that the `piece_offset == piece->size` condition
+        // can be true is when we are inserting at the end of the file.
+
+        new = piece_alloc(file, b);
+        if (new == NULL) {
+            return false;
+        }
+        new->data = ptr;
+        new->size = len;
+
+        // Insert before or after the piece
+        if (piece_offset == 0) {
+            new->list.prev = piece->list.prev;
+            new->list.next = &piece->list;
+        } else {
+            new->list.prev = &piece->list;
+            new->list.next = piece->list.next;
+        }
+        
+        span_init(&change->original, NULL, NULL);
+        span_init(&change->replacement, new, new);
+
+    } else {
+
+        Piece* before = piece_alloc(file, piece->block);
+        Piece* middle = piece_alloc(file, b);
+        Piece* after = piece_alloc(file, piece->block);
+        if (before == NULL || middle == NULL || after == NULL) {
+            if (before != NULL) {
+                piece_free(file, before);
+            }
+            if (middle != NULL) {
+                piece_free(file, middle);
+            }
+            if (after != NULL) {
+                piece_free(file, after);
+            }
+            return false;
+        }
+
+        // Split the data among the three pieces
+        before->data = piece->data;
+        before->size = piece_offset;
+        middle->data = ptr;
+        middle->size = len;
+        after->data = piece->data + piece_offset;
+        after->size = piece->size - piece_offset;
+
+        // Join the three pieces together
+        before->list.prev = piece->list.prev;
+        before->list.next = &middle->list;
+        middle->list.prev = &before->list;
+        middle->list.next = &after->list;
+        after->list.prev = &middle->list;
+        after->list.next = piece->list.next;
+
+        span_init(&change->original, piece, piece);
+        span_init(&change->replacement, before, after);
+    
+        new = middle;
+
+    }
+
+    // Apply the prepared change
+    cache_put(file, new);
+    span_swap(file, &change->original, &change->replacement);
+
+success:
+
+    // Mark the file as dirty
+    file->edits++;
+    
+    return true;
+
+}
+
+static bool chain_delete(PieceChain_t* file, size_t offset, size_t len) {
+
+    if (len == 0) {
+        return true;
+    }
+    if (offset > file->size) {
+        return false;
+    }
+
+    // Find the piece at the begin of the range to delete
+    Piece* start_piece;
+    size_t start_piece_offset;
+    Piece* end_piece;
+    size_t end_piece_offset;
+    if (!piece_find(file, offset, &start_piece, &start_piece_offset)) {
+        return false;
+    }
+    if (!piece_find(file, offset + len, &end_piece, &end_piece_offset)) {
+        // If the end of the delete range fell out of the file, delete up to the last char
+        end_piece = list_last(&file->pieces, Piece, list);
+        end_piece_offset = end_piece->size;
+    }  
+    assert(start_piece != NULL);
+    assert(end_piece != NULL);
+
+    // Discard any redo history
+    revision_branch(file);
+
+    // First try with the cached piece
+    if (cache_delete(file, start_piece, start_piece_offset, len)) {
+        goto success;
+    }
+
+    // Deletion range can both start and end up in the middle of a piece.
+    // This means that we might have to create new pieces to account for the split pieces.
+
+    Change* change = change_alloc(file, offset);
+    if (change == NULL) {
+        return false;
+    }
+
+    bool split_start = start_piece_offset != 0;
+    bool split_end = end_piece_offset != end_piece->size;
+    
+    struct list_head* before = start_piece->list.prev;
+    struct list_head* after = end_piece->list.next;
+
+    Piece* new_start = NULL;
+    Piece* new_end = NULL;
+
+    if (split_start) {
+        new_start = piece_alloc(file, start_piece->block);
+        if (new_start == NULL) {
+            return false;
+        }
+        new_start->data = start_piece->data;
+        new_start->size = start_piece_offset;
+        new_start->list.prev = before;
+        new_start->list.next = after;
+    }
+
+    if (split_end) {
+        new_end = piece_alloc(file, end_piece->block);
+        if (new_end == NULL) {
+            return false;
+        }
+        new_end->data = end_piece->data + end_piece_offset;
+        new_end->size = end_piece->size - end_piece_offset;
+        new_end->list.prev = before;
+        new_end->list.next = after;
+        if (split_start) {
+            new_end->list.prev = &new_start->list;
+            new_start->list.next = &new_end->list;
+        }
+    }
+
+    if (new_start == NULL && new_end != NULL) {
+        new_start = new_end;
+    } else if (new_start != NULL && new_end == NULL) {
+        new_end = new_start;
+    }
+
+    span_init(&change->original, start_piece, end_piece);
+    span_init(&change->replacement, new_start, new_end);
+    span_swap(file, &change->original, &change->replacement);
+
+    // The cached piece can be extended only as long as its change is the last pending one
+    cache_put(file, NULL);
+
+success:
+
+    // Mark the file as dirty
+    file->edits++;
+
+    return true;
+
+}
+
+static Piece* edits_emit(PieceChain_t* file, Piece** first, Piece* last, Block* block, unsigned char* data, size_t size) {
+    Piece* p = piece_alloc(file, block);
+    if (p == NULL) {
+        return NULL;
+    }
+    p->data = data;
+    p->size = size;
+    if (last != NULL) {
+        last->list.next = &p->list;
+        p->list.prev = &last->list;
+    } else {
+        *first = p;
+    }
+    return p;
+}
+
+static bool edits_apply(PieceChain_t* file, const PieceChainEdit_t* const* edits, size_t n, size_t total) {
+
+    // Applies a list of edits, sorted and validated, as a single change.
+    // The idea is to walk the chain only once, from the piece containing the first edit
+    // to the one containing the last, and build on the way the span that will replace
+    // all the pieces we walked over.
+
+    // The change is allocated first, so that nothing is discarded if it fails
+    Change* change = change_alloc(file, edits[0]->offset);
+    if (change == NULL) {
+        return false;
+    }
+
+    // Discard any redo history
+    revision_branch(file);
+
+    // We are going to append to the last block, so the cached piece cannot be extended anymore
+    cache_put(file, NULL);
+
+    // Store all the new data contiguously in a single block
+    unsigned char* ptr = NULL;
+    Block* b = NULL;
+    bool fresh = false; // Whether `b` has been allocated for the batch
+    size_t b_len = 0; // Length of `b` before the batch
+    Piece* first = NULL; // New span
+    Piece* last = NULL;
+    if (total > 0) {
+        if (!list_empty(&file->all_blocks) && block_can_fit(list_last(&file->all_blocks, Block, list), total)) {
+            b = list_last(&file->all_blocks, Block, list);
+        } else {
+            b = block_alloc(file, total);
+            if (b == NULL) {
+                goto error;
+            }
+            fresh = true;
+        }
+        b_len = b->len;
+        ptr = b->data + b->len;
+        for (size_t i = 0; i < n; ++i) {
+            block_append(b, edits[i]->data, edits[i]->len);
+        }
+    }
+
+    // Find the piece where the first edit happens.
+    // If all the edits are at the end of the chain, there is no piece to start from.
+    Piece* start = NULL;
+    size_t start_offset = 0;
+    if (!piece_find(file, edits[0]->offset, &start, &start_offset)) {
+        start = NULL;
+    }
+
+    Piece* cur = start; // Piece we are walking
+    size_t cur_off = 0; // Offset inside `cur`
+    size_t pos = edits[0]->offset - start_offset; // Absolute offset of `cur` + `cur_off`
+    Piece* consumed = NULL; // Last piece of the chain we walked over entirely
+    Piece* inserted = NULL; // Piece holding the last inserted data
+
+    for (size_t i = 0; i <= n; ++i) {
+
+        // Copy the unchanged contents up to the next edit, or up to the end of the last piece we touched
+        size_t target = i < n ? edits[i]->offset : pos + (cur_off > 0 ? cur->size - cur_off : 0);
+        while (pos < target) {
+            size_t len = MIN(cur->size - cur_off, target - pos);
+            if (len > 0) {
+                Piece* p = edits_emit(file, &first, last, cur->block, cur->data + cur_off, len);
+                if (p == NULL) {
+                    goto error;
+                }
+                last = p;
+            }
+            pos += len;
+            cur_off += len;
+            if (cur_off == cur->size) {
+                consumed = cur;
+                cur = list_next(cur, Piece, list);
+                cur_off = 0;
+            }
+        }
+        if (i == n) {
+            break;
+        }
+
+        // New data
+        if (edits[i]->len > 0) {
+            Piece* p = edits_emit(file, &first, last, b, ptr, edits[i]->len);
+            if (p == NULL) {
+                goto error;
+            }
+            last = p;
+            inserted = last;
+            ptr += edits[i]->len;
+        }
+
+        // Skip deleted contents
+        size_t end = pos + MIN(edits[i]->delete_len, file->size - pos);
+        while (pos < end) {
+            size_t len = MIN(cur->size - cur_off, end - pos);
+            pos += len;
+            cur_off += len;
+            if (cur_off == cur->size) {
+                consumed = cur;
+                cur = list_next(cur, Piece, list);
+                cur_off = 0;
+            }
+        }
 
-    // Open the parent directory and sync it to be sure that the rename has been committed to disk
-    while ((dirfd = open(dirname(pathdup), O_DIRECTORY | O_RDONLY)) == -1 && errno == EINTR);
-    if (dirfd < 0) {
-        set_error(file, "Cannot open destination directory", errno);
-        goto error;
     }
-    while ((res = fsync(dirfd)) == -1 && errno == EINTR);
-    if (res < 0) {
-        set_error(file, "Cannot fsync destination directory", errno);
-        goto error;
+
+    // The pieces we walked over are replaced by the new ones.
+    // If we did not walk over any piece, this is a pure insertion before `start` (or at the end of the chain).
+    struct list_head* before = start != NULL ? start->list.prev : file->pieces.prev;
+    struct list_head* after = consumed != NULL ? consumed->list.next : (start != NULL ? &start->list : &file->pieces);
+    if (consumed == NULL && first == NULL) {
+        list_del(&change->list);
+        change_free(file, change, false);
+        return true;
+    }
+    if (first != NULL) {
+        first->list.prev = before;
+        last->list.next = after;
     }
-    close(dirfd);
 
-    free(tmpname);
-    free(pathdup);
+    span_init(&change->original, consumed != NULL ? start : NULL, consumed);
+    span_init(&change->replacement, first, last);
+    span_swap(file, &change->original, &change->replacement);
+
+    // The last inserted data ends exactly at the end of the last block, so its piece can be cached
+    cache_put(file, inserted);
+
+    // Mark the file as dirty
+    file->edits++;
+
     return true;
 
 error:
-    if (oldfd != -1) {
-        close(oldfd);
+    // Nothing has been swapped in yet: drop the new pieces and the data appended for them.
+    // A block allocated for the batch goes away with the last piece pointing into it, if there is any.
+    if (b != NULL) {
+        b->len = b_len;
+        if (fresh && b->pieces == 0) {
+            block_release(file, b);
+        }
     }
-    if (tmpfd != -1) {
-        close(tmpfd);
+    for (Piece* p = first; p != NULL; ) {
+        Piece* next = p != last ? list_next(p, Piece, list) : NULL;
+        piece_free(file, p);
+        p = next;
     }
-    if (dirfd != -1) {
-        close(dirfd);
+    list_del(&change->list);
+    change_free(file, change, false);
+    return false;
+
+}
+
+static int edits_compare(const void* a, const void* b) {
+    const PieceChainEdit_t* ea = *(const PieceChainEdit_t* const*) a;
+    const PieceChainEdit_t* eb = *(const PieceChainEdit_t* const*) b;
+
+    // Edits at the same offset are kept in the order they were given
+    if (ea->offset != eb->offset) {
+        return ea->offset < eb->offset ? -1 : 1;
     }
-    if (tmpname != NULL) {
-        unlink(tmpname);
-        free(tmpname);
+    return ea < eb ? -1 : (ea > eb ? 1 : 0);
+}
+
+bool piece_chain_apply_edits(PieceChain_t* file, const PieceChainEdit_t* edits, size_t n) {
+
+    if (n == 0) {
+        return true;
     }
-    if (pathdup != NULL) {
-        free(pathdup);
+
+    const PieceChainEdit_t** sorted = malloc(sizeof(PieceChainEdit_t*) * n);
+    if (sorted == NULL) {
+        set_error(file, "Out of memory", ENOMEM);
+        return false;
     }
-    return false;
+    for (size_t i = 0; i < n; ++i) {
+        sorted[i] = &edits[i];
+    }
+    qsort(sorted, n, sizeof(PieceChainEdit_t*), edits_compare);
+
+    // Offsets refer to the contents before the batch, so edits cannot overlap
+    size_t prev_end = 0;
+    size_t total = 0;
+    size_t m = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (sorted[i]->offset > file->size || sorted[i]->offset < prev_end) {
+            set_error(file, "Invalid edit range", EINVAL);
+            free(sorted);
+            return false;
+        }
+        prev_end = sorted[i]->offset + MIN(sorted[i]->delete_len, file->size - sorted[i]->offset);
+        total += sorted[i]->len;
+
+        // Edits that neither delete nor insert anything would only split pieces
+        if (sorted[i]->len > 0 || prev_end > sorted[i]->offset) {
+            sorted[m++] = sorted[i];
+        }
+    }
+    if (m == 0) {
+        free(sorted);
+        return true;
+    }
+
+    // The whole batch goes in its own revision, even in coalescing mode
+    bool success = chain_commit(file);
+    size_t mark = file->journal_len;
+    success = success && journal_edits(file, edits, n);
+    if (success && !edits_apply(file, sorted, m, total)) {
+        file->journal_len = mark;
+        success = false;
+    }
+    success = success && chain_commit(file);
+
+    free(sorted);
+    return success;
 
 }
 
-static bool piece_chain_save_inplace(PieceChain_t* file, const char* path) {
+static bool chain_replace(PieceChain_t* file, size_t offset, const unsigned char* data, size_t len) {
+
+    if (len == 0) {
+        return true;
+    }
+    if (offset > file->size) {
+        return false;
+    }
+
+    // First try to overwrite the cached piece, or to extend it if it ends exactly where the replacement begins
+    Piece* piece;
+    size_t piece_offset;
+    if (piece_find(file, offset, &piece, &piece_offset)) {
+        if (cache_replace(file, piece, piece_offset, data, len)) {
+            file->edits++;
+            return true;
+        }
+        if (piece_offset == 0 && list_first(&file->pieces, Piece, list) != piece) {
+            Piece* prev = list_prev(piece, Piece, list);
+            if (cache_replace(file, prev, prev->size, data, len)) {
+                file->edits++;
+                return true;
+            }
+        }
+    }
+
+    // Otherwise, the replacement is a single edit that deletes and inserts at the same time
+    PieceChainEdit_t edit = { offset, len, data, len };
+    const PieceChainEdit_t* edits = &edit;
+    return edits_apply(file, &edits, 1, len);
+
+}
+
+bool piece_chain_commit(PieceChain_t* file) {
+
+    // In coalescing mode the changes stay pending until their group is old or big enough:
+    // the cached piece keeps absorbing adjacent edits, and no revision is allocated meanwhile
+    if (commit_defer(file)) {
+        return journal_flush(file, JOURNAL_GROUP);
+    }
+    return chain_commit(file);
+}
+
+bool piece_chain_commit_now(PieceChain_t* file) {
+    return chain_commit(file);
+}
+
+static bool commit_defer(PieceChain_t* file) {
+    if ((file->options.coalesce_ms == 0 && file->options.coalesce_bytes == 0) || list_empty(&file->pending_changes)) {
+        return false;
+    }
+    bool young = file->options.coalesce_ms == 0 || clock_ms() - file->group_start < file->options.coalesce_ms;
+    bool small = file->options.coalesce_bytes == 0 || file->group_bytes < file->options.coalesce_bytes;
+    return young && small;
+}
+
+static bool chain_commit(PieceChain_t* file) {
+
+    // The revision exists only once it is in the journal
+    if (!journal_flush(file, JOURNAL_COMMIT)) {
+        return false;
+    }
+    file->group_bytes = 0;
+
+    // Allocate a new revision only if there are pending changes not yet committed
+    if (!list_empty(&file->pending_changes)) {
+        Revision* rev = revision_alloc(file);
+        if (rev == NULL) {
+            return false;
+        }
+        rev->parent = file->current_revision;
+        if (rev->parent != NULL) {
+            rev->depth = rev->parent->depth + 1;
+            rev->parent->redo = rev;
+        }
+        file->current_revision = rev;
+        
+        // Move the changes from the temporary list to the revision
+        rev->changes.next = file->pending_changes.next;
+        rev->changes.prev = file->pending_changes.prev;
+        file->pending_changes.next->prev = &rev->changes;
+        file->pending_changes.prev->next = &rev->changes;
+        list_init(&file->pending_changes);
+
+        if (file->options.history_budget != 0) {
+            history_trim(file);
+        }
+    }
     
-    int fd;
-    while ((fd = open(path, O_WRONLY | O_CREAT, 0666)) == -1 && errno == EINTR);
-    if (fd < 0) {
-        set_error(file, "Cannot open file", errno);
+    // Invalidate piece cache
+    cache_put(file, NULL);
+
+    return true;
+}
+
+bool piece_chain_undo(PieceChain_t* file, size_t* pos) {
+
+    // Commit any pending change
+    if (!chain_commit(file)) {
         return false;
     }
 
-    if (!write_to_fd(file, fd)) {
-        close(fd);
+    if (file->current_revision->parent == NULL) {
         return false;
     }
 
-    int res;
-    while ((res = fsync(fd)) == -1 && errno == EINTR);
-    if (res < 0) {
-        set_error(file, "Cannot fsync file", errno);
-        close(fd);
+    revision_undo(file, pos);
+    journal_flush(file, JOURNAL_COMMIT); // If the write fails, the next commit tries again
+
+    return true;
+
+}
+
+bool piece_chain_redo(PieceChain_t* file, size_t* pos) {
+    
+    // Commit any pending change
+    if (!chain_commit(file)) {
         return false;
     }
 
-    close(fd);
+    // Exit if there's nothing to redo
+    if (file->current_revision->redo == NULL) {
+        return false;
+    }
 
+    revision_redo(file, file->current_revision->redo, pos);
+    journal_flush(file, JOURNAL_COMMIT); // If the write fails, the next commit tries again
+    
     return true;
 
 }
 
-bool piece_chain_save(PieceChain_t* file, const char* path, enum PieceChainSaveMode savemode) {    
+uint64_t piece_chain_revision(PieceChain_t* file) {
+    return file->current_revision->id;
+}
 
-    bool success = false;
-    switch (savemode) {
-        
-        case SAVE_MODE_ATOMIC:
-            success = piece_chain_save_atomic(file, path);
-            break;
-        
-        case SAVE_MODE_INPLACE:
-            success = piece_chain_save_inplace(file, path);
+uint64_t piece_chain_revision_parent(PieceChain_t* file, uint64_t id) {
+    Revision* rev = revision_find(file, id);
+    return rev != NULL && rev->parent != NULL ? rev->parent->id : 0;
+}
+
+bool piece_chain_goto_revision(PieceChain_t* file, uint64_t id, size_t* pos) {
+
+    // Commit any pending change
+    if (!chain_commit(file)) {
+        return false;
+    }
+
+    Revision* target = revision_find(file, id);
+    if (target == NULL) {
+        set_error(file, "No such revision", EINVAL);
+        return false;
+    }
+    if (target == file->current_revision) {
+        return true;
+    }
+
+    // Find the closest common ancestor of the current and the target revisions
+    Revision* a = file->current_revision;
+    Revision* b = target;
+    while (a->depth > b->depth) {
+        a = a->parent;
+    }
+    while (b->depth > a->depth) {
+        b = b->parent;
+    }
+    while (a != b) {
+        a = a->parent;
+        b = b->parent;
+    }
+
+    // Only the revisions on the path between the two are swapped:
+    // undo up to the common ancestor, then follow the target branch down, leaving redo pointers along it
+    while (file->current_revision != a) {
+        revision_undo(file, pos);
+    }
+    for (Revision* rev = target; rev != a; rev = rev->parent) {
+        rev->parent->redo = rev;
+    }
+    while (file->current_revision != target) {
+        revision_redo(file, file->current_revision->redo, pos);
+    }
+    journal_flush(file, JOURNAL_COMMIT); // If the write fails, the next commit tries again
+
+    return true;
+
+}
+
+static Piece* compact_run(PieceChain_t* file, Piece** end, size_t threshold, size_t* len) {
+
+    // Extends the run of pieces starting at `*end` as long as the pieces are small,
+    // without making the merged piece bigger than a block.
+    // Returns the piece the run starts at, and leaves in `*end` the last one.
+    Piece* start = *end;
+    *len = start->size;
+    if (start->size >= threshold) {
+        return start;
+    }
+    while ((*end)->list.next != &file->pieces) {
+        Piece* next = list_next(*end, Piece, list);
+        if (next->size >= threshold || *len + next->size > file->options.max_block_size) {
             break;
-        
-        case SAVE_MODE_AUTO:
-            success = piece_chain_save_atomic(file, path);
-            if (!success) {
-                success = piece_chain_save_inplace(file, path);
+        }
+        *end = next;
+        *len += next->size;
+    }
+    return start;
+}
+
+static Piece* compact_merge(PieceChain_t* file, Piece* start, Piece* end, size_t len) {
+
+    // Copies the data of a run of pieces contiguously in a new piece
+    Block* b;
+    if (!list_empty(&file->all_blocks) && block_can_fit(list_last(&file->all_blocks, Block, list), len)) {
+        b = list_last(&file->all_blocks, Block, list);
+    } else {
+        b = block_alloc(file, len);
+        if (b == NULL) {
+            return NULL;
+        }
+    }
+    Piece* p = piece_alloc(file, b);
+    if (p == NULL) {
+        if (b->pieces == 0) {
+            block_release(file, b);
+        }
+        return NULL;
+    }
+    p->data = b->data + b->len;
+    p->size = len;
+    p->lines = 0;
+    list_for_each_interval(q, start, end, Piece, list) {
+        if (!window_copy(q->block, b->data + b->len, q->data, q->size)) {
+            set_error(file, "Cannot map window", errno);
+            piece_free(file, p);
+            return NULL;
+        }
+        b->len += q->size;
+        p->lines += q->lines;
+    }
+    return p;
+}
+
+static bool compact_flatten(PieceChain_t* file, size_t threshold) {
+
+    // Since the whole history is going away, we can build a brand new list of pieces
+    // and make it the only change of the only revision left.
+    // The new revision and change are allocated upfront, so that nothing can fail after the history is gone.
+    // The new pieces come from a new pool, so that all the old ones can be released at once:
+    // walking the spans of past revisions is not possible, since later changes relinked their pieces.
+    struct list_head pieces = LIST_HEAD_INIT(pieces);
+    struct pool old_pieces;
+    pool_move(&old_pieces, &file->piece_pool);
+    pool_init(&file->piece_pool, sizeof(Piece));
+    Revision* rev = revision_alloc(file);
+    if (rev == NULL) {
+        goto error;
+    }
+    Change* change = change_alloc(file, 0);
+    if (change == NULL) {
+        goto error;
+    }
+    list_del(&change->list);
+    list_add_tail(&rev->changes, &change->list);
+
+    for (struct list_head* it = file->pieces.next; it != &file->pieces; ) {
+        Piece* end = container_of(it, Piece, list);
+        size_t len;
+        Piece* start = compact_run(file, &end, threshold, &len);
+        it = end->list.next;
+
+        Piece* p;
+        if (start != end) {
+            p = compact_merge(file, start, end, len);
+        } else {
+            p = piece_alloc(file, start->block);
+            if (p != NULL) {
+                p->data = start->data;
+                p->size = start->size;
+                p->lines = start->lines;
             }
+        }
+        if (p == NULL) {
+            goto error;
+        }
+        list_add_tail(&pieces, &p->list);
+    }
+
+    // The old pieces are released all at once, so the pieces pointing into each block have to be counted again
+    list_for_each_member(b, &file->all_blocks, Block, list) {
+        b->pieces = 0;
+    }
+    list_for_each_member(p, &pieces, Piece, list) {
+        if (block_owned(file, p->block)) {
+            p->block->pieces++;
+        }
+    }
+    list_for_each_member(b, &file->all_blocks, Block, list) {
+        if (b->pieces == 0) {
+            block_release(file, b);
+        }
+    }
+
+    list_for_each_rev_member(r, &file->all_revisions, Revision, list) {
+        if (r != rev) {
+            list_del(&r->list);
+            revision_free(file, r, false);
+        }
+    }
+    pool_destroy(&old_pieces);
+    list_init(&file->pieces);
+    file->index = NULL;
+    file->size = 0;
+    file->current_revision = rev;
+    cursor_put(file, NULL, 0);
+
+    if (!list_empty(&pieces)) {
+        Piece* first = list_first(&pieces, Piece, list);
+        Piece* last = list_last(&pieces, Piece, list);
+        first->list.prev = &file->pieces;
+        last->list.next = &file->pieces;
+        span_init(&change->replacement, first, last);
+        span_swap(file, &change->original, &change->replacement);
+    }
+
+    return true;
+
+error:
+    // The blocks allocated for the runs merged so far are not referenced by any old piece
+    list_for_each_member(p, &pieces, Piece, list) {
+        if (block_owned(file, p->block) && --p->block->pieces == 0) {
+            block_release(file, p->block);
+        }
+    }
+    pool_destroy(&file->piece_pool);
+    pool_move(&file->piece_pool, &old_pieces);
+    if (rev != NULL) {
+        list_del(&rev->list);
+        revision_free(file, rev, false);
+    }
+    return false;
+}
+
+bool piece_chain_compact(PieceChain_t* file, size_t threshold, bool discard_history) {
+
+    if (!chain_commit(file)) {
+        return false;
+    }
+    if (threshold == 0) {
+        threshold = COMPACT_THRESHOLD;
+    }
+    if (discard_history) {
+        return compact_flatten(file, threshold);
+    }
+
+    // Redo history refers to the pieces we are going to replace, so it has to go.
+    // In undo tree mode, instead, if the current revision has children the merges go in a new child revision,
+    // so that the other branches still find the pieces they were committed over.
+    // Branches off the ancestors are safe anyway, since undo restores the original pieces first.
+    bool child = false;
+    if (!file->options.undo_tree) {
+        revision_purge(file);
+    } else {
+        child = file->current_revision->redo != NULL;
+    }
+
+    // Each merged run is recorded as a change of the current revision, so that undo restores
+    // the original pieces before unwinding the revision. The changes take the position
+    // of the last real edit, which is what redo reports. The first revision of an empty chain has no edit at all.
+    Revision* rev = file->current_revision;
+    size_t pos = list_empty(&rev->changes) ? 0 : list_last(&rev->changes, Change, list)->pos;
+    bool success = true;
+    for (struct list_head* it = file->pieces.next; it != &file->pieces; ) {
+        Piece* end = container_of(it, Piece, list);
+        size_t len;
+        Piece* start = compact_run(file, &end, threshold, &len);
+        it = end->list.next;
+        if (start == end) {
+            continue;
+        }
+
+        Piece* merged = compact_merge(file, start, end, len);
+        if (merged == NULL) {
+            success = false;
             break;
+        }
+        Change* change = change_alloc(file, pos);
+        if (change == NULL) {
+            piece_free(file, merged);
+            success = false;
+            break;
+        }
+        if (!child) {
+            list_del(&change->list);
+            list_add_tail(&rev->changes, &change->list);
+        }
 
-        default:
-            abort();
+        merged->list.prev = start->list.prev;
+        merged->list.next = end->list.next;
+        span_init(&change->original, start, end);
+        span_init(&change->replacement, merged, merged);
+        span_swap(file, &change->original, &change->replacement);
     }
 
-    if (success) {
-        file->dirty = false;
+    // The runs merged so far are consistent, so they are committed even if a later one failed
+    if (child && !chain_commit(file)) {
+        return false;
     }
     return success;
-
-}
-
-size_t piece_chain_size(PieceChain_t* file) {
-    return file->size;
 }
 
-bool piece_chain_dirty(PieceChain_t* file) {
-    return file->dirty;
-}
+bool piece_chain_read_byte(PieceChain_t* file, size_t offset, unsigned char* out) {
+    Piece* p;
+    size_t p_offset;
+    if (!piece_find(file, offset, &p, &p_offset)) {
+        return false;
+    }
+    if (!window_acquire(p->block, p->data + p_offset)) {
+        set_error(file, "Cannot map window", errno);
+        return false;
+    }
 
-PieceChainError_t* piece_chain_last_error(PieceChain_t* file) {
-    return &file->last_error;
+    *out = p->data[p_offset];
+    window_release(p->block, p->data + p_offset);
+    return true;
 }
 
-bool piece_chain_insert(PieceChain_t* file, size_t offset, const unsigned char* data, size_t len) {
+size_t piece_chain_read(PieceChain_t* file, size_t offset, unsigned char* buf, size_t len) {
+    Piece* p;
+    size_t p_offset;
+    if (len == 0 || !piece_find(file, offset, &p, &p_offset)) {
+        return 0;
+    }
 
-    if (len == 0) {
-        return true;
+    // A single lookup, then copy from the following pieces
+    len = MIN(len, file->size - offset);
+    size_t done = 0;
+    while (done < len) {
+        size_t n = MIN(p->size - p_offset, len - done);
+        if (!window_copy(p->block, buf + done, p->data + p_offset, n)) {
+            set_error(file, "Cannot map window", errno);
+            break;
+        }
+        done += n;
+        p_offset = 0;
+        p = list_next(p, Piece, list);
     }
-    if (offset > file->size) {
+    return done;
+}
+
+bool piece_chain_read_direct(PieceChain_t* file, size_t offset, size_t len, const unsigned char** out) {
+    // Nothing would keep the window of a windowed file mapped after returning
+    Piece* p;
+    size_t p_offset;
+    if (len == 0 || !piece_find(file, offset, &p, &p_offset) || p->block->windows != NULL || p->size - p_offset < len) {
         return false;
     }
+    *out = p->data + p_offset;
+    return true;
+}
 
-    // Find the piece at offset `offset`
-    Piece* piece;
-    size_t piece_offset;
-    if (!piece_find(file, offset, &piece, &piece_offset)) {
-        if (list_empty(&file->pieces)) {
-            piece = NULL;
-            piece_offset = 0;
-        } else if (offset == file->size) {
-            piece = list_last(&file->pieces, Piece, list);
-            piece_offset = piece->size;
-        } else {
-            return false;
-        }
+static bool advise_range(PieceChain_t* file, size_t start, size_t len, enum PieceChainAdvice advice) {
+    Piece* p;
+    size_t piece_start;
+    if (len == 0 || !piece_find(file, start, &p, &piece_start)) {
+        return true;
     }
 
-    // Discard any redo history
-    revision_purge(file);
-
-    // First try with the cached piece.
-    // If we are inserting at the beginning of a piece, check if the previous one was cached and try using it
-    if (piece != NULL) {
-        if (cache_insert(file, piece, piece_offset, data, len)) {
-            goto success;
+    // Consecutive pieces pointing to consecutive regions of the same block are advised at once
+    Block* block = NULL;
+    size_t run = 0;
+    size_t run_len = 0;
+    size_t end = start + MIN(len, file->size - start);
+    for (size_t off = start; off < end; off += p->size - piece_start, piece_start = 0, p = list_next(p, Piece, list)) {
+        size_t block_off = (size_t) (p->data - p->block->data) + piece_start;
+        size_t n = MIN(p->size - piece_start, end - off);
+        if (p->block == block && block_off == run + run_len) {
+            run_len += n;
+            continue;
         }
-        if (piece_offset == 0 && list_first(&file->pieces, Piece, list) != piece) {
-            Piece* prev = list_prev(piece, Piece, list);
-            if (cache_insert(file, prev, prev->size, data, len)) {
-                goto success;
-            }
+        if (block != NULL && !block_advise(block, run, run_len, advice)) {
+            return false;
         }
+        block = p->block;
+        run = block_off;
+        run_len = n;
     }
+    return block == NULL || block_advise(block, run, run_len, advice);
+}
 
-    // Let's see if we can reuse the last block to store the new data
-    Block* b;
-    if (!list_empty(&file->all_blocks) && block_can_fit(list_last(&file->all_blocks, Block, list), len)) {
-        b = list_last(&file->all_blocks, Block, list);
-    } else {
-        b = block_alloc(file, len);
-        if (b == NULL) {
-            return false;
-        }
+static void advise_blocks(PieceChain_t* file, enum PieceChainAdvice advice) {
+    // Just a hint, failures do not matter
+    list_for_each_member(b, &file->all_blocks, Block, list) {
+        block_advise(b, 0, b->size, advice);
     }
+    for (size_t i = 0; i < file->shared_count; ++i) {
+        block_advise(file->shared[i], 0, file->shared[i]->size, advice);
+    }
+}
 
-    unsigned char* ptr = block_append(b, data, len);
-    if (ptr == NULL) {
+bool piece_chain_advise(PieceChain_t* file, size_t offset, size_t len, enum PieceChainAdvice advice) {
+    if (!advise_range(file, offset, len, advice)) {
+        set_error(file, "Cannot advise", errno);
         return false;
     }
+    return true;
+}
 
-    // There might be two cases for insertion, depending on the offset:
-    // - At the boundary of an already existing piece
-    // - In the middle of an existing piece
-    // In the first case, we can just allocate a new piece and insert it,
-    // while in the other we have to replace the existing piece with three new ones.
-
-    Change* change = change_alloc(file, offset);
-    if (change == NULL) {
+bool piece_chain_chunk_at(PieceChain_t* file, size_t offset, const unsigned char** data, size_t* start, size_t* len, PieceChainPin_t** pin) {
+    Piece* p;
+    size_t p_offset;
+    if (!piece_find(file, offset, &p, &p_offset)) {
         return false;
     }
 
-    Piece* new;
-
-    if (piece == NULL) {
-        // We have no piece to attach to because this is the first insertion to an empty file
-
-        new = piece_alloc(file);
-        if (new == NULL) {
+    // Pieces of windowed files are handed out one window at a time,
+    // and the window stays mapped until the caller drops the pin
+    PieceChainPin_t* held = NULL;
+    if (p->block->windows != NULL) {
+        if (pin == NULL) {
+            set_error(file, "Windowed chunks must be pinned", EINVAL);
             return false;
         }
-        new->data = ptr;
-        new->size = len;
-
-        // Insert as the first piece
-        new->list.prev = new->list.next = &file->pieces;
-
-        span_init(&change->original, NULL, NULL);
-        span_init(&change->replacement, new, new);       
-
-    } else if (piece_offset == 0 || piece_offset == piece->size) {
-        // For how we counted offsets, the only way that the `piece_offset == piece->size` condition
-        // can be true is when we are inserting at the end of the file.
-
-        new = piece_alloc(file);
-        if (new == NULL) {
+        held = malloc(sizeof(PieceChainPin_t));
+        if (held == NULL) {
+            set_error(file, "Out of memory", ENOMEM);
             return false;
         }
-        new->data = ptr;
-        new->size = len;
-
-        // Insert before or after the piece
-        if (piece_offset == 0) {
-            new->list.prev = piece->list.prev;
-            new->list.next = &piece->list;
-        } else {
-            new->list.prev = &piece->list;
-            new->list.next = piece->list.next;
-        }
-        
-        span_init(&change->original, NULL, NULL);
-        span_init(&change->replacement, new, new);
-
-    } else {
-
-        Piece* before = piece_alloc(file);
-        Piece* middle = piece_alloc(file);
-        Piece* after = piece_alloc(file);
-        if (before == NULL || middle == NULL || after == NULL) {
+        if (!window_acquire(p->block, p->data + p_offset)) {
+            set_error(file, "Cannot map window", errno);
+            free(held);
             return false;
         }
-
-        // Split the data among the three pieces
-        before->data = piece->data;
-        before->size = piece_offset;
-        middle->data = ptr;
-        middle->size = len;
-        after->data = piece->data + piece_offset;
-        after->size = piece->size - piece_offset;
-
-        // Join the three pieces together
-        before->list.prev = piece->list.prev;
-        before->list.next = &middle->list;
-        middle->list.prev = &before->list;
-        middle->list.next = &after->list;
-        after->list.prev = &middle->list;
-        after->list.next = piece->list.next;
-
-        span_init(&change->original, piece, piece);
-        span_init(&change->replacement, before, after);
-    
-        new = middle;
-
+        atomic_init(&held->refs, 1);
+        atomic_fetch_add_explicit(&p->block->refs, 1, memory_order_relaxed);
+        held->block = p->block;
+        held->data = p->data + p_offset;
+    }
+    if (pin != NULL) {
+        *pin = held;
     }
 
-    // Apply the prepared change
-    cache_put(file, new);
-    span_swap(file, &change->original, &change->replacement);
-
-success:
-
-    // Mark the file as dirty
-    file->dirty = true;
-    
+    size_t head = p_offset - (window_clip_back(p->block, p->data + p_offset + 1, p_offset + 1) - 1);
+    *data = p->data + head;
+    *start = offset - p_offset + head;
+    *len = window_clip(p->block, *data, p->size - head);
     return true;
-
 }
 
-bool piece_chain_delete(PieceChain_t* file, size_t offset, size_t len) {
-
-    if (len == 0) {
-        return true;
+PieceChainPin_t* piece_chain_pin_ref(PieceChainPin_t* pin) {
+    if (pin != NULL) {
+        atomic_fetch_add_explicit(&pin->refs, 1, memory_order_relaxed);
     }
-    if (offset > file->size) {
-        return false;
+    return pin;
+}
+
+void piece_chain_pin_unref(PieceChainPin_t* pin) {
+    if (pin == NULL || atomic_fetch_sub_explicit(&pin->refs, 1, memory_order_acq_rel) != 1) {
+        return;
     }
+    window_release(pin->block, pin->data);
+    block_unref(pin->block);
+    free(pin);
+}
 
-    // Find the piece at the begin of the range to delete
-    Piece* start_piece;
-    size_t start_piece_offset;
-    Piece* end_piece;
-    size_t end_piece_offset;
-    if (!piece_find(file, offset, &start_piece, &start_piece_offset)) {
+static bool find_forward(PieceChain_t* file, size_t from, size_t end, const unsigned char* pat, size_t plen, unsigned char* carry, size_t* out) {
+
+    // Searches the first occurrence of the pattern in the range [from, end).
+    // Occurrences entirely inside a fragment are found searching the fragment itself,
+    // while the ones crossing fragments are found searching the last plen - 1 bytes seen (the carry)
+    // followed by the first bytes of the next fragment: an occurrence is always found
+    // while looking at the fragment containing its last byte.
+    Piece* p;
+    size_t piece_start;
+    if (from >= end || !piece_find(file, from, &p, &piece_start)) {
         return false;
     }
-    if (!piece_find(file, offset + len, &end_piece, &end_piece_offset)) {
-        // If the end of the delete range fell out of the file, delete up to the last char
-        end_piece = list_last(&file->pieces, Piece, list);
-        end_piece_offset = end_piece->size;
-    }  
-    assert(start_piece != NULL);
-    assert(end_piece != NULL);
 
-    // Discard any redo history
-    revision_purge(file);
+    size_t carry_len = 0;
+    size_t off = from;
+    while (off < end) {
+        const unsigned char* frag = p->data + piece_start;
+        size_t len = window_clip(p->block, frag, MIN(p->size - piece_start, end - off));
+        if (!window_acquire(p->block, frag)) {
+            set_error(file, "Cannot map window", errno);
+            return false;
+        }
+        const unsigned char* m;
+        if (carry_len > 0 && len > 0) {
+            size_t head = MIN(plen - 1, len);
+            memcpy(carry + carry_len, frag, head);
+            if ((m = search_forward(carry, carry_len + head, pat, plen)) != NULL) {
+                window_release(p->block, frag);
+                *out = off - carry_len + (m - carry);
+                return true;
+            }
+        }
+        if ((m = search_forward(frag, len, pat, plen)) != NULL) {
+            window_release(p->block, frag);
+            *out = off + (m - frag);
+            return true;
+        }
 
-    // First try with the cached piece
-    if (cache_delete(file, start_piece, start_piece_offset, len)) {
-        goto success;
+        // Keep the last plen - 1 bytes for the next fragment
+        if (len >= plen - 1) {
+            memcpy(carry, frag + len - (plen - 1), plen - 1);
+            carry_len = plen - 1;
+        } else {
+            size_t keep = MIN(carry_len, plen - 1 - len);
+            memmove(carry, carry + carry_len - keep, keep);
+            memcpy(carry + keep, frag, len);
+            carry_len = keep + len;
+        }
+        window_release(p->block, frag);
+
+        off += len;
+        piece_start += len;
+        if (piece_start == p->size) {
+            piece_start = 0;
+            p = list_next(p, Piece, list);
+        }
     }
 
-    // Deletion range can both start and end up in the middle of a piece.
-    // This means that we might have to create new pieces to account for the split pieces.
+    return false;
+}
 
-    Change* change = change_alloc(file, offset);
-    if (change == NULL) {
+static bool find_backward(PieceChain_t* file, size_t lo, size_t end, const unsigned char* pat, size_t plen, unsigned char* carry, size_t* out) {
+
+    // Mirror image of `find_forward`: searches the last occurrence in the range [lo, end),
+    // walking the fragments backwards and carrying the first plen - 1 bytes seen.
+    // The carry is kept at `carry + plen - 1`, so that the tail of a fragment can be copied right before it.
+    Piece* p;
+    size_t piece_start;
+    if (lo >= end || !piece_find(file, end - 1, &p, &piece_start)) {
         return false;
     }
 
-    bool split_start = start_piece_offset != 0;
-    bool split_end = end_piece_offset != end_piece->size;
-    
-    struct list_head* before = start_piece->list.prev;
-    struct list_head* after = end_piece->list.next;
-
-    Piece* new_start = NULL;
-    Piece* new_end = NULL;
-
-    if (split_start) {
-        new_start = piece_alloc(file);
-        if (new_start == NULL) {
+    unsigned char* head = carry + plen - 1;
+    size_t carry_len = 0;
+    size_t pstart = end - 1 - piece_start; // Absolute offset of the first byte of `p`
+    size_t frag_end = end;
+    for (;;) {
+        size_t len = window_clip_back(p->block, p->data + (frag_end - pstart), frag_end - MAX(pstart, lo));
+        size_t frag_start = frag_end - len;
+        const unsigned char* frag = p->data + (frag_start - pstart);
+        if (!window_acquire(p->block, frag)) {
+            set_error(file, "Cannot map window", errno);
             return false;
         }
-        new_start->data = start_piece->data;
-        new_start->size = start_piece_offset;
-        new_start->list.prev = before;
-        new_start->list.next = after;
-    }
+        const unsigned char* m;
+        if (carry_len > 0 && len > 0) {
+            size_t tail = MIN(plen - 1, len);
+            memcpy(head - tail, frag + len - tail, tail);
+            if ((m = search_backward(head - tail, tail + carry_len, pat, plen)) != NULL) {
+                window_release(p->block, frag);
+                *out = frag_end - tail + (m - (head - tail));
+                return true;
+            }
+        }
+        if ((m = search_backward(frag, len, pat, plen)) != NULL) {
+            window_release(p->block, frag);
+            *out = frag_start + (m - frag);
+            return true;
+        }
 
-    if (split_end) {
-        new_end = piece_alloc(file);
-        if (new_end == NULL) {
-            return false;
+        // Keep the first plen - 1 bytes for the previous fragment
+        if (len >= plen - 1) {
+            memcpy(head, frag, plen - 1);
+            carry_len = plen - 1;
+        } else {
+            size_t keep = MIN(carry_len, plen - 1 - len);
+            memmove(head + len, head, keep);
+            memcpy(head, frag, len);
+            carry_len = len + keep;
         }
-        new_end->data = end_piece->data + end_piece_offset;
-        new_end->size = end_piece->size - end_piece_offset;
-        new_end->list.prev = before;
-        new_end->list.next = after;
-        if (split_start) {
-            new_end->list.prev = &new_start->list;
-            new_start->list.next = &new_end->list;
+        window_release(p->block, frag);
+
+        if (frag_start == lo) {
+            break;
+        }
+        frag_end = frag_start;
+        if (frag_start == pstart) {
+            p = list_prev(p, Piece, list);
+            pstart -= p->size;
         }
     }
 
-    if (new_start == NULL && new_end != NULL) {
-        new_start = new_end;
-    } else if (new_start != NULL && new_end == NULL) {
-        new_end = new_start;
-    }
+    return false;
+}
 
-    span_init(&change->original, start_piece, end_piece);
-    span_init(&change->replacement, new_start, new_end);
-    span_swap(file, &change->original, &change->replacement);
+bool piece_chain_find(PieceChain_t* file, size_t from, const unsigned char* pattern, size_t len, size_t* out) {
+    size_t which;
+    return piece_chain_find_any(file, from, &pattern, &len, 1, out, &which);
+}
+
+bool piece_chain_rfind(PieceChain_t* file, size_t from, const unsigned char* pattern, size_t len, size_t* out) {
+    if (len > file->size) {
+        return false;
+    }
+    from = MIN(from, file->size - len);
+    if (len == 0) {
+        *out = from;
+        return true;
+    }
 
-success:
+    unsigned char stack_carry[FIND_STACK_CARRY];
+    unsigned char* carry = stack_carry;
+    if (2 * (len - 1) > sizeof(stack_carry) && (carry = malloc(2 * (len - 1))) == NULL) {
+        set_error(file, "Out of memory", ENOMEM);
+        return false;
+    }
+    bool found = find_backward(file, 0, from + len, pattern, len, carry, out);
+    if (carry != stack_carry) {
+        free(carry);
+    }
+    return found;
+}
 
-    // Mark the file as dirty
-    file->dirty = true;
+bool piece_chain_find_any(PieceChain_t* file, size_t from, const unsigned char* const* patterns, const size_t* lens, size_t n, size_t* out, size_t* which) {
 
-    return true;
+    // Each pattern is searched only before the best occurrence found until now
+    size_t max_len = 0;
+    for (size_t i = 0; i < n; ++i) {
+        max_len = MAX(max_len, lens[i]);
+    }
+    unsigned char stack_carry[FIND_STACK_CARRY];
+    unsigned char* carry = stack_carry;
+    if (max_len > 0 && 2 * (max_len - 1) > sizeof(stack_carry) && (carry = malloc(2 * (max_len - 1))) == NULL) {
+        set_error(file, "Out of memory", ENOMEM);
+        return false;
+    }
 
+    bool found = false;
+    size_t best = file->size + 1; // Occurrences have to start before this offset
+    for (size_t i = 0; i < n && from < best; ++i) {
+        size_t pos;
+        if (lens[i] == 0) {
+            pos = from;
+        } else if (!find_forward(file, from, MIN(best - 1 + lens[i], file->size), patterns[i], lens[i], carry, &pos)) {
+            continue;
+        }
+        if (pos <= file->size && pos < best) {
+            best = pos;
+            *which = i;
+            found = true;
+        }
+    }
+    if (carry != stack_carry) {
+        free(carry);
+    }
+    if (found) {
+        *out = best;
+    }
+    return found;
 }
 
-bool piece_chain_replace(PieceChain_t* file, size_t offset, const unsigned char* data, size_t len) {
-    // A replacement is just a convenience shortcut for insertion and deletion
-    if (piece_chain_delete(file, offset, len)) {
-        return piece_chain_insert(file, offset, data, len);
-    } else {
+bool piece_chain_line_to_offset(PieceChain_t* file, size_t line, size_t* out) {
+    if (!file->options.line_index) {
+        set_error(file, "Line index not enabled", EINVAL);
         return false;
     }
-}
-
-bool piece_chain_commit(PieceChain_t* file) {
+    if (line == 0) {
+        *out = 0;
+        return true;
+    }
 
-    // Allocate a new revision only if there are pending changes not yet committed
-    if (!list_empty(&file->pending_changes)) {
-        Revision* rev = revision_alloc(file);
-        if (rev == NULL) {
-            return false;
+    // Descend the index looking for the piece containing the newline ending the previous line
+    size_t n = line;
+    size_t offset = 0;
+    Piece* p = file->index;
+    while (p != NULL) {
+        size_t left_lines = p->left != NULL ? p->left->subtree_lines : 0;
+        size_t left_size = p->left != NULL ? p->left->subtree_size : 0;
+        if (n <= left_lines) {
+            p = p->left;
+        } else if (n - left_lines <= p->lines) {
+            *out = offset + left_size + lines_find(p->block, p->data, p->size, n - left_lines) + 1;
+            return true;
+        } else {
+            n -= left_lines + p->lines;
+            offset += left_size + p->size;
+            p = p->right;
         }
-        file->current_revision = rev;
-        
-        // Move the changes from the temporary list to the revision
-        rev->changes.next = file->pending_changes.next;
-        rev->changes.prev = file->pending_changes.prev;
-        file->pending_changes.next->prev = &rev->changes;
-        file->pending_changes.prev->next = &rev->changes;
-        list_init(&file->pending_changes);
     }
-    
-    // Invalidate piece cache
-    cache_put(file, NULL);
 
-    return true;
+    return false;
 }
 
-bool piece_chain_undo(PieceChain_t* file, size_t* pos) {
-
-    // Commit any pending change
-    if (!piece_chain_commit(file)) {
+bool piece_chain_offset_to_line(PieceChain_t* file, size_t offset, size_t* out) {
+    if (!file->options.line_index) {
+        set_error(file, "Line index not enabled", EINVAL);
         return false;
     }
-
-    if (list_first(&file->all_revisions, Revision, list) == file->current_revision) {
+    if (offset > file->size) {
         return false;
     }
 
-    size_t first_pos = file->size;
-    
-    // Revert all the changes in the last revision
-    list_for_each_rev_member(c, &file->current_revision->changes, Change, list) {
-        span_swap(file, &c->replacement, &c->original);
-        *pos = c->pos;
-        first_pos = MIN(first_pos, c->pos);
+    // Sum the newlines of everything on the left of the offset
+    size_t lines = 0;
+    Piece* p = file->index;
+    while (p != NULL) {
+        size_t left_lines = p->left != NULL ? p->left->subtree_lines : 0;
+        size_t left_size = p->left != NULL ? p->left->subtree_size : 0;
+        if (offset < left_size) {
+            p = p->left;
+        } else if (offset - left_size < p->size) {
+            lines += left_lines + lines_count(p->block, p->data, offset - left_size);
+            break;
+        } else {
+            lines += left_lines + p->lines;
+            offset -= left_size + p->size;
+            p = p->right;
+        }
     }
-    file->current_revision = list_prev(file->current_revision, Revision, list);
 
+    *out = lines;
     return true;
-
 }
 
-bool piece_chain_redo(PieceChain_t* file, size_t* pos) {
-    
-    // Commit any pending change
-    if (!piece_chain_commit(file)) {
-        return false;
+bool piece_chain_visit(PieceChain_t* file, size_t start, size_t len, bool (*visitor)(PieceChain_t*, size_t offset, const unsigned char* data, size_t len, void* user), void* user) {
+    if (start >= file->size || len == 0) {
+        return true;
     }
 
-    // Exit if there's nothing to redo
-    if (list_last(&file->all_revisions, Revision, list) == file->current_revision) {
-        return false;
+    // Find the first piece of the range, then walk the chain from there
+    Piece* p;
+    size_t piece_start;
+    if (!piece_find(file, start, &p, &piece_start)) {
+        return true;
     }
 
-    size_t first_pos = file->size;
-    
-    // Reapply the changes in the revision
-    Revision* rev = list_next(file->current_revision, Revision, list);
-    list_for_each_member(c, &rev->changes, Change, list) {
-        span_swap(file, &c->original, &c->replacement);
-        *pos = c->pos;
-        first_pos = MIN(first_pos, c->pos);
+    size_t off = start;
+    size_t end = start + MIN(len, file->size - start);
+    while (off < end) {
+        const unsigned char* frag = p->data + piece_start;
+        size_t frag_len = window_clip(p->block, frag, MIN(p->size - piece_start, end - off));
+        if (!window_acquire(p->block, frag)) {
+            set_error(file, "Cannot map window", errno);
+            return false;
+        }
+        bool more = visitor(file, off, frag, frag_len, user);
+        window_release(p->block, frag);
+        if (!more) {
+            return false;
+        }
+        off += frag_len;
+        piece_start += frag_len;
+        if (piece_start == p->size) {
+            piece_start = 0;
+            p = list_next(p, Piece, list);
+        }
     }
-    file->current_revision = rev;
-    
-    return true;
 
+    return true;
 }
 
-bool piece_chain_read_byte(PieceChain_t* file, size_t offset, unsigned char* out) {
-    Piece* p;
-    size_t p_offset;
-    if (!piece_find(file, offset, &p, &p_offset)) {
-        return false;
+static bool parallel_visit_chunk(ParallelVisit* v, size_t i) {
+    ParallelChunk* c = &v->chunks[i];
+    Piece* p = c->piece;
+    size_t piece_start = c->piece_offset;
+    size_t off = c->start;
+    while (off < c->end) {
+        const unsigned char* frag = p->data + piece_start;
+        size_t frag_len = window_clip(p->block, frag, MIN(p->size - piece_start, c->end - off));
+        if (!window_acquire(p->block, frag)) {
+            atomic_store_explicit(&v->err, errno, memory_order_relaxed);
+            return false;
+        }
+        bool more = v->visitor(v->file, i, off, frag, frag_len, v->user);
+        window_release(p->block, frag);
+        if (!more) {
+            return false;
+        }
+        off += frag_len;
+        piece_start += frag_len;
+        if (piece_start == p->size) {
+            piece_start = 0;
+            p = list_next(p, Piece, list);
+        }
     }
-
-    *out = p->data[p_offset];
     return true;
 }
 
-bool piece_chain_visit(PieceChain_t* file, size_t start, size_t len, bool (*visitor)(PieceChain_t*, size_t offset, const unsigned char* data, size_t len, void* user), void* user) {
+static void* parallel_worker(void* arg) {
+    ParallelVisit* v = arg;
+    while (!atomic_load_explicit(&v->failed, memory_order_relaxed)) {
+        size_t i = atomic_fetch_add_explicit(&v->next, 1, memory_order_relaxed);
+        if (i >= v->count) {
+            break;
+        }
+        if (!parallel_visit_chunk(v, i)) {
+            atomic_store_explicit(&v->failed, true, memory_order_relaxed);
+        }
+    }
+    return NULL;
+}
+
+bool piece_chain_visit_parallel(
+    PieceChain_t* file,
+    size_t start,
+    size_t len,
+    size_t chunks,
+    bool (*visitor)(PieceChain_t*, size_t chunk, size_t offset, const unsigned char* data, size_t len, void* user),
+    bool (*reduce)(PieceChain_t*, size_t chunk, void* user),
+    void* user
+) {
     if (start >= file->size || len == 0) {
         return true;
     }
+    len = MIN(len, file->size - start);
 
-    // The current text is made up of the current active pieces
-    size_t off = 0;
-    list_for_each_member(p, &file->pieces, Piece, list) {
-        if (off + p->size >= start) {
-            size_t piece_start = off <= start ? start - off : 0;
-            size_t piece_len = p->size - piece_start - (off + p->size >= start + len ? off + p->size - start - len : 0);
-            if (!visitor(file, off + piece_start, p->data + piece_start, piece_len, user)) {
-                return false;
-            }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = cpus > 0 ? (size_t) cpus : 1;
+    if (chunks == 0) {
+        chunks = threads;
+    }
+
+    // Do not bother splitting ranges too small to gain anything from it
+    size_t chunk_size = MAX((len + chunks - 1) / chunks, PARALLEL_MIN_CHUNK);
+    size_t count = (len + chunk_size - 1) / chunk_size;
+
+    ParallelVisit v = {
+        .file = file,
+        .visitor = visitor,
+        .user = user,
+        .count = 0,
+        .chunks = malloc(sizeof(ParallelChunk) * count)
+    };
+    atomic_init(&v.next, 0);
+    atomic_init(&v.failed, false);
+    atomic_init(&v.err, 0);
+    if (v.chunks == NULL) {
+        set_error(file, "Out of memory", ENOMEM);
+        return false;
+    }
+
+    // Chunks are located on this thread, since lookups move the cursor.
+    // A boundary is moved back to the start of the piece containing it, unless this makes the chunk too uneven.
+    size_t end = start + len;
+    for (size_t i = 0; i < count; ++i) {
+        size_t b = start + i * chunk_size;
+        Piece* p = NULL;
+        size_t off = 0;
+        piece_find(file, b, &p, &off);
+        if (i > 0 && off > 0 && off <= chunk_size / 2 && b - off > v.chunks[v.count - 1].start) {
+            b -= off;
+            off = 0;
         }
-        off += p->size;
+        if (v.count > 0) {
+            v.chunks[v.count - 1].end = b;
+        }
+        v.chunks[v.count++] = (ParallelChunk) { p, off, b, end };
     }
 
-    return true;
+    // Each chunk is read sequentially
+    advise_range(file, start, len, ADVICE_SEQUENTIAL);
+
+    // Spawn the workers, and take part in the work on this thread too.
+    // If a thread cannot be created, the others will just pick up more chunks.
+    threads = MIN(threads, v.count);
+    pthread_t* workers = malloc(sizeof(pthread_t) * threads);
+    size_t spawned = 0;
+    if (workers != NULL) {
+        while (spawned < threads - 1 && pthread_create(&workers[spawned], NULL, parallel_worker, &v) == 0) {
+            spawned++;
+        }
+    }
+    parallel_worker(&v);
+    for (size_t i = 0; i < spawned; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    advise_range(file, start, len, ADVICE_NORMAL);
+
+    bool success = !atomic_load(&v.failed);
+    if (atomic_load(&v.err) != 0) {
+        set_error(file, "Cannot map window", atomic_load(&v.err));
+    }
+    for (size_t i = 0; success && reduce != NULL && i < v.count; ++i) {
+        success = reduce(file, i, user);
+    }
+    free(v.chunks);
+    return success;
 }
 
 PieceChainIterator_t* piece_chain_iter(PieceChain_t* file, size_t start, size_t len) {
@@ -1175,45 +4720,388 @@ PieceChainIterator_t* piece_chain_iter_clone(PieceChainIterator_t* other) {
     }
 
     memcpy(it, other, sizeof(*it));
+    window_hold(it->held_block, it->held); // Already mapped, so this cannot fail
     return it;
 }
 
+static bool iter_hold(PieceChainIterator_t* it, Block* block, const unsigned char* data) {
+    // Keep the window of the fragment returned mapped until the next call
+    if (block != NULL && block->windows != NULL && !window_acquire(block, data)) {
+        set_error(it->file, "Cannot map window", errno);
+        return false;
+    }
+    window_release(it->held_block, it->held);
+    it->held_block = block;
+    it->held = data;
+    return true;
+}
+
 bool piece_chain_iter_next(PieceChainIterator_t* it, const unsigned char** data, size_t* len) {
     
     if (it->current_off >= it->max_off) {
         return false;
     }
     
-    // Find the piece containing the first byte if this is the first call to `next`
+    // Find the piece containing the first byte if this is the first call to `next`,
+    // otherwise advance the iterator to the next piece if the current one is over
     if (it->current_piece == NULL) {
-        size_t start = it->current_off;
-        size_t off = 0;
-        list_for_each_member(p, &it->file->pieces, Piece, list) {
-            if (off + p->size > start) {
-                size_t piece_start = off <= start ? start - off : 0;
-                it->current_piece = p;
-                *data = p->data + piece_start;
-                *len = MIN(p->size - piece_start, it->max_off - start);
-                break;
-            }
-            off += p->size;
+        if (!piece_find(it->file, it->current_off, &it->current_piece, &it->current_piece_off)) {
+            return false;
         }
+    } else if (it->current_piece_off == it->current_piece->size) {
+        it->current_piece = list_next(it->current_piece, Piece, list);
+        it->current_piece_off = 0;
+    }
 
-    } else {
+    Piece* p = it->current_piece;
+    const unsigned char* frag = p->data + it->current_piece_off;
+    size_t frag_len = window_clip(p->block, frag, MIN(p->size - it->current_piece_off, it->max_off - it->current_off));
+    if (!iter_hold(it, p->block, frag)) {
+        return false;
+    }
+    *data = frag;
+    *len = frag_len;
+    it->current_piece_off += frag_len;
+    it->current_off += frag_len;
+    return true;
 
-        // Advance the iterator
-        Piece* p = list_next(it->current_piece, Piece, list);
-        it->current_piece = p;
-        *data = p->data;
-        *len = it->current_off + p->size > it->max_off ? it->max_off - it->current_off : p->size;
-        
+}
+
+bool piece_chain_iter_prev(PieceChainIterator_t* it, const unsigned char** data, size_t* len) {
+
+    if (it->current_off >= it->max_off) {
+        return false;
     }
-    
-    it->current_off += *len;
+
+    // Find the piece containing the last byte if this is the first call to `prev`
+    if (it->back_piece == NULL) {
+        size_t piece_offset;
+        if (!piece_find(it->file, it->max_off - 1, &it->back_piece, &piece_offset)) {
+            return false;
+        }
+        it->back_piece_off = piece_offset + 1;
+    } else if (it->back_piece_off == 0) {
+        it->back_piece = list_prev(it->back_piece, Piece, list);
+        it->back_piece_off = it->back_piece->size;
+    }
+
+    Piece* p = it->back_piece;
+    const unsigned char* frag_end = p->data + it->back_piece_off;
+    size_t frag_len = window_clip_back(p->block, frag_end, MIN(it->back_piece_off, it->max_off - it->current_off));
+    if (!iter_hold(it, p->block, frag_end - frag_len)) {
+        return false;
+    }
+    *data = frag_end - frag_len;
+    *len = frag_len;
+    it->back_piece_off -= frag_len;
+    it->max_off -= frag_len;
     return true;
 
 }
 
 void piece_chain_iter_free(PieceChainIterator_t* it) {
+    if (it == NULL) {
+        return;
+    }
+    window_release(it->held_block, it->held);
     free(it);
-}
\ No newline at end of file
+}
+PieceChainSnapshot_t* piece_chain_snapshot(PieceChain_t* file) {
+
+    // Pieces and blocks are immutable, with the exception of the cached piece, which is modified in place:
+    // after invalidating the cache, capturing the list of active pieces is enough to freeze the contents.
+    cache_put(file, NULL);
+
+    PieceChainSnapshot_t* snap = malloc(sizeof(PieceChainSnapshot_t));
+    if (snap == NULL) {
+        set_error(file, "Out of memory", ENOMEM);
+        return NULL;
+    }
+    atomic_init(&snap->refs, 1);
+    snap->size = file->size;
+    snap->count = file->index != NULL ? file->index->subtree_count : 0;
+    snap->block_count = file->shared_count;
+    list_for_each(pos, &file->all_blocks) {
+        snap->block_count++;
+    }
+    snap->pieces = malloc(sizeof(SnapshotPiece) * MAX(snap->count, (size_t) 1));
+    snap->blocks = malloc(sizeof(Block*) * MAX(snap->block_count, (size_t) 1));
+    if (snap->pieces == NULL || snap->blocks == NULL) {
+        set_error(file, "Out of memory", ENOMEM);
+        free(snap->pieces);
+        free(snap->blocks);
+        free(snap);
+        return NULL;
+    }
+
+    size_t i = 0;
+    size_t offset = 0;
+    list_for_each_member(p, &file->pieces, Piece, list) {
+        snap->pieces[i].data = p->data;
+        snap->pieces[i].size = p->size;
+        snap->pieces[i].offset = offset;
+        snap->pieces[i].block = p->block;
+        offset += p->size;
+        i++;
+    }
+    assert(i == snap->count);
+
+    // Rather than finding the blocks actually used by the pieces, just keep all of them
+    i = 0;
+    list_for_each_member(b, &file->all_blocks, Block, list) {
+        atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
+        snap->blocks[i++] = b;
+    }
+    for (size_t j = 0; j < file->shared_count; ++j) {
+        atomic_fetch_add_explicit(&file->shared[j]->refs, 1, memory_order_relaxed);
+        snap->blocks[i++] = file->shared[j];
+    }
+
+    return snap;
+}
+
+PieceChainSnapshot_t* piece_chain_snapshot_ref(PieceChainSnapshot_t* snap) {
+    atomic_fetch_add_explicit(&snap->refs, 1, memory_order_relaxed);
+    return snap;
+}
+
+void piece_chain_snapshot_unref(PieceChainSnapshot_t* snap) {
+    if (snap == NULL || atomic_fetch_sub_explicit(&snap->refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    for (size_t i = 0; i < snap->block_count; ++i) {
+        block_unref(snap->blocks[i]);
+    }
+    free(snap->pieces);
+    free(snap->blocks);
+    free(snap);
+}
+
+size_t piece_chain_snapshot_size(const PieceChainSnapshot_t* snap) {
+    return snap->size;
+}
+
+static size_t snapshot_find(const PieceChainSnapshot_t* snap, size_t abs) {
+
+    // Binary search of the last piece starting at or before `abs`
+    size_t lo = 0;
+    size_t hi = snap->count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (snap->pieces[mid].offset <= abs) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+bool piece_chain_snapshot_read_byte(const PieceChainSnapshot_t* snap, size_t offset, unsigned char* out) {
+    if (offset >= snap->size) {
+        return false;
+    }
+    const SnapshotPiece* p = &snap->pieces[snapshot_find(snap, offset)];
+    const unsigned char* data = p->data + (offset - p->offset);
+    if (!window_acquire(p->block, data)) {
+        return false;
+    }
+    *out = *data;
+    window_release(p->block, data);
+    return true;
+}
+
+bool piece_chain_snapshot_visit(const PieceChainSnapshot_t* snap, size_t start, size_t len, bool (*visitor)(const PieceChainSnapshot_t*, size_t offset, const unsigned char* data, size_t len, void* user), void* user) {
+    if (start >= snap->size || len == 0) {
+        return true;
+    }
+
+    size_t i = snapshot_find(snap, start);
+    size_t off = start;
+    size_t end = start + MIN(len, snap->size - start);
+    while (off < end) {
+        const SnapshotPiece* p = &snap->pieces[i];
+        const unsigned char* frag = p->data + (off - p->offset);
+        size_t frag_len = window_clip(p->block, frag, MIN(p->offset + p->size - off, end - off));
+        if (!window_acquire(p->block, frag)) {
+            return false;
+        }
+        bool more = visitor(snap, off, frag, frag_len, user);
+        window_release(p->block, frag);
+        if (!more) {
+            return false;
+        }
+        off += frag_len;
+        if (off == p->offset + p->size) {
+            i++;
+        }
+    }
+
+    return true;
+}
+
+static bool snapshot_copy(const PieceChainSnapshot_t* snap, size_t offset, unsigned char* dst, size_t len) {
+    size_t i = snapshot_find(snap, offset);
+    while (len > 0) {
+        const SnapshotPiece* p = &snap->pieces[i++];
+        size_t n = MIN(p->offset + p->size - offset, len);
+        if (!window_copy(p->block, dst, p->data + (offset - p->offset), n)) {
+            return false;
+        }
+        dst += n;
+        offset += n;
+        len -= n;
+    }
+    return true;
+}
+
+static int diff_compare(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t) (*(const SnapshotPiece* const*) a)->data;
+    uintptr_t y = (uintptr_t) (*(const SnapshotPiece* const*) b)->data;
+    return x < y ? -1 : x > y;
+}
+
+static size_t diff_lookup(const PieceChainSnapshot_t* snap, const SnapshotPiece** sorted, const unsigned char* data, size_t* len) {
+
+    // Binary search of the last piece starting at or before `data` in memory,
+    // then check that `data` actually falls inside of it.
+    // `*len` is clipped to the bytes after `data` which are found (or not) in the same way.
+    size_t lo = 0;
+    size_t hi = snap->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((uintptr_t) sorted[mid]->data <= (uintptr_t) data) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0 || (uintptr_t) data - (uintptr_t) sorted[lo - 1]->data >= sorted[lo - 1]->size) {
+        if (lo < snap->count) {
+            *len = MIN(*len, (size_t) ((uintptr_t) sorted[lo]->data - (uintptr_t) data));
+        }
+        return SIZE_MAX;
+    }
+    size_t skip = (size_t) (data - sorted[lo - 1]->data);
+    *len = MIN(*len, sorted[lo - 1]->size - skip);
+    return sorted[lo - 1]->offset + skip;
+}
+
+static bool diff_trim(const PieceChainSnapshot_t* a, size_t* a_offset, size_t* a_len, const PieceChainSnapshot_t* b, size_t* b_offset, size_t* b_len) {
+
+    // Different pieces can still hold the same bytes (think of a word deleted and typed again):
+    // shrink the range to the bytes that actually differ, comparing a chunk at a time from both ends
+    unsigned char x[DIFF_CHUNK];
+    unsigned char y[DIFF_CHUNK];
+    while (*a_len > 0 && *b_len > 0) {
+        size_t n = MIN(MIN(*a_len, *b_len), (size_t) DIFF_CHUNK);
+        if (!snapshot_copy(a, *a_offset, x, n) || !snapshot_copy(b, *b_offset, y, n)) {
+            return false;
+        }
+        size_t k = 0;
+        while (k < n && x[k] == y[k]) {
+            k++;
+        }
+        *a_offset += k;
+        *b_offset += k;
+        *a_len -= k;
+        *b_len -= k;
+        if (k < n) {
+            break;
+        }
+    }
+    while (*a_len > 0 && *b_len > 0) {
+        size_t n = MIN(MIN(*a_len, *b_len), (size_t) DIFF_CHUNK);
+        if (!snapshot_copy(a, *a_offset + *a_len - n, x, n) || !snapshot_copy(b, *b_offset + *b_len - n, y, n)) {
+            return false;
+        }
+        size_t k = 0;
+        while (k < n && x[n - 1 - k] == y[n - 1 - k]) {
+            k++;
+        }
+        *a_len -= k;
+        *b_len -= k;
+        if (k < n) {
+            break;
+        }
+    }
+    return true;
+
+}
+
+bool piece_chain_snapshot_diff(const PieceChainSnapshot_t* a, const PieceChainSnapshot_t* b, bool (*visitor)(size_t a_offset, size_t a_len, size_t b_offset, size_t b_len, void* user), void* user) {
+
+    // Data never changes once written, so the same address means the same bytes:
+    // the pieces of `b` are matched to the ones of `a` by address, and only what is left unmatched is compared byte by byte.
+    // To find where the data of a piece of `b` is in `a`, the pieces of `a` are sorted by address.
+    const SnapshotPiece** sorted = malloc(sizeof(SnapshotPiece*) * MAX(a->count, (size_t) 1));
+    if (sorted == NULL) {
+        errno = ENOMEM;
+        return false;
+    }
+    for (size_t i = 0; i < a->count; ++i) {
+        sorted[i] = &a->pieces[i];
+    }
+    qsort(sorted, a->count, sizeof(SnapshotPiece*), diff_compare);
+
+    #define DIFF_EMIT(a_start, a_end, b_start, b_end) do { \
+        size_t ao = (a_start), al = (a_end) - ao, bo = (b_start), bl = (b_end) - bo; \
+        if (!diff_trim(a, &ao, &al, b, &bo, &bl) || ((al > 0 || bl > 0) && !visitor(ao, al, bo, bl, user))) { \
+            free(sorted); \
+            return false; \
+        } \
+    } while (false)
+
+    size_t ia = 0;
+    size_t a_off = 0;
+    size_t ib = 0;
+    size_t b_off = 0;
+    size_t a_pending = 0; // Start of the data of `a` not matched yet
+    size_t b_pending = 0;
+    while (b_off < b->size) {
+        const SnapshotPiece* pb = &b->pieces[ib];
+        const unsigned char* data = pb->data + (b_off - pb->offset);
+        size_t n = pb->offset + pb->size - b_off;
+
+        // Most of the times the two snapshots just go on with the same data.
+        // Otherwise, the data of `b` is either somewhere after in `a`, or it has been inserted.
+        if (a_off == a->size || a->pieces[ia].data + (a_off - a->pieces[ia].offset) != data) {
+            size_t found = diff_lookup(a, sorted, data, &n);
+            if (found == SIZE_MAX || found < a_off) {
+                b_off += n;
+                if (b_off == pb->offset + pb->size) {
+                    ib++;
+                }
+                continue;
+            }
+            a_off = found;
+            ia = snapshot_find(a, a_off);
+        }
+        if (a_pending < a_off || b_pending < b_off) {
+            DIFF_EMIT(a_pending, a_off, b_pending, b_off);
+        }
+
+        // Skip the data shared by the two snapshots
+        const SnapshotPiece* pa = &a->pieces[ia];
+        n = MIN(n, pa->offset + pa->size - a_off);
+        a_off += n;
+        b_off += n;
+        a_pending = a_off;
+        b_pending = b_off;
+        if (a_off == pa->offset + pa->size) {
+            ia++;
+        }
+        if (b_off == pb->offset + pb->size) {
+            ib++;
+        }
+    }
+    if (a_pending < a->size || b_pending < b->size) {
+        DIFF_EMIT(a_pending, a->size, b_pending, b->size);
+    }
+
+    #undef DIFF_EMIT
+
+    free(sorted);
+    return true;
+
+}
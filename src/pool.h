@@ -0,0 +1,208 @@
+/*
+ * This is a simple slab allocator for small objects of fixed size.
+ * Objects are carved out of big aligned slabs, so that allocation is just a pointer bump
+ * (or a pop from the free list of a slab), and a whole pool can be released at once.
+ * The first slabs of a pool are small and double in size up to POOL_SLAB_SIZE,
+ * so that pools holding just a handful of objects stay small too.
+ */
+
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "list.h"
+#include "util.h"
+
+#define POOL_SLAB_SIZE ((size_t) (64 * 1024)) /* 64KiB */
+#define POOL_SLAB_MIN_SIZE ((size_t) 1024) /* 1KiB */
+#define POOL_SMALL_SLABS 6 // Number of slab sizes smaller than POOL_SLAB_SIZE
+#define POOL_ALIGN(n) (((n) + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1))
+
+struct pool_slab {
+    struct list_head list;
+    void* free; // Objects of this slab freed and available for reuse
+    size_t size; // Size of the slab in bytes
+    size_t capacity; // Number of objects in the slab
+    size_t used; // Number of objects in use
+    size_t bump; // Number of objects ever handed out from the slab
+};
+
+struct pool {
+    size_t object_size;
+    size_t next_size; // Size of the next slab to allocate
+    size_t count; // Number of objects in use in the whole pool
+    struct list_head slabs; // Slabs with free objects come first, full ones come last
+    struct pool_slab* small[POOL_SMALL_SLABS]; // Slabs smaller than POOL_SLAB_SIZE, which are not aligned to it
+};
+
+/**
+ * Initializes a new pool of objects of the given size.
+ */
+static inline void pool_init(struct pool* pool, size_t object_size) {
+    pool->object_size = POOL_ALIGN(MAX(object_size, sizeof(void*)));
+    pool->next_size = POOL_SLAB_MIN_SIZE;
+    while (pool->next_size < POOL_SLAB_SIZE && pool->next_size - POOL_ALIGN(sizeof(struct pool_slab)) < 8 * pool->object_size) {
+        pool->next_size *= 2;
+    }
+    pool->count = 0;
+    list_init(&pool->slabs);
+    for (size_t i = 0; i < POOL_SMALL_SLABS; ++i) {
+        pool->small[i] = NULL;
+    }
+}
+
+static inline bool pool_slab_full(struct pool_slab* slab) {
+    return slab->used == slab->capacity;
+}
+
+static inline struct pool_slab* pool_slab_new(struct pool* pool) {
+
+    // Only full size slabs have to be aligned, so that objects can find their slab by masking their address
+    size_t size = pool->next_size;
+    struct pool_slab* slab;
+    if (size < POOL_SLAB_SIZE) {
+        size_t i = 0;
+        while (pool->small[i] != NULL) {
+            i++;
+        }
+        slab = malloc(size);
+        if (slab == NULL) {
+            return NULL;
+        }
+        pool->small[i] = slab;
+    } else {
+        slab = aligned_alloc(POOL_SLAB_SIZE, POOL_SLAB_SIZE);
+        if (slab == NULL) {
+            return NULL;
+        }
+    }
+    pool->next_size = MIN(size * 2, POOL_SLAB_SIZE);
+
+    slab->free = NULL;
+    slab->size = size;
+    slab->capacity = (size - POOL_ALIGN(sizeof(struct pool_slab))) / pool->object_size;
+    slab->used = 0;
+    slab->bump = 0;
+    return slab;
+}
+
+static inline struct pool_slab* pool_slab_find(struct pool* pool, void* obj) {
+
+    // There are at most a few small slabs, and they are checked one by one
+    for (size_t i = 0; i < POOL_SMALL_SLABS; ++i) {
+        struct pool_slab* slab = pool->small[i];
+        if (slab != NULL && (char*) obj >= (char*) slab && (char*) obj < (char*) slab + slab->size) {
+            return slab;
+        }
+    }
+    return (struct pool_slab*) ((uintptr_t) obj & ~(uintptr_t) (POOL_SLAB_SIZE - 1));
+}
+
+static inline void pool_slab_free(struct pool* pool, struct pool_slab* slab) {
+    for (size_t i = 0; i < POOL_SMALL_SLABS; ++i) {
+        if (pool->small[i] == slab) {
+            pool->small[i] = NULL;
+        }
+    }
+    free(slab);
+}
+
+/**
+ * Allocates a new object from the pool. Returns NULL if memory is exhausted.
+ */
+static inline void* pool_alloc(struct pool* pool) {
+
+    // The first slab is the only one we have to look at: if it is full, all the others are too
+    struct pool_slab* slab = list_first(&pool->slabs, struct pool_slab, list);
+    if (slab == NULL || pool_slab_full(slab)) {
+        slab = pool_slab_new(pool);
+        if (slab == NULL) {
+            return NULL;
+        }
+        list_add(&pool->slabs, &slab->list);
+    }
+
+    void* obj;
+    if (slab->free != NULL) {
+        obj = slab->free;
+        slab->free = *(void**) obj;
+    } else {
+        obj = (char*) slab + POOL_ALIGN(sizeof(struct pool_slab)) + slab->bump * pool->object_size;
+        slab->bump++;
+    }
+    slab->used++;
+    pool->count++;
+
+    // Keep full slabs at the end of the list
+    if (pool_slab_full(slab)) {
+        list_del(&slab->list);
+        list_add_tail(&pool->slabs, &slab->list);
+    }
+
+    return obj;
+}
+
+/**
+ * Returns an object to the pool it has been allocated from.
+ * Slabs left empty are released, unless they are the last one of the pool.
+ */
+static inline void pool_free(struct pool* pool, void* obj) {
+    struct pool_slab* slab = pool_slab_find(pool, obj);
+    bool was_full = pool_slab_full(slab);
+
+    *(void**) obj = slab->free;
+    slab->free = obj;
+    slab->used--;
+    pool->count--;
+
+    if (slab->used == 0 && pool->slabs.next->next != &pool->slabs) {
+        list_del(&slab->list);
+        pool_slab_free(pool, slab);
+    } else if (was_full) {
+        list_del(&slab->list);
+        list_add(&pool->slabs, &slab->list);
+    }
+}
+
+/**
+ * Returns the number of bytes of memory held by the slabs of a pool.
+ */
+static inline size_t pool_size(struct pool* pool) {
+    size_t n = 0;
+    list_for_each_member(slab, &pool->slabs, struct pool_slab, list) {
+        n += slab->size;
+    }
+    return n;
+}
+
+/**
+ * Moves a pool to a new location, leaving `src` unusable until initialized again.
+ */
+static inline void pool_move(struct pool* dst, struct pool* src) {
+    *dst = *src;
+    if (list_empty(&src->slabs)) {
+        list_init(&dst->slabs);
+    } else {
+        dst->slabs.next->prev = &dst->slabs;
+        dst->slabs.prev->next = &dst->slabs;
+    }
+}
+
+/**
+ * Releases all the slabs of a pool, and with them all the objects allocated from it.
+ */
+static inline void pool_destroy(struct pool* pool) {
+    list_for_each(pos, &pool->slabs) {
+        list_del(pos);
+        free(container_of(pos, struct pool_slab, list));
+    }
+    for (size_t i = 0; i < POOL_SMALL_SLABS; ++i) {
+        pool->small[i] = NULL;
+    }
+    pool->count = 0;
+}
+
+#endif
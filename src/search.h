@@ -0,0 +1,180 @@
+/*
+ * Search and counting of byte patterns inside a contiguous buffer.
+ * Candidates are found by comparing both the first and the last byte of the pattern
+ * 32 positions at a time with AVX2, when the CPU supports it, and only then the whole pattern is checked.
+ * Without AVX2, the search falls back to the (already vectorized) routines of the C library.
+ */
+
+#ifndef __SEARCH_H__
+#define __SEARCH_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define SEARCH_HAVE_AVX2
+#endif
+
+static inline bool search_match(const unsigned char* hay, const unsigned char* pat, size_t plen) {
+    return plen <= 2 || memcmp(hay + 1, pat + 1, plen - 2) == 0;
+}
+
+#ifdef SEARCH_HAVE_AVX2
+
+__attribute__((target("avx2")))
+static inline const unsigned char* search_forward_avx2(const unsigned char* hay, size_t hlen, const unsigned char* pat, size_t plen) {
+    const __m256i first = _mm256_set1_epi8((char) pat[0]);
+    const __m256i last = _mm256_set1_epi8((char) pat[plen - 1]);
+    size_t i = 0;
+    for (; i + plen - 1 + 32 <= hlen; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*) (hay + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*) (hay + i + plen - 1));
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            size_t bit = (size_t) __builtin_ctz(mask);
+            if (search_match(hay + i + bit, pat, plen)) {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    for (; i + plen <= hlen; ++i) {
+        if (hay[i] == pat[0] && hay[i + plen - 1] == pat[plen - 1] && search_match(hay + i, pat, plen)) {
+            return hay + i;
+        }
+    }
+    return NULL;
+}
+
+__attribute__((target("avx2")))
+static inline const unsigned char* search_backward_avx2(const unsigned char* hay, size_t hlen, const unsigned char* pat, size_t plen) {
+    const __m256i first = _mm256_set1_epi8((char) pat[0]);
+    const __m256i last = _mm256_set1_epi8((char) pat[plen - 1]);
+
+    // Number of candidate positions still to check, from the end
+    size_t n = hlen - plen + 1;
+    for (; n >= 32; n -= 32) {
+        size_t i = n - 32;
+        __m256i a = _mm256_loadu_si256((const __m256i*) (hay + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*) (hay + i + plen - 1));
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            size_t bit = 31 - (size_t) __builtin_clz(mask);
+            if (search_match(hay + i + bit, pat, plen)) {
+                return hay + i + bit;
+            }
+            mask &= ~(1u << bit);
+        }
+    }
+    while (n-- > 0) {
+        if (hay[n] == pat[0] && hay[n + plen - 1] == pat[plen - 1] && search_match(hay + n, pat, plen)) {
+            return hay + n;
+        }
+    }
+    return NULL;
+}
+
+__attribute__((target("avx2,popcnt")))
+static inline size_t search_count_avx2(const unsigned char* hay, size_t hlen, unsigned char c) {
+    const __m256i needle = _mm256_set1_epi8((char) c);
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 32 <= hlen; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*) (hay + i));
+        count += (size_t) __builtin_popcount((unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, needle)));
+    }
+    for (; i < hlen; ++i) {
+        count += hay[i] == c;
+    }
+    return count;
+}
+
+static inline bool search_avx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+/**
+ * Returns a pointer to the first occurrence of `pat` in `hay`, or NULL if there is none.
+ * The pattern must not be empty.
+ */
+static inline const unsigned char* search_forward(const unsigned char* hay, size_t hlen, const unsigned char* pat, size_t plen) {
+    if (plen > hlen) {
+        return NULL;
+    }
+    if (plen == 1) {
+        return memchr(hay, pat[0], hlen);
+    }
+#ifdef SEARCH_HAVE_AVX2
+    if (search_avx2()) {
+        return search_forward_avx2(hay, hlen, pat, plen);
+    }
+#endif
+    return memmem(hay, hlen, pat, plen);
+}
+
+/**
+ * Returns a pointer to the last occurrence of `pat` in `hay`, or NULL if there is none.
+ * The pattern must not be empty.
+ */
+static inline const unsigned char* search_backward(const unsigned char* hay, size_t hlen, const unsigned char* pat, size_t plen) {
+    if (plen > hlen) {
+        return NULL;
+    }
+    if (plen == 1) {
+        return memrchr(hay, pat[0], hlen);
+    }
+#ifdef SEARCH_HAVE_AVX2
+    if (search_avx2()) {
+        return search_backward_avx2(hay, hlen, pat, plen);
+    }
+#endif
+    size_t n = hlen - plen + 1;
+    const unsigned char* p;
+    while (n > 0 && (p = memrchr(hay, pat[0], n)) != NULL) {
+        if (memcmp(p, pat, plen) == 0) {
+            return p;
+        }
+        n = p - hay;
+    }
+    return NULL;
+}
+
+/** Counts the occurrences of the byte `c` in `hay`. */
+static inline size_t search_count(const unsigned char* hay, size_t hlen, unsigned char c) {
+#ifdef SEARCH_HAVE_AVX2
+    if (search_avx2()) {
+        return search_count_avx2(hay, hlen, c);
+    }
+#endif
+    size_t count = 0;
+    for (size_t i = 0; i < hlen; ++i) {
+        count += hay[i] == c;
+    }
+    return count;
+}
+
+/**
+ * Returns a pointer to the `n`-th occurrence (starting from 1) of the byte `c` in `hay`,
+ * or NULL if there are less than `n` occurrences.
+ */
+static inline const unsigned char* search_nth(const unsigned char* hay, size_t hlen, unsigned char c, size_t n) {
+    const unsigned char* end = hay + hlen;
+    const unsigned char* p = hay;
+    while (n > 0 && p < end) {
+        const unsigned char* m = memchr(p, c, end - p);
+        if (m == NULL) {
+            return NULL;
+        }
+        if (--n == 0) {
+            return m;
+        }
+        p = m + 1;
+    }
+    return NULL;
+}
+
+#endif
@@ -1,5 +1,15 @@
 #include <iostream>
 #include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <random>
+#include <map>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
 #include <catch2/catch.hpp>
 #include <PieceChain/PieceChain.hpp>
 
@@ -67,6 +77,138 @@ TEST_CASE("Insert and delete", "[edits]") {
     REQUIRE(chain_equals("hello world", chain));
 }
 
+static PieceChainEdit make_edit(size_t offset, size_t delete_len, const char* data) {
+    return PieceChainEdit { offset, delete_len, (const unsigned char*) data, strlen(data) };
+}
+
+TEST_CASE("Batch of edits", "[edits]") {
+    PieceChain chain;
+    chain.insert(0, "hello world", 11);
+    chain.commit();
+
+    // Edits are given out of order and refer to the original offsets
+    chain.apply({
+        make_edit(6, 5, "there"),
+        make_edit(0, 0, "<"),
+        make_edit(11, 0, ">"),
+        make_edit(5, 1, ", "),
+        make_edit(0, 1, "H")
+    });
+    REQUIRE(chain_equals("<Hello, there>", chain));
+
+    // The batch is undone as a whole
+    REQUIRE(chain.undo());
+    REQUIRE(chain_equals("hello world", chain));
+    REQUIRE(chain.redo());
+    REQUIRE(chain_equals("<Hello, there>", chain));
+
+    // Overlapping ranges are rejected
+    REQUIRE_THROWS_AS(chain.apply({ make_edit(0, 5, "a"), make_edit(3, 1, "b") }), PieceChainException);
+    REQUIRE(chain_equals("<Hello, there>", chain));
+
+    // Edits that change nothing do not touch the chain
+    chain.save("test16.txt");
+    uint64_t revision = chain.revision();
+    size_t pieces = chain.stats().pieces;
+    chain.apply({ make_edit(2, 0, ""), make_edit(14, 0, "") });
+    REQUIRE(chain.revision() == revision);
+    REQUIRE(chain.stats().pieces == pieces);
+    REQUIRE_FALSE(chain.dirty());
+    REQUIRE(chain.undo());
+    REQUIRE(chain_equals("hello world", chain));
+}
+
+TEST_CASE("Random batches of edits", "[edits]") {
+    PieceChain chain;
+    string expected;
+    vector<string> history = { "" };
+    mt19937 rng(1234);
+    vector<string> buffers;
+
+    for (int round = 0; round < 200; ++round) {
+        // Generate non overlapping edits in increasing order, then shuffle them
+        vector<PieceChainEdit> edits;
+        buffers.clear();
+        buffers.reserve(16);
+        size_t pos = 0;
+        for (int i = 0; i < 8 && pos <= expected.size(); ++i) {
+            size_t offset = pos + rng() % (expected.size() - pos + 1) / 2;
+            size_t del = expected.empty() ? 0 : rng() % 5;
+            del = min(del, expected.size() - offset);
+            buffers.push_back(string(rng() % 6, (char) ('a' + rng() % 26)));
+            edits.push_back(PieceChainEdit { offset, del, (const unsigned char*) buffers.back().data(), buffers.back().size() });
+            pos = offset + del + 1;
+        }
+        string next = expected;
+        for (auto it = edits.rbegin(); it != edits.rend(); ++it) {
+            next.replace(it->offset, it->delete_len, (const char*) it->data, it->len);
+        }
+        shuffle(edits.begin(), edits.end(), rng);
+
+        chain.apply(edits);
+        expected = next;
+        if (any_of(edits.begin(), edits.end(), [](auto& e) { return e.delete_len > 0 || e.len > 0; })) {
+            history.push_back(expected);
+        }
+        REQUIRE(chain_equals(expected, chain));
+    }
+
+    for (size_t i = history.size() - 1; i > 0; --i) {
+        REQUIRE(chain.undo());
+        REQUIRE(chain_equals(history[i - 1], chain));
+    }
+}
+
+TEST_CASE("Overwrite", "[edits]") {
+    PieceChain chain;
+    string expected(64, '0');
+    chain.insert(0, expected);
+    chain.commit();
+
+    // Sequential overwrites, like typing in a hex editor
+    for (size_t i = 10; i < 40; ++i) {
+        chain.replace(i, "f", 1);
+        expected[i] = 'f';
+        REQUIRE(chain_equals(expected, chain));
+    }
+
+    // Overwrites inside data just written, and past the end
+    chain.replace(12, "abc", 3);
+    expected.replace(12, 3, "abc");
+    chain.replace(62, "xyz", 3);
+    expected.replace(62, 2, "xyz");
+    REQUIRE(chain_equals(expected, chain));
+
+    // Everything has been done in a single revision
+    size_t pos = *chain.undo();
+    REQUIRE(pos == 10);
+    REQUIRE(chain_equals(string(64, '0'), chain));
+    chain.redo();
+    REQUIRE(chain_equals(expected, chain));
+
+    // Overwriting a whole piece does not leave an empty one behind
+    PieceChain tail;
+    tail.insert(0, string(10, '0'));
+    tail.commit();
+    bool trailing = GENERATE(false, true);
+    if (trailing) {
+        tail.insert(10, "zz", 2);
+        tail.commit();
+    }
+    for (size_t i = 2; i < 10; ++i) {
+        tail.replace(i, "a", 1);
+    }
+    string overwritten = trailing ? "00aaaaaaaazz" : "00aaaaaaaa";
+    REQUIRE(chain_equals(overwritten, tail));
+    REQUIRE(tail.stats().pieces == (trailing ? 3 : 2));
+    REQUIRE(tail.at(overwritten.size() - 1) == overwritten.back());
+    tail.commit();
+    tail.undo();
+    REQUIRE(chain_equals(trailing ? "0000000000zz" : "0000000000", tail));
+    tail.redo();
+    REQUIRE(chain_equals(overwritten, tail));
+}
+
 TEST_CASE("Undo", "[undo]") {
     PieceChain chain;
     chain.insert(0, "hello", 5);
@@ -193,6 +335,570 @@ TEST_CASE("Undo and redo with insertions inbetween", "[undo]") {
 
 }
 
+TEST_CASE("Random edits are indexed correctly", "[edits]") {
+    PieceChain chain;
+    string expected;
+    vector<string> history;
+    mt19937 rng(42);
+
+    // Interleave scattered insertions and deletions, committing every few edits
+    for (int i = 0; i < 2000; ++i) {
+        if (rng() % 3 != 0 || expected.empty()) {
+            size_t offset = rng() % (expected.size() + 1);
+            string data(1 + rng() % 8, (char) ('a' + rng() % 26));
+            chain.insert(offset, data);
+            expected.insert(offset, data);
+        } else {
+            size_t offset = rng() % expected.size();
+            size_t len = 1 + rng() % 8;
+            chain.remove(offset, len);
+            expected.erase(offset, len);
+        }
+        if (i % 7 == 0) {
+            chain.commit();
+            history.push_back(expected);
+        }
+    }
+    chain.commit();
+    history.push_back(expected);
+
+    REQUIRE(chain.size() == expected.size());
+    REQUIRE(chain_equals(expected, chain));
+    for (size_t i = 0; i < expected.size(); i += 37) {
+        REQUIRE(chain[i] == (unsigned char) expected[i]);
+        REQUIRE(chain_equals(expected.substr(i, 50), chain, i, 50));
+    }
+
+    // Walk the whole history back and forth
+    for (size_t i = history.size() - 1; i > 0; --i) {
+        REQUIRE(chain.undo());
+        REQUIRE(chain_equals(history[i - 1], chain));
+    }
+    for (size_t i = 1; i < history.size(); ++i) {
+        REQUIRE(chain.redo());
+        REQUIRE(chain_equals(history[i], chain));
+    }
+}
+
+TEST_CASE("Clustered edits", "[edits]") {
+    PieceChain chain;
+    string expected(1000, '.');
+    chain.insert(0, expected);
+    chain.commit();
+
+    // Type and backspace around a few locations, committing every edit so that the cache does not kick in
+    for (size_t base : { 500, 10, 990, 499 }) {
+        for (size_t i = 0; i < 20; ++i) {
+            chain.insert(base + i, "x", 1);
+            expected.insert(base + i, "x");
+            chain.commit();
+        }
+        for (size_t i = 0; i < 5; ++i) {
+            chain.remove(base + 19 - i, 1);
+            expected.erase(base + 19 - i, 1);
+            chain.commit();
+        }
+        REQUIRE(chain[base] == 'x');
+        REQUIRE(chain[base - 1] == expected[base - 1]);
+    }
+    REQUIRE(chain_equals(expected, chain));
+
+    while (chain.undo());
+    REQUIRE(chain_equals("", chain));
+}
+
+TEST_CASE("Discarding redo history releases pieces", "[undo]") {
+    PieceChain chain;
+    string expected;
+
+    // Build a long history, then repeatedly undo half of it and replace it with new edits,
+    // so that lots of pieces and revisions are released and reallocated
+    for (int round = 0; round < 4; ++round) {
+        for (int i = 0; i < 3000; ++i) {
+            chain.insert(expected.size() / 2, "ab", 2);
+            expected.insert(expected.size() / 2, "ab");
+            chain.commit();
+        }
+        for (int i = 0; i < 1500; ++i) {
+            REQUIRE(chain.undo());
+        }
+        chain.commit();
+        ostringstream ss;
+        ss << chain;
+        expected = ss.str();
+        REQUIRE(expected.size() == (size_t) (round + 1) * 3000);
+    }
+    chain.insert(0, "end", 3);
+    REQUIRE_FALSE(chain.redo());
+    REQUIRE(chain_equals("end" + expected, chain));
+}
+
+TEST_CASE("Unreferenced blocks are released", "[undo]") {
+    PieceChainOptions options = {};
+    options.initial_block_size = 4096;
+    options.max_block_size = 4096;
+    PieceChain chain(options);
+    chain.insert(0, "base", 4);
+    chain.commit();
+
+    // Type a lot of data and undo it, over and over:
+    // once redo history is discarded, its blocks are either recycled or freed
+    size_t peak = 0;
+    for (int round = 0; round < 50; ++round) {
+        for (int i = 0; i < 20; ++i) {
+            string data(1000, (char) ('a' + round % 26));
+            chain.insert(chain.size(), data);
+            chain.commit();
+        }
+        for (int i = 0; i < 20; ++i) {
+            REQUIRE(chain.undo());
+        }
+        auto stats = chain.stats();
+        peak = max(peak, stats.heap_bytes + stats.free_bytes);
+    }
+    REQUIRE(peak < 10 * 4096);
+    chain.insert(0, "x", 1);
+    REQUIRE(chain_equals("xbase", chain));
+
+    auto stats = chain.stats();
+    REQUIRE(stats.free_bytes > 0);
+    REQUIRE(stats.free_bytes <= 4 * 4096);
+}
+
+TEST_CASE("Revisions", "[undo]") {
+    SECTION("Linear history") {
+        PieceChain chain;
+        vector<uint64_t> ids { chain.revision() };
+        for (int i = 0; i < 1000; ++i) {
+            chain.insert(chain.size() / 2, to_string(i));
+            chain.commit();
+            REQUIRE(chain.revision() > ids.back());
+            REQUIRE(chain.revision_parent(chain.revision()) == ids.back());
+            ids.push_back(chain.revision());
+        }
+        ostringstream last;
+        last << chain;
+
+        // Jump back and forth without going through every revision one at a time
+        REQUIRE(chain.goto_revision(ids[0]));
+        REQUIRE(chain.empty());
+        REQUIRE(chain.goto_revision(ids[1]) == 0u);
+        REQUIRE(chain_equals("0", chain));
+        REQUIRE(chain.redo());
+        REQUIRE(chain_equals("10", chain));
+        REQUIRE(chain.goto_revision(ids.back()));
+        REQUIRE(chain_equals(last.str(), chain));
+        REQUIRE_FALSE(chain.goto_revision(ids.back()));
+        REQUIRE_THROWS_AS(chain.goto_revision(ids.back() + 1), PieceChainException);
+
+        // A new edit after an undo discards the redo history
+        chain.goto_revision(ids[500]);
+        chain.insert(0, "x");
+        chain.commit();
+        REQUIRE_THROWS_AS(chain.goto_revision(ids[501]), PieceChainException);
+        REQUIRE(chain.revision_parent(chain.revision()) == ids[500]);
+    }
+
+    SECTION("Undo tree") {
+        PieceChainOptions options = {};
+        options.undo_tree = true;
+        PieceChain chain(options);
+        chain.insert(0, "a");
+        chain.commit();
+        uint64_t a = chain.revision();
+        chain.insert(1, "b");
+        chain.commit();
+        uint64_t ab = chain.revision();
+        chain.undo();
+        chain.insert(1, "c");
+        chain.commit();
+        uint64_t ac = chain.revision();
+        REQUIRE(chain.revision_parent(ab) == a);
+        REQUIRE(chain.revision_parent(ac) == a);
+
+        chain.goto_revision(ab);
+        REQUIRE(chain_equals("ab", chain));
+        REQUIRE(chain.undo());
+        REQUIRE(chain.redo());
+        REQUIRE(chain_equals("ab", chain));
+        chain.goto_revision(ac);
+        REQUIRE(chain_equals("ac", chain));
+
+        // Compaction keeps every branch: without children, the merges go in the current revision
+        chain.compact();
+        REQUIRE(chain.revision() == ac);
+        chain.goto_revision(ab);
+        REQUIRE(chain_equals("ab", chain));
+        chain.insert(0, "x");
+        chain.commit();
+        chain.insert(3, "y");
+        chain.commit();
+        uint64_t xaby = chain.revision();
+
+        // Otherwise they go in a new child revision, so that the children still find their pieces
+        chain.undo();
+        chain.undo();
+        chain.compact();
+        uint64_t compacted = chain.revision();
+        REQUIRE(compacted != ab);
+        REQUIRE(chain.revision_parent(compacted) == ab);
+        REQUIRE(chain.stats().pieces == 1);
+        REQUIRE(chain_equals("ab", chain));
+        chain.goto_revision(xaby);
+        REQUIRE(chain_equals("xaby", chain));
+        chain.goto_revision(ac);
+        REQUIRE(chain_equals("ac", chain));
+        chain.goto_revision(compacted);
+        REQUIRE(chain.undo());
+        REQUIRE(chain.revision() == ab);
+        REQUIRE(chain_equals("ab", chain));
+        chain.goto_revision(a);
+        REQUIRE(chain_equals("a", chain));
+    }
+
+    SECTION("Random walks over the tree") {
+        PieceChainOptions options = {};
+        options.undo_tree = true;
+        options.initial_block_size = 4096;
+        options.max_block_size = 4096;
+        options.history_budget = GENERATE(0, 64 * 1024);
+        PieceChain chain(options);
+        map<uint64_t, string> contents { { chain.revision(), "" } };
+        string expected;
+        mt19937 rng(99);
+        for (int i = 0; i < 5000; ++i) {
+            switch (rng() % 5) {
+                case 0:
+                case 1: {
+                    string data(1 + rng() % 100, (char) ('a' + rng() % 26));
+                    size_t offset = rng() % (expected.size() + 1);
+                    chain.insert(offset, data);
+                    expected.insert(offset, data);
+                    if (!expected.empty() && rng() % 2 == 0) {
+                        size_t start = rng() % expected.size();
+                        size_t len = 1 + rng() % (expected.size() - start);
+                        chain.remove(start, len);
+                        expected.erase(start, len);
+                    }
+                    chain.commit();
+                    contents[chain.revision()] = expected;
+                    break;
+                }
+                case 2:
+                    if (chain.undo()) {
+                        expected = contents.at(chain.revision());
+                    }
+                    break;
+                case 3:
+                    chain.compact();
+                    contents[chain.revision()] = expected;
+                    break;
+                default: {
+                    auto it = contents.begin();
+                    advance(it, rng() % contents.size());
+                    try {
+                        chain.goto_revision(it->first);
+                        expected = it->second;
+                    } catch (const PieceChainException&) {
+                        // Dropped to stay within the budget
+                        REQUIRE(options.history_budget != 0);
+                        contents.erase(it);
+                    }
+                    break;
+                }
+            }
+            REQUIRE(chain.revision_parent(chain.revision()) != chain.revision());
+            REQUIRE(chain_equals(expected, chain));
+        }
+    }
+}
+
+static size_t count_pieces(const PieceChain& chain) {
+    size_t count = 0;
+    for (auto it = chain.begin(0, chain.size()); it != chain.end(); ++it) {
+        ++count;
+    }
+    return count;
+}
+
+TEST_CASE("Compaction", "[compact]") {
+    PieceChain chain;
+    string base;
+    for (int i = 0; i < 1000; ++i) {
+        base += to_string(i) + ",";
+    }
+    chain.insert(0, base);
+    chain.commit();
+
+    // Scatter lots of small edits, one per revision
+    string expected = base;
+    mt19937 rng(7);
+    for (int i = 0; i < 500; ++i) {
+        size_t off = rng() % (expected.size() + 1);
+        chain.insert(off, "xy", 2);
+        expected.insert(off, "xy");
+        chain.commit();
+    }
+    size_t before = count_pieces(chain);
+    REQUIRE(before > 500);
+
+    SECTION("Keeping history") {
+        chain.compact(1024);
+        REQUIRE(chain_equals(expected, chain));
+        REQUIRE(count_pieces(chain) < before / 10);
+
+        // Undo still walks back through all the edits
+        for (int i = 0; i < 500; ++i) {
+            REQUIRE(chain.undo());
+        }
+        REQUIRE(chain_equals(base, chain));
+        for (int i = 0; i < 500; ++i) {
+            REQUIRE(chain.redo());
+        }
+        REQUIRE(chain_equals(expected, chain));
+    }
+
+    SECTION("Discarding history") {
+        chain.compact(1024, true);
+        REQUIRE(chain_equals(expected, chain));
+        REQUIRE(count_pieces(chain) < before / 10);
+        REQUIRE_FALSE(chain.undo());
+    }
+
+    // Edits keep working on the compacted chain
+    const string compacted = expected;
+    chain.insert(10, "abc", 3);
+    expected.insert(10, "abc");
+    chain.remove(expected.size() - 5, 5);
+    expected.erase(expected.size() - 5, 5);
+    REQUIRE(chain_equals(expected, chain));
+    chain.compact();
+    REQUIRE(chain.undo());
+    REQUIRE(chain_equals(compacted, chain));
+}
+
+TEST_CASE("Compaction of empty chains", "[compact]") {
+    bool discard_history = GENERATE(false, true);
+
+    SECTION("Fresh chain") {
+        PieceChain chain;
+        chain.compact(0, discard_history);
+        REQUIRE(chain.empty());
+        REQUIRE_FALSE(chain.undo());
+        chain.insert(0, "abc", 3);
+        REQUIRE(chain_equals("abc", chain));
+    }
+
+    SECTION("Chain undone to its initial revision") {
+        PieceChain chain;
+        for (int i = 0; i < 10; ++i) {
+            chain.insert(chain.size(), "ab", 2);
+            chain.commit();
+        }
+        while (chain.undo());
+        REQUIRE(chain.empty());
+        chain.compact(0, discard_history);
+        REQUIRE(chain.empty());
+        REQUIRE_FALSE(chain.redo());
+        chain.insert(0, "abc", 3);
+        chain.commit();
+        REQUIRE(chain_equals("abc", chain));
+        REQUIRE(chain.undo());
+        REQUIRE(chain.empty());
+    }
+}
+
+TEST_CASE("Custom memory block sizes", "[options]") {
+    PieceChainOptions options = {};
+
+    SECTION("Tiny blocks") {
+        options.initial_block_size = 1;
+        options.max_block_size = 16;
+    }
+
+    SECTION("Anonymous mappings") {
+        options.initial_block_size = 4096;
+        options.max_block_size = 64 * 1024;
+        options.mmap_threshold = 8192;
+    }
+
+    PieceChain chain(options);
+    string expected;
+    mt19937 rng(7);
+    for (int i = 0; i < 500; ++i) {
+        size_t offset = rng() % (expected.size() + 1);
+        string data(1 + rng() % 100, (char) ('a' + rng() % 26));
+        chain.insert(offset, data);
+        expected.insert(offset, data);
+        if (i % 3 == 0) {
+            chain.commit();
+        }
+    }
+    REQUIRE(chain_equals(expected, chain));
+
+    while (chain.undo());
+    REQUIRE(chain.empty());
+}
+
+TEST_CASE("Tiny chains stay small", "[options]") {
+    PieceChain chain;
+    chain.insert(0, "hello");
+    chain.commit();
+    auto stats = chain.stats();
+    REQUIRE(stats.heap_bytes <= 4096);
+    REQUIRE(stats.bookkeeping_bytes < 3 * 4096);
+}
+
+TEST_CASE("History budget", "[options]") {
+    PieceChainOptions options = {};
+    options.initial_block_size = 4096;
+    options.max_block_size = 4096;
+
+    // Keep appending to the end and deleting from the beginning, one revision per edit,
+    // so that the contents stay small while the history keeps referencing all the data ever inserted
+    auto edit = [](PieceChain& chain, vector<string>& states) {
+        string expected;
+        for (int i = 0; i < 200; ++i) {
+            string data(1000, (char) ('a' + i % 26));
+            chain.insert(chain.size(), data);
+            chain.commit();
+            expected += data;
+            states.push_back(expected);
+            if (expected.size() > 3000) {
+                chain.remove(0, 1000);
+                chain.commit();
+                expected.erase(0, 1000);
+                states.push_back(expected);
+            }
+        }
+        REQUIRE(chain_equals(expected, chain));
+    };
+
+    SECTION("Unlimited") {
+        PieceChain chain(options);
+        vector<string> states;
+        edit(chain, states);
+
+        auto stats = chain.stats();
+        REQUIRE(stats.heap_bytes >= 200 * 1000);
+        REQUIRE(stats.heap_live_bytes == chain.size());
+        REQUIRE(stats.fragmentation > 0.9);
+        REQUIRE(stats.pieces == count_pieces(chain));
+        REQUIRE(stats.total_pieces > stats.pieces);
+        REQUIRE(stats.revisions == states.size() + 1);
+        REQUIRE(stats.mapped_bytes == 0);
+        REQUIRE(stats.bookkeeping_bytes > 0);
+
+        // Dropping the history releases the blocks nobody needs anymore
+        chain.compact(0, true);
+        stats = chain.stats();
+        REQUIRE(stats.heap_bytes < 4 * 4096);
+        REQUIRE(stats.revisions == 1);
+        REQUIRE(stats.pieces == count_pieces(chain));
+        REQUIRE(stats.total_pieces == stats.pieces);
+        REQUIRE(chain_equals(states.back(), chain));
+    }
+
+    SECTION("Limited") {
+        options.history_budget = 64 * 1024;
+        PieceChain chain(options);
+        vector<string> states;
+        edit(chain, states);
+
+        auto stats = chain.stats();
+        REQUIRE(stats.heap_bytes <= options.history_budget);
+        REQUIRE(stats.revisions < states.size());
+
+        // The most recent revisions are still there
+        size_t undone = 0;
+        while (chain.undo()) {
+            ++undone;
+            REQUIRE(chain_equals(states[states.size() - 1 - undone], chain));
+        }
+        REQUIRE(undone > 10);
+        REQUIRE(undone < states.size() - 1);
+        while (chain.redo());
+        REQUIRE(chain_equals(states.back(), chain));
+    }
+}
+
+TEST_CASE("Coalescing commits", "[options]") {
+    PieceChainOptions options = {};
+
+    SECTION("By size") {
+        options.coalesce_bytes = 1000;
+        PieceChain chain(options);
+
+        // A stream of one byte edits, each one committed on its own
+        string expected;
+        for (int i = 0; i < 3000; ++i) {
+            char c = (char) ('a' + i % 26);
+            chain.insert(chain.size(), &c, 1);
+            chain.commit();
+            expected += c;
+        }
+        REQUIRE(chain_equals(expected, chain));
+        auto stats = chain.stats();
+        REQUIRE(stats.revisions <= 4);
+        REQUIRE(stats.pieces <= 4);
+
+        // Undo goes back a whole group at a time
+        REQUIRE(chain.undo());
+        REQUIRE(chain_equals(expected.substr(0, 2000), chain));
+        REQUIRE(chain.redo());
+        REQUIRE(chain_equals(expected, chain));
+
+        // Committing right away closes the group early
+        chain.insert(0, "x", 1);
+        chain.commit_now();
+        chain.insert(0, "y", 1);
+        chain.commit();
+        REQUIRE(chain.undo());
+        REQUIRE(chain_equals("x" + expected, chain));
+        REQUIRE(chain.undo());
+        REQUIRE(chain_equals(expected, chain));
+    }
+
+    SECTION("Batches") {
+        options.coalesce_bytes = 1000;
+        PieceChain chain(options);
+        chain.insert(0, "hello");
+        chain.commit();
+
+        // A batch never joins the pending group, nor does it absorb the edits that follow
+        chain.apply({ make_edit(0, 0, "<"), make_edit(5, 0, ">") });
+        chain.insert(7, "!");
+        chain.commit();
+        REQUIRE(chain_equals("<hello>!", chain));
+        REQUIRE(chain.undo());
+        REQUIRE(chain_equals("<hello>", chain));
+        REQUIRE(chain.undo());
+        REQUIRE(chain_equals("hello", chain));
+        REQUIRE(chain.undo());
+        REQUIRE(chain.empty());
+    }
+
+    SECTION("By time") {
+        options.coalesce_ms = 100;
+        PieceChain chain(options);
+        for (int burst = 0; burst < 2; ++burst) {
+            for (int i = 0; i < 100; ++i) {
+                chain.insert(chain.size(), "ab", 2);
+                chain.commit();
+            }
+            this_thread::sleep_for(chrono::milliseconds(150));
+        }
+
+        // The first commit after a pause closes the group
+        chain.commit();
+        REQUIRE(chain.size() == 400);
+        REQUIRE(chain.undo());
+        REQUIRE(chain.size() == 200);
+        REQUIRE(chain.undo());
+        REQUIRE(chain.empty());
+    }
+}
+
 TEST_CASE("Can iterate portions of text", "[iterator]") {
     PieceChain chain;
     chain.insert(0, "hello world", 11);
@@ -232,6 +938,57 @@ TEST_CASE("Iterators are copyable", "[iterator]") {
     REQUIRE(ss.str() == "hello world");
 }
 
+TEST_CASE("Reverse iterators", "[iterator]") {
+    PieceChain chain;
+    string expected;
+    for (int i = 0; i < 50; ++i) {
+        string s = to_string(i) + ";";
+        chain.insert(expected.size() / 2, s);
+        expected.insert(expected.size() / 2, s);
+        chain.commit();
+    }
+
+    auto reversed = [&](size_t start, size_t len) {
+        string out;
+        for (auto it = chain.rbegin(start, len); it != chain.rend(); ++it) {
+            out.insert(0, (const char*) it->first, it->second);
+        }
+        return out;
+    };
+    REQUIRE(reversed(0, chain.size()) == expected);
+    for (size_t start = 0; start < expected.size(); start += 7) {
+        for (size_t len : { 1, 5, 13, 100 }) {
+            REQUIRE(reversed(start, len) == expected.substr(start, len));
+        }
+    }
+    REQUIRE(chain.rbegin(0, 0) == chain.rend());
+}
+
+TEST_CASE("Iterators consume from both ends", "[iterator]") {
+    PieceChain_t* chain = piece_chain_open(nullptr);
+    REQUIRE(piece_chain_insert(chain, 0, (const unsigned char*) "world", 5));
+    REQUIRE(piece_chain_commit(chain));
+    REQUIRE(piece_chain_insert(chain, 0, (const unsigned char*) "hello ", 6));
+    REQUIRE(piece_chain_commit(chain));
+    REQUIRE(piece_chain_insert(chain, 11, (const unsigned char*) "!", 1));
+
+    auto it = piece_chain_iter(chain, 3, 8);
+    const unsigned char* data;
+    size_t len;
+    string front, back;
+    REQUIRE(piece_chain_iter_prev(it, &data, &len));
+    back.insert(0, (const char*) data, len);
+    REQUIRE(piece_chain_iter_next(it, &data, &len));
+    front.append((const char*) data, len);
+    while (piece_chain_iter_prev(it, &data, &len)) {
+        back.insert(0, (const char*) data, len);
+    }
+    REQUIRE_FALSE(piece_chain_iter_next(it, &data, &len));
+    piece_chain_iter_free(it);
+    piece_chain_destroy(chain);
+    REQUIRE(front + back == "lo world");
+}
+
 TEST_CASE("Single byte access", "[iterator]") {
     PieceChain chain;
     chain.insert(0, " world", 6);
@@ -285,4 +1042,1039 @@ TEST_CASE("Saves file correctly", "[file]") {
             "\"a41872ff87fe2c2757379f93842dd33e\"" // MD5 of "Test file contents\n"
         " ]";
     REQUIRE(system(command.c_str()) == 0);
-}
\ No newline at end of file
+}
+
+TEST_CASE("Saves edited file correctly", "[file]") {
+    system("printf 'Test file contents\\n' > test3.txt");
+    PieceChain chain("test3.txt");
+    chain.insert(5, "edited ");
+    chain.remove(0, 5);
+    chain.insert(chain.size(), "More contents\n");
+
+    // Unchanged portions are copied from the original file, so save over it too
+    string path;
+    SECTION("Different file") {
+        path = "test3-copy.txt";
+    }
+
+    SECTION("Same file") {
+        path = "test3.txt";
+    }
+
+    chain.save(path, SaveMode::Atomic);
+
+    PieceChain saved(path);
+    REQUIRE(chain_equals("edited file contents\nMore contents\n", saved));
+    REQUIRE(chain_equals("edited file contents\nMore contents\n", chain));
+}
+
+TEST_CASE("Saves only modified regions", "[file]") {
+    string expected;
+    for (size_t i = 0; i < 3 * 4096 + 100; ++i) {
+        expected.push_back('a' + i % 26);
+    }
+    const string original = expected;
+    {
+        FILE* f = fopen("test4.txt", "w");
+        fwrite(expected.data(), 1, expected.size(), f);
+        fclose(f);
+    }
+
+    PieceChain chain("test4.txt");
+    chain.replace(5000, "XYZ");
+    expected.replace(5000, 3, "XYZ");
+    chain.replace(expected.size() - 2, "!!");
+    expected.replace(expected.size() - 2, 2, "!!");
+    chain.commit();
+    chain.save("test4.txt", SaveMode::Incremental);
+
+    REQUIRE(chain_equals(expected, PieceChain("test4.txt")));
+    REQUIRE(chain_equals(expected, chain));
+#ifdef PIECE_CHAIN_INSTRUMENTATION
+    REQUIRE(chain.counters().save_bytes[SAVE_MODE_INCREMENTAL] == 5);
+#endif
+
+    // The history still sees the contents the file had when it was opened
+    chain.undo();
+    REQUIRE(chain_equals(original, chain));
+    chain.redo();
+
+    // Size changes fall back to rewriting the whole file
+    chain.remove(0, 200);
+    expected.erase(0, 200);
+    chain.save("test4.txt", SaveMode::Incremental);
+    REQUIRE(chain_equals(expected, PieceChain("test4.txt")));
+
+    // Even the parts of the mapping past the end of the truncated file
+    while (chain.undo());
+    REQUIRE(chain_equals(original, chain));
+
+    // In place saves over the mapped file skip the unchanged regions as well
+    system("cp test4.txt test17.txt");
+    PieceChain inplace("test17.txt");
+    inplace.replace(100, "?");
+    inplace.commit();
+    inplace.save("test17.txt", SaveMode::InPlace);
+    string edited = expected;
+    REQUIRE(chain_equals(edited.replace(100, 1, "?"), PieceChain("test17.txt")));
+#ifdef PIECE_CHAIN_INSTRUMENTATION
+    REQUIRE(inplace.counters().save_bytes[SAVE_MODE_INPLACE] == 1);
+#endif
+    inplace.undo();
+    REQUIRE(chain_equals(expected, inplace));
+}
+
+TEST_CASE("Saves in the background", "[file]") {
+    string expected;
+    for (int i = 0; i < 100000; ++i) {
+        expected += to_string(i) + ",";
+    }
+    system("echo 'Test file contents' > test14.txt");
+    PieceChain chain("test14.txt");
+    chain.insert(0, expected);
+    chain.commit();
+    expected += "Test file contents\n";
+
+    // Edits made while saving are not part of the saved file, and leave the chain dirty
+    auto saving = chain.save_async("test14.txt");
+    for (int i = 0; i < 1000; ++i) {
+        chain.insert(chain.size() / 2, "x");
+        chain.commit();
+    }
+    saving.get();
+    REQUIRE(chain_equals(expected, PieceChain("test14.txt")));
+    REQUIRE(chain.dirty());
+
+    ostringstream edited;
+    edited << chain;
+    chain.save_async("test14.txt").get();
+    REQUIRE_FALSE(chain.dirty());
+    REQUIRE(chain_equals(edited.str(), PieceChain("test14.txt")));
+
+    // Overlapping saves to the same file leave it with the newest contents
+    vector<future<void>> overlapping;
+    for (int i = 0; i < 8; ++i) {
+        chain.insert(0, to_string(i));
+        chain.commit();
+        overlapping.push_back(chain.save_async("test14.txt"));
+    }
+    for (auto& f : overlapping) {
+        f.get();
+    }
+    REQUIRE_FALSE(chain.dirty());
+    ostringstream newest;
+    newest << chain;
+    REQUIRE(chain_equals(newest.str(), PieceChain("test14.txt")));
+    REQUIRE(system("ls test14.txt~~save* > /dev/null 2>&1") != 0);
+
+    // Saving in place over the mapped file waits for the background saves still reading from it
+    {
+        PieceChain mapped("test14.txt");
+        ostringstream before;
+        before << mapped;
+        auto copying = mapped.save_async("test15.txt");
+        mapped.replace(0, string(mapped.size(), 'x'));
+        mapped.save("test14.txt", SaveMode::InPlace);
+        copying.get();
+        REQUIRE(chain_equals(before.str(), PieceChain("test15.txt")));
+        REQUIRE(chain_equals(string(mapped.size(), 'x'), PieceChain("test14.txt")));
+        REQUIRE_FALSE(mapped.dirty());
+    }
+
+    // Errors are reported through the future
+    auto failed = chain.save_async("nonexistent/test14.txt");
+    REQUIRE_THROWS_AS(failed.get(), PieceChainException);
+
+    // The chain waits for the saves still running before going away
+    optional<PieceChain> other(in_place);
+    other->insert(0, expected);
+    other->save_async("test15.txt");
+    other.reset();
+    REQUIRE(chain_equals(expected, PieceChain("test15.txt")));
+}
+
+TEST_CASE("Instrumentation", "[file]") {
+    system("echo 'Test file contents' > test13.txt");
+    PieceChain chain("test13.txt");
+    vector<PieceChainTraceEvent> events;
+    chain.set_trace([](PieceChain_t*, const PieceChainTraceEvent* event, void* user) {
+        ((vector<PieceChainTraceEvent>*) user)->push_back(*event);
+    }, &events);
+
+    chain.replace(0, "T");
+    chain.commit();
+    chain.save("test13.txt", SaveMode::Incremental);
+    for (int i = 0; i < 100; ++i) {
+        chain.insert(5 + i, "x");
+    }
+    chain.commit();
+    chain.at(50);
+    chain.save("test13.txt", SaveMode::Atomic);
+    auto counters = chain.counters();
+
+#ifdef PIECE_CHAIN_INSTRUMENTATION
+    REQUIRE(counters.lookups >= 101);
+    REQUIRE(counters.lookup_steps >= counters.lookups);
+    REQUIRE(counters.cache_hits == 99);
+    REQUIRE(counters.cache_misses == 1);
+    REQUIRE(counters.blocks_allocated == 1);
+    REQUIRE(counters.save_bytes[SAVE_MODE_ATOMIC] == chain.size());
+    REQUIRE(counters.save_bytes[SAVE_MODE_INCREMENTAL] == 1);
+    REQUIRE(counters.bytes_written == chain.size() + 1);
+    REQUIRE(counters.renames == 1);
+    REQUIRE(counters.fsyncs == 3);
+
+    vector<PieceChainTraceType> types;
+    for (auto& e : events) {
+        types.push_back(e.type);
+    }
+    REQUIRE(types == vector<PieceChainTraceType> {
+        TRACE_BLOCK_ALLOC, TRACE_FSYNC, TRACE_SAVE, TRACE_FSYNC, TRACE_RENAME, TRACE_FSYNC, TRACE_SAVE
+    });
+    REQUIRE(events[2].mode == SAVE_MODE_INCREMENTAL);
+    REQUIRE(events[2].bytes == 1);
+    REQUIRE(events[6].mode == SAVE_MODE_ATOMIC);
+    REQUIRE(events[6].bytes == chain.size());
+    REQUIRE(events[6].success);
+
+    chain.reset_counters();
+    REQUIRE(chain.counters().lookups == 0);
+
+    // Background saves are accounted to the chain they belong to
+    pair<PieceChain_t*, vector<PieceChainTraceEvent>> background { nullptr, {} };
+    chain.set_trace([](PieceChain_t* c, const PieceChainTraceEvent* event, void* user) {
+        auto seen = (pair<PieceChain_t*, vector<PieceChainTraceEvent>>*) user;
+        seen->first = c;
+        seen->second.push_back(*event);
+    }, &background);
+    chain.save("test13.txt", SaveMode::Incremental);
+    PieceChain_t* self = background.first;
+    background = { nullptr, {} };
+    chain.reset_counters();
+    chain.save_async("test13.txt").get();
+    REQUIRE(background.first == self);
+    REQUIRE(background.second.size() == 4);
+    REQUIRE(background.second.back().type == TRACE_SAVE);
+    REQUIRE(background.second.back().bytes == chain.size());
+    counters = chain.counters();
+    REQUIRE(counters.save_bytes[SAVE_MODE_ATOMIC] == chain.size());
+    REQUIRE(counters.renames == 1);
+    chain.reset_counters();
+    REQUIRE(chain.counters().renames == 0);
+
+    // Removing the callback waits for the background saves still using it
+    background = { nullptr, {} };
+    auto pending = chain.save_async("test13.txt");
+    chain.set_trace(nullptr, nullptr);
+    size_t reported = background.second.size();
+    REQUIRE(reported == 4);
+    pending.get();
+    REQUIRE(background.second.size() == reported);
+#else
+    // Without instrumentation nothing is counted or reported
+    REQUIRE(counters.lookups == 0);
+    REQUIRE(counters.bytes_written == 0);
+    REQUIRE(events.empty());
+#endif
+}
+
+TEST_CASE("Saves fragmented chains correctly", "[file]") {
+    // Enough pieces to need more than one batch of buffers
+    PieceChain chain;
+    string expected;
+    for (size_t i = 0; i < 3000; ++i) {
+        string s = to_string(i) + ",";
+        chain.insert(0, s);
+        expected.insert(0, s);
+    }
+
+    string path;
+    SaveMode mode;
+
+    SECTION("Atomic mode") {
+        path = "test5-atomic.txt";
+        mode = SaveMode::Atomic;
+    }
+
+    SECTION("In-place mode") {
+        path = "test5-inplace.txt";
+        mode = SaveMode::InPlace;
+    }
+
+    chain.save(path, mode);
+    REQUIRE(chain_equals(expected, PieceChain(path)));
+}
+
+TEST_CASE("Access hints", "[file]") {
+    string original;
+    for (size_t i = 0; i < 5 * 4096 + 10; ++i) {
+        original.push_back('a' + i % 26);
+    }
+    {
+        FILE* f = fopen("test9.txt", "w");
+        fwrite(original.data(), 1, original.size(), f);
+        fclose(f);
+    }
+
+    PieceChain chain("test9.txt");
+    chain.insert(4096, "hello");
+    string expected = original;
+    expected.insert(4096, "hello");
+    for (Advice advice : { Advice::Sequential, Advice::Random, Advice::WillNeed, Advice::DontNeed, Advice::Normal }) {
+        chain.advise(0, chain.size(), advice);
+        chain.advise(100, 5000, advice);
+        REQUIRE(chain_equals(expected, chain));
+    }
+    chain.advise(chain.size(), 10, Advice::Sequential);
+
+    // Hints never drop the only copy of the old contents of the file
+    chain.remove(0, 3 * 4096);
+    expected.erase(0, 3 * 4096);
+    chain.save("test9.txt", SaveMode::InPlace);
+    chain.advise(0, chain.size(), Advice::DontNeed);
+    REQUIRE(chain_equals(expected, chain));
+    while (chain.undo());
+    chain.advise(0, chain.size(), Advice::DontNeed);
+    REQUIRE(chain_equals(original, chain));
+}
+
+static string to_string(const Snapshot& snapshot) {
+    ostringstream ss;
+    ss << snapshot;
+    return ss.str();
+}
+
+TEST_CASE("Snapshots", "[snapshot]") {
+    PieceChain chain;
+    chain.insert(0, "Hello world");
+    Snapshot snap = chain.snapshot();
+    REQUIRE(snap.size() == 11);
+    REQUIRE(snap.at(4) == 'o');
+    REQUIRE(to_string(snap) == "Hello world");
+
+    // Edits that would normally modify the last piece in place must not show in the snapshot
+    chain.insert(11, "!!!");
+    chain.insert(5, ",");
+    chain.replace(0, "J");
+    chain.remove(1, 2);
+    REQUIRE(chain_equals("Jlo, world!!!", chain));
+    REQUIRE(to_string(snap) == "Hello world");
+
+    Snapshot copy = snap;
+    Snapshot later = chain.snapshot();
+    chain.compact(0, true);
+    chain.clear();
+    REQUIRE(to_string(later) == "Jlo, world!!!");
+
+    // Partial visits
+    string partial;
+    later.visit(2, 5, [&](const unsigned char* data, size_t len) {
+        partial.append((const char*) data, len);
+    });
+    REQUIRE(partial == "o, wo");
+    REQUIRE(to_string(copy) == "Hello world");
+
+    // Moved-from snapshots can still be copied and assigned
+    Snapshot moved = std::move(copy);
+    Snapshot empty_copy = copy;
+    later = copy;
+    REQUIRE(to_string(moved) == "Hello world");
+}
+
+TEST_CASE("Snapshots outlive their chain", "[snapshot]") {
+    system("echo 'Test file contents' > test6.txt");
+    optional<Snapshot> snap;
+    {
+        PieceChain chain("test6.txt");
+        chain.insert(0, "More ");
+        snap = chain.snapshot();
+    }
+    REQUIRE(to_string(*snap) == "More Test file contents\n");
+}
+
+TEST_CASE("Clones", "[snapshot]") {
+    system("echo 'Test file contents' > test12.txt");
+    optional<PieceChain> chain(in_place, "test12.txt");
+    chain->insert(0, "More ");
+    chain->commit();
+
+    PieceChain clone = chain->clone();
+    REQUIRE(chain_equals("More Test file contents\n", clone));
+    REQUIRE(clone.dirty());
+    REQUIRE_FALSE(clone.undo());
+    REQUIRE(clone.stats().heap_bytes == 0);
+    REQUIRE(clone.stats().shared_bytes > 0);
+
+    // The two chains evolve independently, even when writing past the data they share
+    chain->insert(chain->size() - 1, " and more");
+    clone.insert(clone.size() - 1, "!");
+    clone.commit();
+    clone.remove(0, 5);
+    REQUIRE(chain_equals("More Test file contents and more\n", *chain));
+    REQUIRE(chain_equals("Test file contents!\n", clone));
+    REQUIRE(clone.undo());
+    REQUIRE(chain_equals("More Test file contents!\n", clone));
+
+    // The clone keeps the shared data alive after the original is gone
+    PieceChain second = clone.clone();
+    Snapshot snap = clone.snapshot();
+    chain.reset();
+    REQUIRE(chain_equals("More Test file contents!\n", clone));
+    clone.insert(0, "Even ");
+    clone = PieceChain();
+    REQUIRE(chain_equals("More Test file contents!\n", second));
+    REQUIRE(to_string(snap) == "More Test file contents!\n");
+
+    second.save("test12.txt");
+    REQUIRE(chain_equals("More Test file contents!\n", PieceChain("test12.txt")));
+}
+
+TEST_CASE("Snapshot diff", "[snapshot]") {
+    using Edit = tuple<size_t, size_t, size_t, size_t>;
+    auto diff = [](const Snapshot& a, const Snapshot& b) {
+        vector<Edit> edits;
+        a.diff(b, [&](size_t a_offset, size_t a_len, size_t b_offset, size_t b_len) {
+            edits.emplace_back(a_offset, a_len, b_offset, b_len);
+        });
+        return edits;
+    };
+
+    PieceChain chain;
+    string base;
+    for (int i = 0; i < 1000; ++i) {
+        base += to_string(i) + ",";
+    }
+    chain.insert(0, base);
+    chain.commit();
+    Snapshot saved = chain.snapshot();
+    REQUIRE(diff(saved, saved).empty());
+
+    chain.insert(10, "abc");
+    chain.remove(2000, 5);
+    chain.replace(3000, "xy");
+    chain.commit();
+    Snapshot now = chain.snapshot();
+    REQUIRE(diff(saved, now) == vector<Edit> { { 10, 0, 10, 3 }, { 1997, 5, 2000, 0 }, { 3002, 2, 3000, 2 } });
+    REQUIRE(diff(now, saved) == vector<Edit> { { 10, 3, 10, 0 }, { 2000, 0, 1997, 5 }, { 3000, 2, 3002, 2 } });
+
+    // Bytes deleted and typed again are not a change
+    chain.remove(100, 3);
+    chain.insert(100, base.substr(97, 3));
+    chain.commit();
+    REQUIRE(diff(now, chain.snapshot()).empty());
+
+    // Clones share their data with the original chain
+    PieceChain clone = chain.clone();
+    clone.insert(clone.size(), "end");
+    REQUIRE(diff(now, clone.snapshot()) == vector<Edit> { { now.size(), 0, now.size(), 3 } });
+
+    // Unrelated contents are compared byte by byte
+    PieceChain other;
+    other.insert(0, base.substr(0, 500) + "!" + base.substr(500));
+    REQUIRE(diff(saved, other.snapshot()) == vector<Edit> { { 500, 0, 500, 1 } });
+    REQUIRE(diff(Snapshot(PieceChain().snapshot()), saved) == vector<Edit> { { 0, 0, 0, base.size() } });
+}
+
+TEST_CASE("Snapshots can be read concurrently", "[snapshot]") {
+    PieceChain chain;
+    string expected;
+    mt19937 rng(3);
+    vector<pair<Snapshot, string>> snapshots;
+    for (int i = 0; i < 20; ++i) {
+        for (int j = 0; j < 50; ++j) {
+            size_t off = rng() % (expected.size() + 1);
+            string s = to_string(rng());
+            chain.insert(off, s);
+            expected.insert(off, s);
+        }
+        snapshots.emplace_back(chain.snapshot(), expected);
+    }
+
+    // Readers check the snapshots while the writer keeps editing
+    bool ok[4] = { false, false, false, false };
+    vector<thread> readers;
+    for (int t = 0; t < 4; ++t) {
+        readers.emplace_back([&, t] {
+            bool res = true;
+            for (auto& [snap, contents] : snapshots) {
+                res = res && to_string(snap) == contents;
+            }
+            ok[t] = res;
+        });
+    }
+    for (int j = 0; j < 2000; ++j) {
+        size_t off = rng() % (expected.size() + 1);
+        chain.insert(off, "abc");
+        if (j % 7 == 0) {
+            chain.remove(off / 2, 3);
+        }
+    }
+    for (auto& t : readers) {
+        t.join();
+    }
+    for (int t = 0; t < 4; ++t) {
+        REQUIRE(ok[t]);
+    }
+}
+
+TEST_CASE("Parallel visit", "[visit]") {
+    PieceChain chain;
+    string expected;
+    mt19937 rng(11);
+    for (int i = 0; i < 2000; ++i) {
+        string s(rng() % 1000, 'a' + i % 26);
+        size_t off = rng() % (expected.size() + 1);
+        chain.insert(off, s);
+        expected.insert(off, s);
+    }
+
+    size_t chunks = GENERATE(0, 1, 3, 16, 1000);
+
+    // Concatenating the chunks in order gives back the contents
+    string contents = chain.visit_parallel(0, chain.size(), string(),
+        [](string& acc, size_t, const unsigned char* data, size_t len) { acc.append((const char*) data, len); },
+        [](string acc, string chunk) { return acc + chunk; },
+        chunks
+    );
+    REQUIRE(contents == expected);
+
+    // Offsets are reported correctly
+    size_t from = 12345;
+    size_t len = expected.size() - 2 * from;
+    size_t mismatches = chain.visit_parallel(from, len, (size_t) 0,
+        [&](size_t& acc, size_t offset, const unsigned char* data, size_t len) {
+            acc += memcmp(expected.data() + offset, data, len) != 0;
+        },
+        [](size_t acc, size_t chunk) { return acc + chunk; },
+        chunks
+    );
+    REQUIRE(mismatches == 0);
+    size_t total = chain.visit_parallel(from, len, (size_t) 0,
+        [](size_t& acc, size_t, const unsigned char*, size_t len) { acc += len; },
+        [](size_t acc, size_t chunk) { return acc + chunk; },
+        chunks
+    );
+    REQUIRE(total == len);
+
+    // Boolean accumulators are bound by reference like any other
+    bool found = chain.visit_parallel(0, chain.size(), false,
+        [](bool& acc, size_t, const unsigned char* data, size_t len) { acc = acc || memchr(data, '7', len) != nullptr; },
+        [](bool acc, bool chunk) { return acc || chunk; },
+        chunks
+    );
+    REQUIRE(found == (expected.find('7') != string::npos));
+
+    // Exceptions stop the visit
+    REQUIRE_THROWS_AS(chain.visit_parallel(0, chain.size(), 0,
+        [](int&, size_t offset, const unsigned char*, size_t) { if (offset > 100000) throw std::logic_error("stop"); },
+        [](int acc, int) { return acc; },
+        chunks
+    ), std::logic_error);
+}
+
+TEST_CASE("Search", "[search]") {
+    // Build the contents out of lots of tiny pieces, so that most occurrences cross piece boundaries
+    PieceChain chain;
+    string expected;
+    mt19937 rng(5);
+    const string alphabet = "abcd";
+    for (int i = 0; i < 3000; ++i) {
+        string s;
+        for (size_t n = 1 + rng() % 4; n > 0; --n) {
+            s.push_back(alphabet[rng() % alphabet.size()]);
+        }
+        size_t off = rng() % (expected.size() + 1);
+        chain.insert(off, s);
+        expected.insert(off, s);
+    }
+    chain.insert(expected.size() / 2, string(300, 'x') + "needle" + string(300, 'x'));
+    expected.insert(expected.size() / 2, string(300, 'x') + "needle" + string(300, 'x'));
+
+    vector<string> patterns = { "a", "abc", "dcba", "aaaa", "needle", string(300, 'x') + "n", "bbbbbbbbbb", "" };
+    for (auto& pattern : patterns) {
+        for (size_t from : { (size_t) 0, (size_t) 1, (size_t) 777, expected.size() / 2, expected.size() - 3, expected.size() + 10 }) {
+            size_t pos = expected.find(pattern, from);
+            auto found = chain.find(pattern, from);
+            REQUIRE(found.has_value() == (pos != string::npos));
+            if (found) {
+                REQUIRE(*found == pos);
+            }
+
+            pos = expected.rfind(pattern, from);
+            found = chain.rfind(pattern, from);
+            REQUIRE(found.has_value() == (pos != string::npos));
+            if (found) {
+                REQUIRE(*found == pos);
+            }
+        }
+    }
+
+    // Walk all the occurrences of a pattern
+    size_t count = 0;
+    for (auto pos = chain.find("ab"); pos; pos = chain.find("ab", *pos + 1)) {
+        REQUIRE(expected.compare(*pos, 2, "ab") == 0);
+        ++count;
+    }
+    size_t expected_count = 0;
+    for (size_t pos = expected.find("ab"); pos != string::npos; pos = expected.find("ab", pos + 1)) {
+        ++expected_count;
+    }
+    REQUIRE(count == expected_count);
+
+    // Multiple patterns
+    auto any = chain.find_any({ "needle", "cccc", "dddd" }, 100);
+    size_t first = min({ expected.find("needle", 100), expected.find("cccc", 100), expected.find("dddd", 100) });
+    REQUIRE(any);
+    REQUIRE(any->first == first);
+    REQUIRE(expected.compare(first, 4, any->second == 0 ? "need" : any->second == 1 ? "cccc" : "dddd") == 0);
+    REQUIRE_FALSE(chain.find_any({ "zz", "yy" }));
+}
+
+static void check_lines(const string& expected, const PieceChain& chain) {
+    // Line i starts after the i-th newline
+    vector<size_t> starts = { 0 };
+    for (size_t i = 0; i < expected.size(); ++i) {
+        if (expected[i] == '\n') {
+            starts.push_back(i + 1);
+        }
+    }
+    for (size_t line = 0; line < starts.size(); ++line) {
+        REQUIRE(chain.line_to_offset(line) == starts[line]);
+    }
+    REQUIRE_FALSE(chain.line_to_offset(starts.size()));
+
+    size_t line = 0;
+    for (size_t off = 0; off <= expected.size(); off += 1 + off % 97) {
+        while (line + 1 < starts.size() && starts[line + 1] <= off) {
+            ++line;
+        }
+        REQUIRE(chain.offset_to_line(off) == line);
+    }
+    REQUIRE(chain.offset_to_line(expected.size()) == starts.size() - 1);
+    REQUIRE_FALSE(chain.offset_to_line(expected.size() + 1));
+}
+
+TEST_CASE("Line index", "[lines]") {
+    PieceChainOptions options = {};
+    options.line_index = true;
+
+    string expected;
+    optional<PieceChain> chain;
+    SECTION("Empty chain") {
+        chain.emplace(options);
+    }
+    SECTION("Big file") {
+        // Make sure that edits split the original file far from the chunk boundaries
+        for (int i = 0; i < 20000; ++i) {
+            expected += "line " + to_string(i) + string(i % 13, '-') + "\n";
+        }
+        FILE* f = fopen("test7.txt", "w");
+        fwrite(expected.data(), 1, expected.size(), f);
+        fclose(f);
+        chain.emplace("test7.txt", options);
+    }
+    check_lines(expected, *chain);
+
+    mt19937 rng(9);
+    vector<string> history = { expected };
+    for (int round = 0; round < 10; ++round) {
+        for (int i = 0; i < 30; ++i) {
+            size_t off = rng() % (expected.size() + 1);
+            switch (rng() % 4) {
+                case 0: {
+                    // Typing, which extends the cached piece
+                    for (char c : string("ab\ncd\n")) {
+                        chain->insert(off, string(1, c));
+                        expected.insert(off++, 1, c);
+                    }
+                    break;
+                }
+                case 1: {
+                    size_t len = min((size_t) rng() % 300, expected.size() - off);
+                    chain->remove(off, len);
+                    expected.erase(off, len);
+                    break;
+                }
+                case 2: {
+                    string s = "x\ny\n";
+                    chain->replace(off, s);
+                    expected.replace(off, min(s.size(), expected.size() - off), s);
+                    break;
+                }
+                default: {
+                    string s = "\n\n" + to_string(rng()) + "\n";
+                    chain->insert(off, s);
+                    expected.insert(off, s);
+                    break;
+                }
+            }
+        }
+        chain->commit();
+        history.push_back(expected);
+        check_lines(expected, *chain);
+    }
+
+    // Undo and redo keep the counts consistent
+    for (int i = 0; i < 5; ++i) {
+        chain->undo();
+        history.pop_back();
+    }
+    check_lines(history.back(), *chain);
+    chain->redo();
+    chain->compact(4096);
+    ostringstream ss;
+    ss << *chain;
+    check_lines(ss.str(), *chain);
+}
+
+TEST_CASE("Bulk reads", "[read]") {
+    PieceChain chain;
+    string expected;
+    for (int i = 0; i < 200; ++i) {
+        string s = to_string(i) + ";";
+        chain.insert(expected.size() / 3, s);
+        expected.insert(expected.size() / 3, s);
+        chain.commit();
+    }
+    REQUIRE(count_pieces(chain) > 1);
+
+    for (size_t off : { (size_t) 0, (size_t) 5, (size_t) 100, expected.size() - 20, expected.size() - 1 }) {
+        for (size_t len : { (size_t) 0, (size_t) 1, (size_t) 7, (size_t) 300, (size_t) 10000 }) {
+            REQUIRE(chain.read(off, len) == expected.substr(off, len));
+        }
+    }
+    REQUIRE(chain.read(expected.size(), 10).empty());
+
+    unsigned char buf[16];
+    REQUIRE(chain.read(expected.size() - 4, buf, sizeof(buf)) == 4);
+    REQUIRE(memcmp(buf, expected.data() + expected.size() - 4, 4) == 0);
+
+    // Direct views only work inside a single piece
+    auto view = chain.view(0, 1);
+    REQUIRE(view);
+    REQUIRE(*view == expected.substr(0, 1));
+    REQUIRE_FALSE(chain.view(0, expected.size()));
+    REQUIRE_FALSE(chain.view(expected.size(), 1));
+}
+
+TEST_CASE("Byte iterators", "[iterator]") {
+    PieceChain chain;
+    string expected;
+    for (int i = 0; i < 100; ++i) {
+        string s = to_string(i) + ";";
+        chain.insert(expected.size() / 2, s);
+        expected.insert(expected.size() / 2, s);
+        chain.commit();
+    }
+    REQUIRE(count_pieces(chain) > 1);
+
+    SECTION("Forward and backward") {
+        auto bytes = chain.bytes();
+        REQUIRE(bytes.size() == expected.size());
+        REQUIRE(string(bytes.begin(), bytes.end()) == expected);
+        REQUIRE(string(bytes.rbegin(), bytes.rend()) == string(expected.rbegin(), expected.rend()));
+
+        string out;
+        for (unsigned char c : chain.bytes(10, 25)) {
+            out += (char) c;
+        }
+        REQUIRE(out == expected.substr(10, 25));
+        REQUIRE(chain.bytes(expected.size() - 3, 100).size() == 3);
+        REQUIRE(chain.bytes(expected.size() + 3, 100).empty());
+    }
+
+    SECTION("Random access") {
+        auto bytes = chain.bytes();
+        auto it = bytes.begin();
+        mt19937 rng(3);
+        for (int i = 0; i < 1000; ++i) {
+            size_t off = rng() % expected.size();
+            REQUIRE(it[off] == (unsigned char) expected[off]);
+            REQUIRE(*(bytes.end() - (expected.size() - off)) == (unsigned char) expected[off]);
+        }
+        REQUIRE(bytes.end() - bytes.begin() == (ptrdiff_t) expected.size());
+        REQUIRE(bytes.begin() < bytes.end());
+        REQUIRE_THROWS(*bytes.end());
+    }
+
+    SECTION("Standard algorithms") {
+        auto bytes = chain.bytes();
+        const string needle = expected.substr(150, 6);
+        auto found = std::search(bytes.begin(), bytes.end(), needle.begin(), needle.end());
+        REQUIRE(found.offset() == expected.find(needle));
+        REQUIRE(std::count(bytes.begin(), bytes.end(), ';') == 100);
+        REQUIRE(std::find(bytes.begin(), bytes.end(), 'x') == bytes.end());
+
+        // Binary search over a sorted chain
+        PieceChain sorted;
+        sorted.insert(0, "aaabbb");
+        sorted.commit();
+        sorted.insert(6, "cccddd");
+        REQUIRE(std::lower_bound(sorted.bytes().begin(), sorted.bytes().end(), 'c').offset() == 6);
+    }
+
+    SECTION("Chunk iterators can be assigned") {
+        auto it = chain.begin();
+        auto other = chain.begin(5, 10);
+        it = other;
+        REQUIRE(it->second == other->second);
+    }
+}
+
+TEST_CASE("Windowed files", "[file]") {
+    string expected;
+    mt19937 rng(13);
+    for (size_t i = 0; i < 16 * 65536 + 123; ++i) {
+        expected.push_back(i % 80 == 79 ? '\n' : 'a' + rng() % 26);
+    }
+    const string original = expected;
+    {
+        FILE* f = fopen("test8.txt", "w");
+        fwrite(expected.data(), 1, expected.size(), f);
+        fclose(f);
+    }
+
+    // Tiny windows, and only a couple of them kept mapped
+    PieceChainOptions options = {};
+    options.window_size = 1;
+    options.max_windows = 2;
+    options.line_index = true;
+    PieceChain chain("test8.txt", options);
+    REQUIRE(chain_equals(expected, chain));
+    REQUIRE_FALSE(chain.view(0, 1));
+
+    for (int i = 0; i < 200; ++i) {
+        size_t off = rng() % (expected.size() + 1);
+        string s = to_string(i);
+        chain.insert(off, s);
+        expected.insert(off, s);
+        if (i % 3 == 0) {
+            size_t len = min((size_t) rng() % 1000, expected.size() - off);
+            chain.remove(off, len);
+            expected.erase(off, len);
+        }
+        chain.commit();
+    }
+
+    SECTION("Reading") {
+        REQUIRE(chain_equals(expected, chain));
+        string reversed;
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+            reversed.insert(0, (const char*) it->first, it->second);
+        }
+        REQUIRE(reversed == expected);
+        REQUIRE(string(chain.bytes().begin(), chain.bytes().end()) == expected);
+        REQUIRE(chain.read(1000, 300000) == expected.substr(1000, 300000));
+
+        // Byte iterators keep the window of their chunk mapped while lots of other windows are read
+        auto tail = chain.bytes(expected.size() - 10, 10);
+        auto first = tail.begin();
+        REQUIRE(*first == (unsigned char) expected[expected.size() - 10]);
+        auto haystack = chain.bytes(0, expected.size() / 2);
+        auto found = std::search(haystack.begin(), haystack.end(), first, tail.end());
+        REQUIRE(expected.substr(0, expected.size() / 2).find(expected.substr(expected.size() - 10)) == string::npos);
+        REQUIRE(found == haystack.end());
+        for (size_t off = 0; off < expected.size(); off += 65536 / 3) {
+            REQUIRE(chain.at(off) == (unsigned char) expected[off]);
+        }
+
+        const string needle = expected.substr(700000, 20);
+        REQUIRE(chain.find(needle) == expected.find(needle));
+        REQUIRE(chain.rfind(expected.substr(100, 20)) == expected.rfind(expected.substr(100, 20)));
+        check_lines(expected, chain);
+
+        string contents = chain.visit_parallel(0, chain.size(), string(),
+            [](string& acc, size_t, const unsigned char* data, size_t len) { acc.append((const char*) data, len); },
+            [](string acc, string chunk) { return acc + chunk; },
+            4
+        );
+        REQUIRE(contents == expected);
+
+        // Snapshots acquire windows from their own threads
+        Snapshot snap = chain.snapshot();
+        bool ok[4] = { false, false, false, false };
+        vector<thread> readers;
+        for (int t = 0; t < 4; ++t) {
+            readers.emplace_back([&, t] { ok[t] = to_string(snap) == expected; });
+        }
+        for (auto& t : readers) {
+            t.join();
+        }
+        for (int t = 0; t < 4; ++t) {
+            REQUIRE(ok[t]);
+        }
+    }
+
+    SECTION("Saving over the same file") {
+        chain.save("test8.txt", SaveMode::InPlace);
+        REQUIRE(chain_equals(expected, PieceChain("test8.txt")));
+
+        // The windows mapped later still show the contents the file had when it was opened
+        while (chain.undo());
+        REQUIRE(chain_equals(original, chain));
+
+        PieceChain other("test8.txt", options);
+        other.replace(100, "XYZ");
+        expected.replace(100, 3, "XYZ");
+        other.replace(900000, "!!");
+        expected.replace(900000, 2, "!!");
+        other.save("test8.txt", SaveMode::Incremental);
+        REQUIRE(chain_equals(expected, PieceChain("test8.txt")));
+        REQUIRE(chain_equals(expected, other));
+    }
+
+    SECTION("Saving in place keeps only the overwritten windows") {
+        PieceChain other("test8.txt", options);
+        string edited = original;
+        other.replace(100, "XYZ");
+        edited.replace(100, 3, "XYZ");
+        other.replace(900000, "!!");
+        edited.replace(900000, 2, "!!");
+        other.commit();
+        other.save("test8.txt", SaveMode::InPlace);
+        REQUIRE(chain_equals(edited, PieceChain("test8.txt")));
+        REQUIRE(other.stats().mapped_bytes <= (options.max_windows + 2) * 65536);
+
+        while (other.undo());
+        REQUIRE(chain_equals(original, other));
+        REQUIRE(other.stats().mapped_bytes <= (options.max_windows + 2) * 65536);
+    }
+}
+
+TEST_CASE("Opens descriptors and buffers", "[file]") {
+    SECTION("Descriptor") {
+        system("printf 'Test file contents\\n' > test10.txt");
+        int fd = open("test10.txt", O_RDONLY);
+        REQUIRE(fd >= 0);
+        PieceChain chain = PieceChain::from_fd(fd);
+        close(fd);
+        REQUIRE(chain_equals("Test file contents\n", chain));
+
+        // Saving over the same file still recognizes it
+        chain.insert(0, "More ");
+        chain.save("test10.txt", SaveMode::InPlace);
+        REQUIRE(chain_equals("More Test file contents\n", PieceChain("test10.txt")));
+        chain.undo();
+        REQUIRE(chain_equals("Test file contents\n", chain));
+
+        REQUIRE_THROWS(PieceChain::from_fd(-1));
+    }
+
+    SECTION("Buffer") {
+        static const unsigned char data[] = "hello world";
+        int released = 0;
+        optional<Snapshot> snap;
+        {
+            PieceChain chain = PieceChain::from_buffer(data, 11, [&] { released++; });
+            REQUIRE(chain.view(0, 11) == string_view((const char*) data, 11));
+            chain.insert(5, ",");
+            REQUIRE(chain_equals("hello, world", chain));
+            snap = chain.snapshot();
+        }
+
+        // Snapshots keep the buffer alive
+        REQUIRE(released == 0);
+        REQUIRE(to_string(*snap) == "hello, world");
+        snap.reset();
+        REQUIRE(released == 1);
+
+        PieceChainOptions options = {};
+        options.line_index = true;
+        // Strings are adopted without copying their contents
+        string contents = "a\nb\n" + string(100, 'c');
+        const string expected = contents;
+        const char* ptr = contents.data();
+        PieceChain chain = PieceChain::from_buffer(std::move(contents), options);
+        REQUIRE(chain_equals(expected, chain));
+        REQUIRE(chain.line_to_offset(2) == 4);
+        REQUIRE(chain.view(0, 1)->data() == ptr);
+    }
+
+    SECTION("Empty buffer") {
+        bool released = false;
+        {
+            PieceChain chain = PieceChain::from_buffer(nullptr, 0, [&] { released = true; });
+            REQUIRE(chain.size() == 0);
+            chain.insert(0, "abc");
+            REQUIRE(chain_equals("abc", chain));
+        }
+        REQUIRE(released);
+    }
+}
+
+TEST_CASE("Journal", "[file]") {
+    system("printf 'Hello world' > test11.txt");
+    unlink("test11.journal");
+
+    // Edits of all kinds, undo and some uncommitted changes
+    {
+        PieceChain chain = PieceChain::with_journal("test11.txt", "test11.journal");
+        chain.insert(5, ",");
+        chain.commit();
+        chain.insert(12, "!");
+        chain.commit();
+        chain.replace(0, "J", 1);
+        chain.commit();
+        PieceChainEdit edits[] = { { 0, 1, (const unsigned char*) "h", 1 }, { 7, 5, (const unsigned char*) "there", 5 } };
+        chain.apply(edits, 2);
+        chain.remove(0, 7);
+        chain.commit();
+        chain.undo();
+        chain.undo();
+        chain.redo();
+        REQUIRE(chain_equals("hello, there!", chain));
+    }
+
+    PieceChain chain = PieceChain::with_journal("test11.txt", "test11.journal");
+    REQUIRE(chain.dirty());
+    REQUIRE(chain_equals("hello, there!", chain));
+    REQUIRE(chain_equals("Hello world", PieceChain("test11.txt")));
+
+    // The history comes back too, with undo and redo as edits of their own
+    const vector<string> history = {
+        "Jello, world!", "hello, there!", "there!", "hello, there!", "Jello, world!", "Hello, world!", "Hello, world", "Hello world"
+    };
+    for (auto& state : history) {
+        REQUIRE(chain.undo());
+        REQUIRE(chain_equals(state, chain));
+    }
+    REQUIRE_FALSE(chain.undo());
+    while (chain.redo());
+    REQUIRE(chain_equals("hello, there!", chain));
+
+    // A write torn by a crash is dropped, and the journal keeps working after it
+    chain.insert(0, ">", 1);
+    chain.commit();
+    chain = PieceChain();
+    {
+        int fd = open("test11.journal", O_WRONLY | O_APPEND);
+        REQUIRE(fd >= 0);
+        REQUIRE(write(fd, "I\x01\x02", 3) == 3);
+        close(fd);
+    }
+    chain = PieceChain::with_journal("test11.txt", "test11.journal");
+    REQUIRE(chain_equals(">hello, there!", chain));
+    chain.insert(chain.size(), "<", 1);
+    chain.commit();
+    chain = PieceChain::with_journal("test11.txt", "test11.journal");
+    REQUIRE(chain_equals(">hello, there!<", chain));
+
+    // Saving restarts the journal from the saved file
+    chain.save("test11.txt");
+    chain.remove(0, 1);
+    chain.commit();
+    chain.undo();
+    chain.undo();
+    REQUIRE(chain_equals(">hello, there!", chain));
+    chain = PieceChain::with_journal("test11.txt", "test11.journal");
+    REQUIRE(chain_equals(">hello, there!", chain));
+    REQUIRE(chain.undo());
+    REQUIRE(chain_equals(">hello, there!<", chain));
+    REQUIRE(chain.undo());
+    REQUIRE(chain_equals("hello, there!<", chain));
+
+    // A journal does not apply to a file changed behind its back
+    chain = PieceChain();
+    system("printf 'Something else' > test11.txt");
+    REQUIRE_THROWS(PieceChain::with_journal("test11.txt", "test11.journal"));
+}